@@ -0,0 +1,802 @@
+// Benchmarks of each stage of the tracing pipeline.
+// Fonts and images are generated, so no assets or network are needed.
+// Every result is printed to stdout as one JSON object per line.
+#define GIKO_BENCH
+#include "../src/giko.c"
+#include <getopt.h>
+#include <time.h>
+
+#define DEFAULT_MIN_SECONDS 0.1
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+#define BENCH_FIRST_CODEPOINT 0x20
+#define MAX_BENCH_GLYPHS 800
+#define CROP_IMAGE_SIZE 512
+#define TRACE_GLYPH_SIZE 24
+#define FRAMES_IMAGE_SIZE 512
+#define FRAMES_CHARSET 256
+#define NUM_FRAMES 16
+#define INKED_MIN_PERCENT 10 // Set pixels of similarity patches
+#define INKED_MAX_PERCENT 50
+
+typedef void (*bench_function_t)(void *context);
+
+typedef struct {
+    long long iterations;
+    double ns_per_op;
+    double comparisons_per_op;
+    double comparisons_per_sec;
+} bench_result_t;
+
+typedef struct {
+    char *font_path;
+    giko_codepoint_t *charset;
+    int glyph_size;
+} glyph_map_bench_t;
+
+typedef struct {
+    giko_bitmap_t *image;
+    int glyph_size;
+    uint64_t state;
+} crop_bench_t;
+
+typedef struct {
+    giko_glyph_map_t *map;
+    giko_bitmap_t **patches; // Reference patch of each glyph's advance
+    int glyph;
+} similarity_bench_t;
+
+typedef struct {
+    giko_bitmap_t *image;
+    giko_glyph_map_t *map;
+    giko_trace_options_t options;
+} trace_bench_t;
+
+typedef struct {
+    giko_graymap_t *image;
+    giko_glyph_map_t *map;
+    giko_trace_options_t options;
+} gray_bench_t;
+
+typedef struct {
+    giko_bitmap_t **frames;
+    int frame;
+    giko_glyph_map_t *map;
+    giko_trace_options_t options;
+    giko_frame_tracer_t *tracer; // NULL to trace every frame from scratch
+} frames_bench_t;
+
+// Function prototypes
+uint64_t next_random(uint64_t *state);
+int write_bench_font(char *filepath, int glyph_size, int num_glyphs,
+                     int monospace);
+void draw_disc(uint8_t *pixels, int width, int height, int cx, int cy,
+               int radius);
+void draw_stroke(uint8_t *pixels, int width, int height, int x0, int y0,
+                 int x1, int y1, int thickness);
+giko_bitmap_t *new_bench_bitmap(uint8_t *pixels, int width, int height);
+giko_bitmap_t *new_bench_image(int width, int height, uint64_t seed);
+void draw_bench_art(uint8_t *pixels, int width, int height, uint64_t seed);
+giko_bitmap_t **new_bench_frames(int size, int count, uint64_t seed);
+giko_bitmap_t *crop_inked_patch(giko_bitmap_t *image, int width, int height);
+giko_graymap_t *new_bench_graymap(int width, int height, uint64_t seed);
+giko_codepoint_t *new_bench_charset(int num_glyphs);
+double now_ns(void);
+bench_result_t run_bench(bench_function_t function, void *context,
+                         double min_seconds);
+void print_result(const char *stage, const char *parameters,
+                  bench_result_t result);
+int cubic(int x);
+void bench_glyph_map(void *context);
+void bench_crop(void *context);
+void bench_similarity(void *context);
+void bench_trace(void *context);
+void bench_frames(void *context);
+void bench_gray(void *context);
+int discard_row(const giko_row_t *row, void *user_data);
+void print_usage(const char *program_name);
+
+static const int charset_sizes[] = {95, 128, 256, 512, 800};
+static const int glyph_sizes[] = {16, 32};
+static const int image_sizes[] = {128, 256, 512};
+static const int shortlist_sizes[] = {0, 8, 16, 32, 64};
+static const float greed_settings[][2] = {
+    {0.5, 0.5}, // chunk_greed, glyph_greed
+    {0.75, 0.9},
+    {1.0, 1.0},
+};
+
+#define COUNT(array) (int)(sizeof(array) / sizeof(array[0]))
+
+int main(int argc, char *argv[]) {
+    double min_seconds = DEFAULT_MIN_SECONDS;
+    char *stage = NULL;
+
+    static struct option long_options[] = {
+        {"min-time", required_argument, 0, 't'},
+        {"stage", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "t:s:h", long_options,
+                              &option_index)) != -1) {
+        switch (opt) {
+        case 't':
+            min_seconds = atof(optarg);
+            if (min_seconds <= 0) {
+                fprintf(stderr, "Error: --min-time must be positive.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            stage = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char directory[] = "/tmp/giko-bench-XXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("Error creating font directory");
+        return EXIT_FAILURE;
+    }
+    // Every path is named first, so failures can remove whichever were
+    // written
+    int result = EXIT_FAILURE;
+    char font_paths[COUNT(glyph_sizes)][64];
+    char trace_font_path[64];
+    char mono_font_path[64];
+    for (int i = 0; i < COUNT(glyph_sizes); i++) {
+        snprintf(font_paths[i], sizeof(font_paths[i]), "%s/bench%d.bdf",
+                 directory, glyph_sizes[i]);
+    }
+    snprintf(trace_font_path, sizeof(trace_font_path), "%s/bench%d.bdf",
+             directory, TRACE_GLYPH_SIZE);
+    snprintf(mono_font_path, sizeof(mono_font_path), "%s/mono%d.bdf",
+             directory, TRACE_GLYPH_SIZE);
+
+    for (int i = 0; i < COUNT(glyph_sizes); i++) {
+        if (write_bench_font(font_paths[i], glyph_sizes[i], MAX_BENCH_GLYPHS,
+                             0))
+            goto cleanup;
+    }
+    if (write_bench_font(trace_font_path, TRACE_GLYPH_SIZE, MAX_BENCH_GLYPHS,
+                         0) ||
+        write_bench_font(mono_font_path, TRACE_GLYPH_SIZE, MAX_BENCH_GLYPHS,
+                         1))
+        goto cleanup;
+
+    char parameters[256];
+    const char *engine = giko_engine_name(giko_get_engine());
+
+    // Rasterising and packing glyph maps
+    if (!stage || strcmp(stage, "glyph_map") == 0) {
+        for (int i = 0; i < COUNT(charset_sizes); i++) {
+            for (int j = 0; j < COUNT(glyph_sizes); j++) {
+                glyph_map_bench_t context = {
+                    font_paths[j], new_bench_charset(charset_sizes[i]),
+                    glyph_sizes[j]};
+                bench_result_t result =
+                    run_bench(bench_glyph_map, &context, min_seconds);
+                snprintf(parameters, sizeof(parameters),
+                         "\"charset\":%d,\"glyph_size\":%d", charset_sizes[i],
+                         glyph_sizes[j]);
+                print_result("glyph_map", parameters, result);
+                free(context.charset);
+            }
+        }
+    }
+
+    // Copying patches out of an image
+    if (!stage || strcmp(stage, "crop") == 0) {
+        giko_bitmap_t *image =
+            new_bench_image(CROP_IMAGE_SIZE, CROP_IMAGE_SIZE, BENCH_SEED);
+        for (int j = 0; j < COUNT(glyph_sizes); j++) {
+            crop_bench_t context = {image, glyph_sizes[j], BENCH_SEED};
+            bench_result_t result = run_bench(bench_crop, &context, min_seconds);
+            snprintf(parameters, sizeof(parameters),
+                     "\"glyph_size\":%d,\"image\":\"%dx%d\"", glyph_sizes[j],
+                     CROP_IMAGE_SIZE, CROP_IMAGE_SIZE);
+            print_result("crop", parameters, result);
+        }
+        giko_free_bitmap(image);
+    }
+
+    // Comparing one patch against one glyph, with every supported engine
+    if (!stage || strcmp(stage, "similarity") == 0) {
+        giko_engine_t active = giko_get_engine();
+        giko_bitmap_t *image =
+            new_bench_image(CROP_IMAGE_SIZE, CROP_IMAGE_SIZE, BENCH_SEED);
+        for (int j = 0; j < COUNT(glyph_sizes); j++) {
+            giko_codepoint_t *charset = new_bench_charset(MAX_BENCH_GLYPHS);
+            giko_glyph_map_t *map = giko_new_glyph_map(
+                font_paths[j], charset, glyph_sizes[j], NONE, NULL);
+            free(charset);
+            if (!map)
+                goto cleanup;
+            giko_bitmap_t **advance_patches =
+                calloc(map->num_advances, sizeof(giko_bitmap_t *));
+            giko_bitmap_t **patches =
+                calloc(map->num_glyphs, sizeof(giko_bitmap_t *));
+            for (int advance = 0; advance < map->num_advances; advance++) {
+                glyph_bucket_t bucket = map->buckets[advance];
+                if (bucket.count == 0)
+                    continue;
+                // Blank patches return before any kernel runs
+                advance_patches[advance] =
+                    crop_inked_patch(image, advance, map->em_height);
+                if (!advance_patches[advance]) {
+                    fprintf(stderr,
+                            "Error: no patch of the bench image is %d to %d "
+                            "percent set at advance %d\n",
+                            INKED_MIN_PERCENT, INKED_MAX_PERCENT, advance);
+                    goto cleanup;
+                }
+                for (int i = 0; i < bucket.count; i++) {
+                    patches[bucket.start + i] = advance_patches[advance];
+                }
+            }
+
+            for (giko_engine_t e = ENGINE_AUTO; e <= ENGINE_AVX512; e++) {
+                if (e != ENGINE_AUTO && !engine_kernel(e))
+                    continue;
+                giko_set_engine(e);
+                similarity_bench_t context = {map, patches, 0};
+                bench_result_t result =
+                    run_bench(bench_similarity, &context, min_seconds);
+                snprintf(parameters, sizeof(parameters),
+                         "\"glyph_size\":%d,\"engine\":\"%s\"", glyph_sizes[j],
+                         giko_engine_name(e));
+                print_result("similarity", parameters, result);
+            }
+            giko_set_engine(active);
+
+            for (int advance = 0; advance < map->num_advances; advance++) {
+                if (advance_patches[advance])
+                    giko_free_bitmap(advance_patches[advance]);
+            }
+            free(advance_patches);
+            free(patches);
+            giko_free_glyph_map(map);
+        }
+        giko_free_bitmap(image);
+    }
+
+    // Tracing whole images
+    if (!stage || strcmp(stage, "trace") == 0) {
+        for (int i = 0; i < COUNT(charset_sizes); i++) {
+            giko_codepoint_t *charset = new_bench_charset(charset_sizes[i]);
+            giko_glyph_map_t *map = giko_new_glyph_map(
+                trace_font_path, charset, TRACE_GLYPH_SIZE, NONE, NULL);
+            free(charset);
+            if (!map)
+                goto cleanup;
+
+            for (int k = 0; k < COUNT(image_sizes); k++) {
+                giko_bitmap_t *image = new_bench_image(
+                    image_sizes[k], image_sizes[k], BENCH_SEED + k);
+                for (int g = 0; g < COUNT(greed_settings); g++) {
+                    for (search_mode_t search = SEARCH_LINEAR;
+                         search <= SEARCH_BOUNDED; search++) {
+                        for (segmentation_t segmentation = SEGMENT_GREEDY;
+                             segmentation <= SEGMENT_OPTIMAL; segmentation++) {
+                            trace_bench_t context = {
+                                image, map, giko_default_trace_options()};
+                            context.options.chunk_greed = greed_settings[g][0];
+                            context.options.glyph_greed = greed_settings[g][1];
+                            context.options.fidelity_function = cubic;
+                            context.options.search = search;
+                            context.options.segmentation = segmentation;
+                            bench_result_t result =
+                                run_bench(bench_trace, &context, min_seconds);
+                            snprintf(
+                                parameters, sizeof(parameters),
+                                "\"charset\":%d,\"glyph_size\":%d,"
+                                "\"image\":\"%dx%d\",\"chunk_greed\":%.2f,"
+                                "\"glyph_greed\":%.2f,\"search\":\"%s\","
+                                "\"segmentation\":\"%s\",\"engine\":\"%s\"",
+                                charset_sizes[i], TRACE_GLYPH_SIZE,
+                                image_sizes[k], image_sizes[k],
+                                greed_settings[g][0], greed_settings[g][1],
+                                search == SEARCH_BOUNDED ? "bounded" : "linear",
+                                segmentation == SEGMENT_OPTIMAL ? "optimal"
+                                                                : "greedy",
+                                engine);
+                            print_result("trace", parameters, result);
+                        }
+                    }
+                }
+                giko_free_bitmap(image);
+            }
+            giko_free_glyph_map(map);
+        }
+    }
+
+    // Tracing with signature shortlists of each bucket, at full accuracy
+    if (!stage || strcmp(stage, "shortlist") == 0) {
+        char *shortlist_fonts[] = {trace_font_path, mono_font_path};
+        giko_bitmap_t *image = new_bench_image(256, 256, BENCH_SEED);
+        if (!image)
+            goto cleanup;
+        for (int f = 0; f < COUNT(shortlist_fonts); f++) {
+            giko_codepoint_t *charset = new_bench_charset(MAX_BENCH_GLYPHS);
+            giko_glyph_map_t *map = giko_new_glyph_map(
+                shortlist_fonts[f], charset, TRACE_GLYPH_SIZE, NONE, NULL);
+            free(charset);
+            if (!map)
+                goto cleanup;
+
+            for (int i = 0; i < COUNT(shortlist_sizes); i++) {
+                trace_bench_t context = {image, map,
+                                         giko_default_trace_options()};
+                context.options.chunk_greed = 1;
+                context.options.glyph_greed = 1;
+                context.options.fidelity_function = cubic;
+                context.options.shortlist = shortlist_sizes[i];
+                bench_result_t result =
+                    run_bench(bench_trace, &context, min_seconds);
+                snprintf(parameters, sizeof(parameters),
+                         "\"charset\":%d,\"glyph_size\":%d,"
+                         "\"font\":\"%s\",\"image\":\"256x256\","
+                         "\"shortlist\":%d,\"engine\":\"%s\"",
+                         MAX_BENCH_GLYPHS, TRACE_GLYPH_SIZE,
+                         f ? "monospace" : "proportional", shortlist_sizes[i],
+                         engine);
+                print_result("shortlist", parameters, result);
+            }
+            giko_free_glyph_map(map);
+        }
+        giko_free_bitmap(image);
+    }
+
+    // Tracing frame sequences, from scratch and reusing unchanged chunks
+    if (!stage || strcmp(stage, "frames") == 0) {
+        giko_codepoint_t *charset = new_bench_charset(FRAMES_CHARSET);
+        giko_glyph_map_t *map = giko_new_glyph_map(
+            trace_font_path, charset, TRACE_GLYPH_SIZE, NONE, NULL);
+        free(charset);
+        giko_bitmap_t **frames =
+            new_bench_frames(FRAMES_IMAGE_SIZE, NUM_FRAMES, BENCH_SEED);
+        if (!map || !frames)
+            goto cleanup;
+
+        for (int incremental = 0; incremental <= 1; incremental++) {
+            frames_bench_t context = {frames, 0, map,
+                                      giko_default_trace_options(), NULL};
+            context.options.fidelity_function = cubic;
+            if (incremental) {
+                context.tracer = giko_new_frame_tracer(map, &context.options);
+                if (!context.tracer)
+                    goto cleanup;
+            }
+            bench_result_t result =
+                run_bench(bench_frames, &context, min_seconds);
+            snprintf(parameters, sizeof(parameters),
+                     "\"charset\":%d,\"glyph_size\":%d,\"image\":\"%dx%d\","
+                     "\"mode\":\"%s\",\"engine\":\"%s\"",
+                     FRAMES_CHARSET, TRACE_GLYPH_SIZE, FRAMES_IMAGE_SIZE,
+                     FRAMES_IMAGE_SIZE, incremental ? "incremental" : "full",
+                     engine);
+            print_result("frames", parameters, result);
+            giko_free_frame_tracer(context.tracer);
+        }
+
+        for (int i = 0; i < NUM_FRAMES; i++) {
+            giko_free_bitmap(frames[i]);
+        }
+        free(frames);
+        giko_free_glyph_map(map);
+    }
+
+    // Tracing shaded images by glyph density
+    if (!stage || strcmp(stage, "gray") == 0) {
+        giko_codepoint_t *charset = new_bench_charset(FRAMES_CHARSET);
+        giko_glyph_map_t *map = giko_new_glyph_map(
+            trace_font_path, charset, TRACE_GLYPH_SIZE, NONE, NULL);
+        free(charset);
+        giko_graymap_t *image = new_bench_graymap(256, 256, BENCH_SEED);
+        if (!map || !image)
+            goto cleanup;
+
+        for (segmentation_t segmentation = SEGMENT_GREEDY;
+             segmentation <= SEGMENT_OPTIMAL; segmentation++) {
+            gray_bench_t context = {image, map, giko_default_trace_options()};
+            context.options.segmentation = segmentation;
+            bench_result_t result = run_bench(bench_gray, &context, min_seconds);
+            snprintf(parameters, sizeof(parameters),
+                     "\"charset\":%d,\"glyph_size\":%d,"
+                     "\"image\":\"256x256\",\"segmentation\":\"%s\","
+                     "\"engine\":\"%s\"",
+                     FRAMES_CHARSET, TRACE_GLYPH_SIZE,
+                     segmentation == SEGMENT_OPTIMAL ? "optimal" : "greedy",
+                     engine);
+            print_result("gray", parameters, result);
+        }
+        giko_free_graymap(image);
+        giko_free_glyph_map(map);
+    }
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    for (int i = 0; i < COUNT(glyph_sizes); i++) {
+        remove(font_paths[i]);
+    }
+    remove(trace_font_path);
+    remove(mono_font_path);
+    rmdir(directory);
+    return result;
+}
+
+// xorshift64*, so every run sees the same fonts and images
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Write a BDF font of stroke-like glyphs. The first glyph is an empty space,
+// the rest have advances between half and all of the glyph size, or half of
+// it for monospace fonts.
+int write_bench_font(char *filepath, int glyph_size, int num_glyphs,
+                     int monospace) {
+    FILE *file = fopen(filepath, "w");
+    if (!file) {
+        perror("Error opening font file");
+        return EXIT_FAILURE;
+    }
+
+    int ascent = glyph_size * 3 / 4;
+    int descent = glyph_size - ascent;
+    fprintf(file, "STARTFONT 2.1\n");
+    fprintf(file, "FONT -giko-bench-medium-r-normal--%d-%d-75-75-p-0-"
+                  "iso10646-1\n",
+            glyph_size, glyph_size * 10);
+    fprintf(file, "SIZE %d 75 75\n", glyph_size);
+    fprintf(file, "FONTBOUNDINGBOX %d %d 0 %d\n", glyph_size, glyph_size,
+            -descent);
+    fprintf(file, "STARTPROPERTIES 5\n");
+    fprintf(file, "PIXEL_SIZE %d\n", glyph_size);
+    fprintf(file, "FONT_ASCENT %d\n", ascent);
+    fprintf(file, "FONT_DESCENT %d\n", descent);
+    fprintf(file, "CHARSET_REGISTRY \"ISO10646\"\n");
+    fprintf(file, "CHARSET_ENCODING \"1\"\n");
+    fprintf(file, "ENDPROPERTIES\n");
+    fprintf(file, "CHARS %d\n", num_glyphs);
+
+    uint64_t state = BENCH_SEED ^ glyph_size;
+    uint8_t *pixels = malloc(glyph_size * glyph_size);
+    for (int i = 0; i < num_glyphs; i++) {
+        int advance = glyph_size / 2;
+        if (i > 0 && !monospace)
+            advance += next_random(&state) % (glyph_size / 2 + 1);
+        memset(pixels, 0, glyph_size * glyph_size);
+        int strokes = i == 0 ? 0 : 1 + next_random(&state) % 4;
+        for (int s = 0; s < strokes; s++) {
+            draw_stroke(pixels, advance, glyph_size,
+                        next_random(&state) % advance,
+                        next_random(&state) % glyph_size,
+                        next_random(&state) % advance,
+                        next_random(&state) % glyph_size,
+                        1 + next_random(&state) % (glyph_size / 8 + 1));
+        }
+
+        fprintf(file, "STARTCHAR u%04X\n", BENCH_FIRST_CODEPOINT + i);
+        fprintf(file, "ENCODING %d\n", BENCH_FIRST_CODEPOINT + i);
+        fprintf(file, "SWIDTH %d 0\n", advance * 1000 / glyph_size);
+        fprintf(file, "DWIDTH %d 0\n", advance);
+        fprintf(file, "BBX %d %d 0 %d\n", advance, glyph_size, -descent);
+        fprintf(file, "BITMAP\n");
+        for (int y = 0; y < glyph_size; y++) {
+            for (int x = 0; x < advance; x += 8) {
+                int byte = 0;
+                for (int bit = 0; bit < 8 && x + bit < advance; bit++) {
+                    if (pixels[y * glyph_size + x + bit])
+                        byte |= 0x80 >> bit;
+                }
+                fprintf(file, "%02X", byte);
+            }
+            fprintf(file, "\n");
+        }
+        fprintf(file, "ENDCHAR\n");
+    }
+    fprintf(file, "ENDFONT\n");
+
+    free(pixels);
+    fclose(file);
+    return EXIT_SUCCESS;
+}
+
+void draw_disc(uint8_t *pixels, int width, int height, int cx, int cy,
+               int radius) {
+    for (int y = cy - radius; y <= cy + radius; y++) {
+        for (int x = cx - radius; x <= cx + radius; x++) {
+            int dx = x - cx;
+            int dy = y - cy;
+            if (x >= 0 && x < width && y >= 0 && y < height &&
+                dx * dx + dy * dy <= radius * radius)
+                pixels[y * width + x] = 1;
+        }
+    }
+}
+
+void draw_stroke(uint8_t *pixels, int width, int height, int x0, int y0,
+                 int x1, int y1, int thickness) {
+    int steps = abs(x1 - x0) > abs(y1 - y0) ? abs(x1 - x0) : abs(y1 - y0);
+    for (int step = 0; step <= steps; step++) {
+        int x = steps ? x0 + (x1 - x0) * step / steps : x0;
+        int y = steps ? y0 + (y1 - y0) * step / steps : y0;
+        draw_disc(pixels, width, height, x, y, thickness / 2);
+    }
+}
+
+// Pack one byte per pixel into a new bitmap
+giko_bitmap_t *new_bench_bitmap(uint8_t *pixels, int width, int height) {
+    int pitch = pitch_32bit(width);
+    uint8_t *data = calloc(pitch * height, sizeof(uint8_t));
+    if (!data) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (pixels[y * width + x])
+                data[y * pitch + x / 8] |= 0x80 >> (x % 8);
+        }
+    }
+    return giko_new_bitmap(width, height, data);
+}
+
+// Line art of strokes and dots, roughly as dense as a traced drawing
+giko_bitmap_t *new_bench_image(int width, int height, uint64_t seed) {
+    uint8_t *pixels = calloc(width * height, sizeof(uint8_t));
+    if (!pixels) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    draw_bench_art(pixels, width, height, seed);
+    giko_bitmap_t *image = new_bench_bitmap(pixels, width, height);
+    free(pixels);
+    return image;
+}
+
+// First patch of the image, in reading order on a grid of its own size, with
+// between INKED_MIN_PERCENT and INKED_MAX_PERCENT of its pixels set, like
+// the strokes a trace compares glyphs with. Returns NULL if there is none.
+giko_bitmap_t *crop_inked_patch(giko_bitmap_t *image, int width, int height) {
+    int area = width * height;
+    for (int y = 0; y + height <= image->height; y += height) {
+        for (int x = 0; x + width <= image->width; x += width) {
+            giko_bitmap_t *patch = giko_crop_bitmap(image, x, y, width, height);
+            if (!patch)
+                return NULL;
+            int set = 0;
+            for (int byte = 0; byte < patch->pitch * patch->height; byte++) {
+                set += set_bits[patch->data[byte]];
+            }
+            if (set * 100 >= area * INKED_MIN_PERCENT &&
+                set * 100 <= area * INKED_MAX_PERCENT)
+                return patch;
+            giko_free_bitmap(patch);
+        }
+    }
+    return NULL;
+}
+
+void draw_bench_art(uint8_t *pixels, int width, int height, uint64_t seed) {
+    uint64_t state = seed;
+    int shapes = width * height / 2048;
+    for (int i = 0; i < shapes; i++) {
+        int x = next_random(&state) % width;
+        int y = next_random(&state) % height;
+        if (next_random(&state) % 4 == 0) {
+            draw_disc(pixels, width, height, x, y,
+                      1 + next_random(&state) % 6);
+        } else {
+            draw_stroke(pixels, width, height, x, y,
+                        x + (int)(next_random(&state) % 64) - 32,
+                        y + (int)(next_random(&state) % 64) - 32,
+                        1 + next_random(&state) % 3);
+        }
+    }
+}
+
+// Mostly static frames: the same line art with a ball moving across it
+giko_bitmap_t **new_bench_frames(int size, int count, uint64_t seed) {
+    giko_bitmap_t **frames = calloc(count, sizeof(giko_bitmap_t *));
+    uint8_t *background = calloc(size * size, sizeof(uint8_t));
+    uint8_t *pixels = malloc(size * size);
+    if (!frames || !background || !pixels) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    draw_bench_art(background, size, size, seed);
+    for (int i = 0; i < count; i++) {
+        memcpy(pixels, background, size * size);
+        draw_disc(pixels, size, size, size / 4 + i * size / (2 * count),
+                  size / 2, 8);
+        frames[i] = new_bench_bitmap(pixels, size, size);
+        if (!frames[i])
+            exit(EXIT_FAILURE);
+    }
+    free(background);
+    free(pixels);
+    return frames;
+}
+
+// Diagonal gradient with discs of random shades, like a shaded photograph
+giko_graymap_t *new_bench_graymap(int width, int height, uint64_t seed) {
+    int pitch = ((width + 31) / 32) * 32;
+    uint8_t *pixels = calloc((size_t)pitch * height, 1);
+    if (!pixels)
+        return NULL;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            pixels[y * pitch + x] = (x + y) * 255 / (width + height);
+        }
+    }
+    uint64_t state = seed;
+    for (int i = 0; i < 24; i++) {
+        int cx = next_random(&state) % width;
+        int cy = next_random(&state) % height;
+        int radius = 4 + next_random(&state) % (width / 6);
+        uint8_t shade = next_random(&state) % 256;
+        for (int y = cy - radius; y <= cy + radius; y++) {
+            for (int x = cx - radius; x <= cx + radius; x++) {
+                if (x >= 0 && y >= 0 && x < width && y < height &&
+                    (x - cx) * (x - cx) + (y - cy) * (y - cy) <=
+                        radius * radius)
+                    pixels[y * pitch + x] = shade;
+            }
+        }
+    }
+    giko_graymap_t *graymap = giko_new_graymap(width, height, pixels);
+    if (!graymap)
+        free(pixels);
+    return graymap;
+}
+
+giko_codepoint_t *new_bench_charset(int num_glyphs) {
+    giko_codepoint_t *charset =
+        malloc((num_glyphs + 1) * sizeof(giko_codepoint_t));
+    if (!charset) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_glyphs; i++) {
+        charset[i] = BENCH_FIRST_CODEPOINT + i;
+    }
+    charset[num_glyphs] = TERMINAL_CODEPOINT;
+    return charset;
+}
+
+double now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// Run a benchmark in doubling batches until it has taken min_seconds
+bench_result_t run_bench(bench_function_t function, void *context,
+                         double min_seconds) {
+    // Warm up caches and the lazily selected engine
+    function(context);
+
+    long long iterations = 0;
+    long long batch = 1;
+    double elapsed = 0;
+    uint64_t comparisons = __atomic_load_n(&bench_comparisons, __ATOMIC_RELAXED);
+    while (elapsed < min_seconds * 1e9) {
+        double start = now_ns();
+        for (long long i = 0; i < batch; i++) {
+            function(context);
+        }
+        elapsed += now_ns() - start;
+        iterations += batch;
+        batch *= 2;
+    }
+    comparisons =
+        __atomic_load_n(&bench_comparisons, __ATOMIC_RELAXED) - comparisons;
+
+    bench_result_t result;
+    result.iterations = iterations;
+    result.ns_per_op = elapsed / iterations;
+    result.comparisons_per_op = (double)comparisons / iterations;
+    result.comparisons_per_sec = comparisons / (elapsed / 1e9);
+    return result;
+}
+
+void print_result(const char *stage, const char *parameters,
+                  bench_result_t result) {
+    printf("{\"stage\":\"%s\",%s,\"iterations\":%lld,\"ns_per_op\":%.1f,"
+           "\"comparisons_per_op\":%.1f,\"comparisons_per_sec\":%.0f}\n",
+           stage, parameters, result.iterations, result.ns_per_op,
+           result.comparisons_per_op, result.comparisons_per_sec);
+    fflush(stdout);
+}
+
+int cubic(int x) { return x * x * x; }
+
+void bench_glyph_map(void *context) {
+    glyph_map_bench_t *bench = context;
+    giko_glyph_map_t *map = giko_new_glyph_map(
+        bench->font_path, bench->charset, bench->glyph_size, NONE, NULL);
+    if (!map)
+        exit(EXIT_FAILURE);
+    giko_free_glyph_map(map);
+}
+
+void bench_crop(void *context) {
+    crop_bench_t *bench = context;
+    int range = bench->image->width - bench->glyph_size;
+    int x = next_random(&bench->state) % range;
+    int y = next_random(&bench->state) % range;
+    giko_bitmap_t *patch = giko_crop_bitmap(bench->image, x, y,
+                                            bench->glyph_size, bench->glyph_size);
+    giko_free_bitmap(patch);
+}
+
+// Compare the next glyph of the map against the patch of its advance
+void bench_similarity(void *context) {
+    similarity_bench_t *bench = context;
+    giko_glyph_map_t *map = bench->map;
+    int glyph = bench->glyph;
+    bitmap_similarity(bench->patches[glyph], map->atlas + map->offsets[glyph],
+                      map->set_pixels[glyph], DEFAULT_NOISE_THRESHOLD, cubic);
+    bench->glyph = (glyph + 1) % map->num_glyphs;
+}
+
+void bench_trace(void *context) {
+    trace_bench_t *bench = context;
+    giko_codepoint_t *art =
+        giko_trace_art_str(bench->image, bench->map, &bench->options);
+    if (!art)
+        exit(EXIT_FAILURE);
+    free(art);
+}
+
+// Trace the next frame of the sequence, looping back to the first
+void bench_frames(void *context) {
+    frames_bench_t *bench = context;
+    giko_bitmap_t *frame = bench->frames[bench->frame];
+    bench->frame = (bench->frame + 1) % NUM_FRAMES;
+    if (bench->tracer) {
+        if (giko_trace_frame(bench->tracer, frame, discard_row, NULL))
+            exit(EXIT_FAILURE);
+        return;
+    }
+    if (giko_trace_rows(frame, bench->map, &bench->options, discard_row, NULL))
+        exit(EXIT_FAILURE);
+}
+
+void bench_gray(void *context) {
+    gray_bench_t *bench = context;
+    giko_codepoint_t *art =
+        giko_trace_graymap_str(bench->image, bench->map, &bench->options);
+    if (!art)
+        exit(EXIT_FAILURE);
+    free(art);
+}
+
+int discard_row(const giko_row_t *row, void *user_data) {
+    (void)row;
+    (void)user_data;
+    return EXIT_SUCCESS;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -h, --help                    Print this message\n");
+    printf("  -t, --min-time SECONDS        Minimum time spent on each "
+           "benchmark (default: 0.1)\n");
+    printf("  -s, --stage NAME              Only run one stage: glyph_map, "
+           "crop, similarity, trace, shortlist, frames, gray\n");
+}
@@ -6,11 +6,14 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 // Default arguments
 #define DEFAULT_GLYPH_SIZE 16
 #define DEFAUKT_CHUNK_GREED 0.5
 #define DEFAULT_GLYPH_GREED 0.8
+#define DEFAULT_NOISE_THRESHOLD 0.05
+#define DEFAULT_NUM_THREADS 1
 
 // Types
 typedef struct giko_bitmap {
@@ -39,12 +42,212 @@ typedef struct giko_bitmap {
     int set_pixels; // Number of set bits in the data field.
 } giko_bitmap_t;
 
+typedef struct giko_bitmap_view {
+    const uint8_t *data; // First byte of the top-most row of the parent
+                         // bitmap covered by the view. Not owned by the view.
+
+    int bit_offset; // Pixel offset of the left-most column of the view from
+                    // the start of each row in data.
+
+    int stride; // Number of bytes between rows i.e. the parent's pitch.
+
+    int width; // Width of the view.
+
+    int height; // Height of the view.
+
+    int valid_width; // Number of columns that lie inside the parent bitmap.
+                     // Columns right of it read as unset (0) pixels.
+
+    int valid_height; // Number of rows that lie inside the parent bitmap.
+                      // Rows below it read as unset (0) pixels.
+} giko_bitmap_view_t;
+
+typedef struct giko_graymap {
+    int width; // Width of image i.e. number of pixels across
+
+    int pitch; // Number of bytes per row. A multiple of 32. If the width is
+               // not, the row is padded with 0 bytes.
+
+    int height; // Height of image.
+
+    uint8_t *data; // One byte per pixel, rows top to bottom. Each byte is
+                   // how much of the pixel is set, from 0 (unset) to 255
+                   // (set).
+} giko_graymap_t;
+
+// Colours of an image summed over bands of rows, one band per row of the
+// trace, so that the colour of any cell is the sum of its columns
+typedef struct giko_color_bands {
+    int width; // Width of image i.e. number of pixels across
+
+    int height; // Height of image.
+
+    int band_height; // Rows summed into each band, the em_height of the
+                     // glyph map the image is traced with. The last band
+                     // may be shorter.
+
+    uint32_t *sums; // Seven sums per column of each band, bands top to
+                    // bottom: red, green and blue each weighted by how much
+                    // the pixel is set, the total weight, then red, green
+                    // and blue unweighted.
+} giko_color_bands_t;
+
+// Asked by colour image reads for the height of the bands that the colours
+// are summed over, once the size of the image is known and before anything
+// is allocated or any row is decoded. Returns the em_height of the glyph map
+// the image will be traced with (see giko_glyph_map_em_height), or 0 to stop
+// the read. It is asked even if colours are not summed, so it can also
+// refuse images that are too large.
+typedef int (*giko_band_height_callback_t)(int width, int height,
+                                           void *user_data);
+
+typedef struct giko_color {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} giko_color_t;
+
+// One glyph map can be traced by any number of threads at once. Its glyphs
+// are not changed once rasterized. Lazy maps rasterize each advance's glyphs
+// on first use, behind a lock of the map. The blurred glyphs of graymap
+// traces are set once, by a compare-and-swap.
 typedef struct giko_glyph_map giko_glyph_map_t;
 
+// Shared state for building glyph maps and tracing from many threads. See
+// giko_new_context.
+typedef struct giko_context giko_context_t;
+
+typedef struct giko_frame_tracer giko_frame_tracer_t;
+
 typedef uint32_t giko_codepoint_t;
 
 typedef enum { NONE, ASCENDING, DESCENDING } sort_order_t;
 
+typedef enum {
+    SEARCH_LINEAR, // Compare glyphs in glyph map order
+    SEARCH_BOUNDED // Skip glyphs and advances whose best possible similarity,
+                   // bounded by set pixel counts, cannot beat the best match.
+                   // Gives the same result as SEARCH_LINEAR, and is much
+                   // faster when glyph_greed is high.
+} search_mode_t;
+
+typedef enum {
+    SEGMENT_GREEDY, // Trace each row left to right, taking the widest advance
+                    // whose best match reaches chunk_greed.
+    SEGMENT_OPTIMAL // Choose the glyphs of each row that maximise the total
+                    // similarity, weighted by the columns each glyph covers.
+                    // chunk_greed is not used. Slower than SEGMENT_GREEDY,
+                    // and frames are traced without reusing matches.
+} segmentation_t;
+
+// Where the time of glyph map builds and traces goes. Times are in
+// nanoseconds of a monotonic clock, and are summed over every thread tracing,
+// so stage times can add up to more than trace_ns. Every field is added to,
+// so one giko_stats_t can gather several calls. Zero it before the first.
+typedef struct giko_stats {
+    uint64_t charset_ns;    // Loading charsets. Timed by the caller, e.g.
+                            // with giko_stats_clock.
+    uint64_t decode_ns;     // Decoding reference images. Timed by the caller.
+    uint64_t rasterize_ns;  // FreeType loading and rendering of glyphs
+    uint64_t pack_ns;       // Packing rendered glyphs into the glyph map
+    uint64_t crop_ns;       // Summing the bands of bitmaps, or blurring
+                            // graymaps, before their patches are cut
+    uint64_t similarity_ns; // The rest of each row: cutting patches and
+                            // comparing them with glyphs. Rows are timed
+                            // whole, not patch by patch.
+    uint64_t output_ns;     // Encoding rows and running the row callback
+    uint64_t trace_ns;      // Whole traces, from start to the last row
+
+    uint64_t glyphs_rasterized; // Glyphs rendered into glyph maps
+    uint64_t rows_traced;
+    uint64_t similarity_calls;  // Glyphs compared with a patch
+    uint64_t glyph_greed_exits; // Searches of an advance ended by a glyph
+                                // reaching glyph_greed
+    uint64_t chunk_greed_exits; // Chunks whose narrower advances were not
+                                // searched, as a match reached chunk_greed
+    uint64_t bytes_allocated;   // Heap memory requested by glyph map builds
+                                // and traces, not counting what is returned
+} giko_stats_t;
+
+typedef struct giko_trace_options {
+    float chunk_greed; // See giko_new_art_str.
+
+    float glyph_greed; // See giko_new_art_str.
+
+    float noise_threshold; // See giko_new_art_str.
+
+    int (*fidelity_function)(int); // See giko_new_art_str.
+
+    int num_threads; // Number of worker threads tracing rows in parallel.
+                     // Set to 0 to use one thread per online CPU.
+
+    search_mode_t search; // How glyphs are searched for the best match.
+                          // SEARCH_BOUNDED requires a non-decreasing
+                          // fidelity function.
+
+    segmentation_t segmentation; // How each row is split into glyphs.
+
+    int shortlist; // Only compare the `shortlist` glyphs of each advance
+                   // whose coarse density grids are closest to the patch's.
+                   // Much faster with large charsets, but may miss the best
+                   // match. Set to 0 to compare every glyph.
+
+    const giko_color_bands_t *colors; // Colours of the reference, the same
+                                      // size as it and banded by the map's
+                                      // em_height, e.g. from
+                                      // giko_load_color_image. If set, the
+                                      // colour of each glyph's cell is handed
+                                      // to the row callback. Not used by
+                                      // frame tracers. NULL by default.
+
+    giko_stats_t *stats; // Added to by every trace with these options, or
+                         // NULL to not measure traces. NULL by default.
+                         // Measuring adds a clock read per patch and search.
+
+    giko_context_t *context; // If set, scratch buffers are taken from the
+                             // context and returned to it after the trace,
+                             // instead of being allocated by every trace.
+                             // NULL by default.
+} giko_trace_options_t;
+
+typedef struct giko_row {
+    int index; // Row number, 0 being the top row.
+
+    const giko_codepoint_t *codepoints; // Codepoints of the row, ending with
+                                        // a line feed. Only valid during the
+                                        // callback.
+
+    int length; // Number of codepoints.
+
+    const uint8_t *utf8; // The codepoints encoded as UTF-8 (not terminated).
+                         // Only valid during the callback.
+
+    int utf8_length; // Number of bytes in utf8.
+
+    const int *advances; // Width in pixels of the cell of each codepoint, 0
+                         // for the line feed. Only valid during the
+                         // callback.
+
+    const giko_color_t *colors; // Colour of each codepoint's cell, or NULL
+                                // if the options have no colors. The cell's
+                                // set pixels are averaged, weighted by how
+                                // much they are set, or every pixel if none
+                                // are. Only valid during the callback.
+} giko_row_t;
+
+// Called with each traced row. Return 0 to continue tracing.
+typedef int (*giko_row_callback_t)(const giko_row_t *row, void *user_data);
+
+typedef enum {
+    ENGINE_AUTO,   // ENGINE_WORD for small bitmaps, the widest engine
+                   // supported by the CPU for larger ones
+    ENGINE_LUT,    // Portable 256-entry byte lookup table
+    ENGINE_WORD,   // 64 bit words (popcnt instruction when available)
+    ENGINE_AVX2,   // 256 bit nibble lookup (x86 AVX2). Graymaps are
+                   // compared with vpsadbw by both AVX engines.
+    ENGINE_AVX512, // 512 bit vpopcntq (x86 AVX-512 VPOPCNTDQ)
+} giko_engine_t;
+
 // Main functions
 
 /*
@@ -82,15 +285,51 @@ Input:
                                 number of set pixels.
                                 DESCENDING sorts the glyphs by most to least
                                 number of set pixels.
-                                NONE adds glyphs to the map without sorting.
+                                NONE keeps the glyphs in charset order.
+                                Glyphs with equal counts keep charset order.
+
+    giko_stats_t *stats:        Added to with the time spent rasterizing and
+                                packing glyphs, or NULL.
 
 Output:
-    - Returns a giko_glyph_map_t.
+    - Returns a giko_glyph_map_t, which may be traced by several threads at
+      once. Its glyphs never change, but the first graymap trace keeps their
+      blurred copy with the map, set once by a compare-and-swap.
+    - Large charsets are rasterized by several threads, each with a face of
+      its own. The map is the same for any number of threads.
     - Returns NULL if an error is encountered. Errors printed to stderr.
  */
 giko_glyph_map_t *giko_new_glyph_map(char *ttf_filepath,
                                      giko_codepoint_t *charset, int glyph_size,
-                                     sort_order_t order);
+                                     sort_order_t order, giko_stats_t *stats);
+
+/*
+ Generates a glyph map like giko_new_glyph_map, but only loads the outline
+ and advance of each glyph up front. The glyphs of an advance are rasterized
+ the first time a trace searches them, so traces start sooner and glyphs of
+ advances never searched are never rasterized.
+
+Input:
+    See giko_new_glyph_map. stats is only added to with the time spent loading
+    glyphs. Glyphs rasterized later are added to the stats of the trace that
+    searched them.
+
+Output:
+    - Returns a giko_glyph_map_t. Traces of the map are identical to traces of
+      giko_new_glyph_map's, and it may be traced by several threads at once.
+    - Rendering, graymap traces and giko_save_glyph_map use every glyph, so
+      rasterize every glyph not rasterized yet.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_glyph_map_t *giko_new_lazy_glyph_map(char *ttf_filepath,
+                                          giko_codepoint_t *charset,
+                                          int glyph_size, sort_order_t order,
+                                          giko_stats_t *stats);
+
+/*
+ Height in pixels of the glyphs of a map, and so of each row traced with it.
+ */
+int giko_glyph_map_em_height(const giko_glyph_map_t *map);
 
 /*
  Generates an ascii_art string from a reference bitmap and a glyph map.
@@ -131,6 +370,9 @@ Input:
                                 Set to NULL for the default function
                                 (default is quadratic i.e. f(x) = x * x).
 
+    giko_stats_t *stats:        Added to with the time and counters of the
+                                trace, or NULL.
+
 Output:
     - Returns an array of giko_codepoint_t terminated with 0.
     - Returns NULL if an error is encountered. Errors printed to stderr.
@@ -138,7 +380,207 @@ Output:
 giko_codepoint_t *giko_new_art_str(giko_bitmap_t *reference,
                                    giko_glyph_map_t *map, float chunk_greed,
                                    float glyph_greed, float noise_threshold,
-                                   int (*fidelity_function)(int));
+                                   int (*fidelity_function)(int),
+                                   giko_stats_t *stats);
+
+/*
+ Get the default tracing options.
+
+Output:
+    - Returns a giko_trace_options_t filled with the DEFAULT_* values and the
+      default fidelity function.
+ */
+giko_trace_options_t giko_default_trace_options(void);
+
+/*
+ Generates an ascii_art string from a reference bitmap and a glyph map,
+ tracing rows in parallel. Rows are independent of each other, so the result
+ is identical to giko_new_art_str for any number of threads.
+
+Input:
+    giko_bitmap_t *reference:       Reference bitmap to be traced.
+
+    giko_glyph_map_t *map:          Glyph map used to trace the reference.
+                                    The map may be shared by concurrent
+                                    traces.
+
+    giko_trace_options_t *options:  Tracing options. Start from
+                                    giko_default_trace_options().
+
+Output:
+    - Returns an array of giko_codepoint_t terminated with 0.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_codepoint_t *giko_trace_art_str(giko_bitmap_t *reference,
+                                     giko_glyph_map_t *map,
+                                     const giko_trace_options_t *options);
+
+/*
+ Traces a reference bitmap like giko_trace_art_str, but hands each row to a
+ callback as soon as it and every row above it are traced, instead of
+ returning the whole string. Rows arrive in order on the calling thread.
+ Row buffers are reused, so memory stays flat however large the output is.
+
+Input:
+    giko_bitmap_t *reference:       Reference bitmap to be traced.
+
+    giko_glyph_map_t *map:          Glyph map used to trace the reference.
+
+    giko_trace_options_t *options:  Tracing options. With more than one
+                                    thread, workers trace at most two rows
+                                    per thread ahead of the callback.
+
+    giko_row_callback_t callback:   Called once per row, top to bottom.
+
+    void *user_data:                Passed to the callback.
+
+Output:
+    - Returns EXIT_SUCCESS once every row has been passed to the callback.
+    - Returns the callback's return value if it is not 0. No further rows
+      are traced.
+    - Returns EXIT_FAILURE if an error is encountered. Errors printed to
+      stderr.
+ */
+int giko_trace_rows(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                    const giko_trace_options_t *options,
+                    giko_row_callback_t callback, void *user_data);
+
+/*
+ Creates a tracer for a sequence of frames, such as the frames of an
+ animation or video. Matches are kept between frames, and chunks whose
+ reference pixels have not changed since the previous frame are not searched
+ again. The output of every frame is identical to giko_trace_rows.
+
+Input:
+    giko_glyph_map_t *map:          Glyph map used to trace every frame.
+                                    Must outlive the tracer.
+
+    giko_trace_options_t *options:  Tracing options, copied into the tracer.
+
+Output:
+    - Returns a pointer to a giko_frame_tracer_t.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_frame_tracer_t *giko_new_frame_tracer(giko_glyph_map_t *map,
+                                           const giko_trace_options_t *options);
+
+/*
+ Traces the next frame of a sequence, handing each row to a callback like
+ giko_trace_rows. Only chunks overlapping pixels that differ from the
+ previous frame are searched. A frame of a different size starts the
+ sequence over.
+
+Input:
+    giko_frame_tracer_t *tracer:    Tracer of the sequence.
+
+    giko_bitmap_t *frame:           Frame to be traced.
+
+    giko_row_callback_t callback:   Called once per row, top to bottom.
+
+    void *user_data:                Passed to the callback.
+
+Output:
+    - Returns EXIT_SUCCESS once every row has been passed to the callback.
+    - Returns the callback's return value if it is not 0.
+    - Returns EXIT_FAILURE if an error is encountered. Errors printed to
+      stderr.
+ */
+int giko_trace_frame(giko_frame_tracer_t *tracer, giko_bitmap_t *frame,
+                     giko_row_callback_t callback, void *user_data);
+
+/*
+    Free a frame tracer. The glyph map is not freed.
+Input:
+    giko_frame_tracer_t *tracer:    Tracer to be freed.
+
+Output:
+    - No output.
+ */
+void giko_free_frame_tracer(giko_frame_tracer_t *tracer);
+
+/*
+ Traces a graymap like giko_trace_rows. Instead of counting overlapping set
+ pixels, each glyph is compared with the patch by the sum of absolute
+ differences between its coverage and the patch's intensity. Both are box
+ blurred by an eighth of the glyph height first, and the reference is scaled
+ so that full intensity matches the coverage of the densest glyph. The
+ similarity is 1 minus the sum over the total intensity of both, which is the
+ Dice coefficient for a bilevel patch. Shades of grey are matched by glyphs of
+ similar density, so photographs need no dithering. The glyphs of a map are
+ blurred by its first graymap trace and kept with the map for later traces.
+
+Input:
+    giko_graymap_t *reference:      Reference graymap to be traced.
+
+    giko_glyph_map_t *map:          Glyph map used to trace the reference.
+
+    giko_trace_options_t *options:  Tracing options. fidelity_function,
+                                    search and shortlist are not used.
+
+    giko_row_callback_t callback:   Called once per row, top to bottom.
+
+    void *user_data:                Passed to the callback.
+
+Output:
+    - See giko_trace_rows.
+ */
+int giko_trace_graymap_rows(giko_graymap_t *reference, giko_glyph_map_t *map,
+                            const giko_trace_options_t *options,
+                            giko_row_callback_t callback, void *user_data);
+
+/*
+ Traces a graymap into one string. See giko_trace_graymap_rows.
+
+Output:
+    - Returns an array of giko_codepoint_t terminated with 0.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_codepoint_t *giko_trace_graymap_str(giko_graymap_t *reference,
+                                         giko_glyph_map_t *map,
+                                         const giko_trace_options_t *options);
+
+/*
+ Renders traced art back into a bitmap with the glyphs of the map it was
+ traced with. Each row is em_height pixels tall and each glyph is drawn
+ exactly as it was compared with the reference, so the result lines up
+ with the reference pixel for pixel.
+
+Input:
+    giko_codepoint_t *art:  Array of codepoints terminated with 0, e.g. from
+                            giko_trace_art_str.
+
+    giko_glyph_map_t *map:  Glyph map the art was traced with. Codepoints
+                            that are not in the map are skipped.
+
+    int width:              Width of the bitmap. Glyphs past it are clipped.
+                            Set to 0 to fit the widest row.
+
+    int height:             Height of the bitmap. Rows past it are clipped.
+                            Set to 0 to fit every row.
+
+Output:
+    - Returns a pointer to a giko_bitmap_t.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_bitmap_t *giko_render_art_str(giko_codepoint_t *art, giko_glyph_map_t *map,
+                                   int width, int height);
+
+/*
+ Measures how closely two bitmaps of the same size match, as the
+ intersection over union of their set pixels. A quality score of traced art
+ is the IoU of the reference and the art rendered by giko_render_art_str.
+
+Input:
+    giko_bitmap_t *a:   First bitmap.
+
+    giko_bitmap_t *b:   Second bitmap, the same size as a.
+
+Output:
+    - Returns the number of pixels set in both bitmaps over the number set in
+      either, from 0 to 1. Returns 1 if neither has set pixels.
+    - Returns -1 if the sizes differ. Errors printed to stderr.
+ */
+float giko_bitmap_iou(giko_bitmap_t *a, giko_bitmap_t *b);
 
 /*
     Converts a giko_codepoint_t to a utf8 byte sequence.
@@ -165,6 +607,26 @@ Output:
  */
 void giko_free_bitmap(giko_bitmap_t *bitmap);
 
+/*
+    Free a giko graymap.
+Input:
+    giko_graymap_t *graymap:  Graymap to be freed.
+
+Output:
+    - No output.
+ */
+void giko_free_graymap(giko_graymap_t *graymap);
+
+/*
+    Free the colour sums of an image.
+Input:
+    giko_color_bands_t *colors: Colour sums to be freed.
+
+Output:
+    - No output.
+ */
+void giko_free_color_bands(giko_color_bands_t *colors);
+
 /*
     Free a giko glyph map.
 Input:
@@ -209,11 +671,212 @@ Input:
     int width:              Height of the bounding box (projecting downward).
 
 Output:
-    - Set pixels become unset and unset pixels become set. Done in-place.
+    - Returns a pointer to a new giko_bitmap_t holding a copy of the patch.
+      Pixels outside of the bitmap are unset.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
  */
 giko_bitmap_t *giko_crop_bitmap(giko_bitmap_t *bitmap, int offset_x,
                                 int offset_y, int width, int height);
 
+/*
+    Get a non-owning view of a patch of a bitmap.
+    Unlike giko_crop_bitmap, nothing is allocated or copied. The view is only
+    valid while the bitmap is alive and unchanged.
+Input:
+    giko_bitmap_t *bitmap:  Bitmap to be viewed.
+    int offset_x:           X offset of the top-left corner of the bounding box
+                            (0 is the left-most column).
+    int offset_y:           Y offset of the top-left corner of the bounding box
+                            (0 is the top-most row).
+    int width:              Width of the bounding box (projecting rightwards).
+    int height:             Height of the bounding box (projecting downward).
+
+Output:
+    - Returns a giko_bitmap_view_t. Pixels outside of the bitmap read as unset.
+ */
+giko_bitmap_view_t giko_view_bitmap(giko_bitmap_t *bitmap, int offset_x,
+                                    int offset_y, int width, int height);
+
+/*
+    Generates a new graymap from an array of pixel data.
+Input:
+    int width:      Width of the image (in number of pixels).
+
+    int height:     Height of the image (in number of pixels).
+
+    uint8_t *data:  A 1-dimensional array of pitch * height bytes. See
+                    giko_graymap_t for the format. Owned by the graymap.
+
+Output:
+    - Returns a pointer to a giko_graymap_t structure.
+    - NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_graymap_t *giko_new_graymap(int width, int height, uint8_t *data);
+
+/*
+    Dither a graymap into a bitmap by Floyd-Steinberg error diffusion.
+    Pixels are set where the diffused intensity is at least half, so areas
+    of grey become patterns of set pixels of the same density.
+Input:
+    giko_graymap_t *graymap:  Graymap to be dithered.
+
+Output:
+    - Returns a pointer to a new giko_bitmap_t.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_bitmap_t *giko_dither_graymap(giko_graymap_t *graymap);
+
+// Context
+
+/*
+    Creates a context for a program that builds glyph maps and traces from
+    many threads, such as a service handling concurrent requests.
+    The context owns one FreeType library and keeps every font face it opens,
+    so glyph maps of the same font are built without reopening it. Each build
+    takes a face of its own, so builds may run at once.
+    Traces whose options set the context reuse its scratch buffers. Every
+    thread tracing takes its own scratch, so traces of a shared glyph map do
+    not wait on each other.
+    Every function taking the context may be called from any thread.
+
+Output:
+    - Returns a pointer to a giko_context_t.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_context_t *giko_new_context(void);
+
+/*
+    Generates a new glyph map like giko_new_glyph_map, with a font face
+    opened by the context.
+
+Input:
+    giko_context_t *context:    Context to open the font face with.
+
+    Other inputs:               See giko_new_glyph_map.
+
+Output:
+    - Returns a giko_glyph_map_t. The map does not refer to the context, and
+      may outlive it.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_glyph_map_t *giko_context_glyph_map(giko_context_t *context,
+                                         char *ttf_filepath,
+                                         giko_codepoint_t *charset,
+                                         int glyph_size, sort_order_t order,
+                                         giko_stats_t *stats);
+
+/*
+    Free a context, its font faces and its scratch buffers. No glyph map
+    build or trace may be using the context.
+Input:
+    giko_context_t *context:    Context to be freed.
+
+Output:
+    - No output.
+ */
+void giko_free_context(giko_context_t *context);
+
+// Similarity engine
+
+/*
+    Select the engine used to compare glyphs against the reference.
+    The engine is picked automatically (ENGINE_AUTO) on first use. Every
+    engine produces identical results; only the speed differs.
+
+Input:
+    giko_engine_t engine:   Engine to use. ENGINE_AUTO picks between
+                            ENGINE_WORD and the widest engine supported by
+                            the CPU by the size of each comparison, as
+                            vector engines are slower on small bitmaps.
+
+Output:
+    - Returns EXIT_SUCCESS if the engine is now active.
+    - Returns EXIT_FAILURE if the CPU does not support the engine. The active
+      engine is left unchanged. Errors printed to stderr.
+ */
+int giko_set_engine(giko_engine_t engine);
+
+/*
+    Get the active similarity engine.
+
+Output:
+    - Returns the active engine, ENGINE_AUTO unless another was set.
+ */
+giko_engine_t giko_get_engine(void);
+
+/*
+    Get the name of a similarity engine (e.g. "avx2").
+
+Output:
+    - Returns a static string.
+ */
+const char *giko_engine_name(giko_engine_t engine);
+
+// Statistics
+
+/*
+    Read the monotonic clock that giko_stats_t times are measured with, to
+    time stages outside of libgiko such as charset loading.
+
+Output:
+    - Returns the time in nanoseconds since an arbitrary point.
+ */
+uint64_t giko_stats_clock(void);
+
+// Glyph map cache
+
+/*
+    Compute the cache key of a glyph map.
+    The key is a hash of the font file contents, the charset, the glyph size
+    and the sort order, i.e. everything giko_new_glyph_map depends on.
+
+Input:
+    See giko_new_glyph_map.
+
+Output:
+    - Returns a non-zero 64 bit key.
+    - Returns 0 if an error is encountered. Errors printed to stderr.
+ */
+uint64_t giko_glyph_map_key(char *ttf_filepath, giko_codepoint_t *charset,
+                            int glyph_size, sort_order_t order);
+
+/*
+    Save a glyph map to a cache file.
+    The file is written to a temporary file and renamed into place, so
+    concurrent readers never see a partial file.
+
+Input:
+    giko_glyph_map_t *map:  Glyph map to be saved.
+
+    uint64_t key:           Key from giko_glyph_map_key.
+
+    char *filepath:         String representing filepath to the cache file.
+
+Output:
+    - Returns EXIT_SUCCESS if the write is successful.
+    - Returns EXIT_FAILURE if the write is unsuccessful. Errors printed to
+      stderr.
+ */
+int giko_save_glyph_map(giko_glyph_map_t *map, uint64_t key,
+                        char *filepath);
+
+/*
+    Load a glyph map from a cache file.
+    The file is memory mapped and the glyph bitmaps are used in place. Free
+    the map with giko_free_glyph_map as usual.
+
+Input:
+    char *filepath:     String representing filepath to the cache file.
+
+    uint64_t key:       Key from giko_glyph_map_key.
+
+Output:
+    - Returns a giko_glyph_map_t.
+    - Returns NULL if the file does not exist or was saved with another key.
+    - Returns NULL if the file is corrupt. Errors printed to stderr.
+ */
+giko_glyph_map_t *giko_load_glyph_map(char *filepath, uint64_t key);
+
 // File utility
 
 /*
@@ -246,6 +909,126 @@ Output:
  */
 giko_bitmap_t *giko_load_bitmap(char *bmp_filepath);
 
+/*
+    Read an image and threshold it into a bitmap at half intensity.
+    Supported formats are BMP (uncompressed), PBM, PGM and PPM (plain and
+    raw), and PNG when libgiko is built with libpng. Colours are reduced to
+    their Rec. 709 luminance. Transparent PNG pixels are treated as white.
+
+Input:
+    char *filepath: String representing filepath to the image.
+    int invert:     If 0, dark pixels are set. Otherwise light pixels are set.
+
+Output:
+    - Returns a pointer to a giko_bitmap_t.
+    - Returns NULL without an error if the format is not supported.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_bitmap_t *giko_load_image(char *filepath, int invert);
+
+/*
+    Read an image from a stream, e.g. a pipe. See giko_load_image.
+    The image is read in one pass, the stream is never rewound.
+
+Input:
+    FILE *file:     Stream positioned at the start of the image.
+    int invert:     If 0, dark pixels are set. Otherwise light pixels are set.
+
+Output:
+    - Returns a pointer to a giko_bitmap_t.
+    - Returns NULL without an error if the format is not supported.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_bitmap_t *giko_read_image(FILE *file, int invert);
+
+/*
+    Read an image into a graymap, keeping its shades of grey instead of
+    thresholding them. Supports the formats of giko_load_image.
+
+Input:
+    char *filepath: String representing filepath to the image.
+    int invert:     If 0, dark pixels are set. Otherwise light pixels are set.
+
+Output:
+    - Returns a pointer to a giko_graymap_t.
+    - Returns NULL without an error if the format is not supported.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_graymap_t *giko_load_graymap(char *filepath, int invert);
+
+/*
+    Read a graymap from a stream, e.g. a pipe. See giko_load_graymap.
+
+Input:
+    FILE *file:     Stream positioned at the start of the image.
+    int invert:     If 0, dark pixels are set. Otherwise light pixels are set.
+
+Output:
+    - Returns a pointer to a giko_graymap_t.
+    - Returns NULL without an error if the format is not supported.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_graymap_t *giko_read_graymap(FILE *file, int invert);
+
+/*
+    Read an image like giko_load_image, also summing its colours. Each
+    decoded row is added to the sums of its band and then dropped, so the
+    image is still only decoded once and its colours are never held whole.
+    They are not inverted.
+
+Input:
+    char *filepath:         String representing filepath to the image.
+    int invert:             If 0, dark pixels are set. Otherwise light pixels
+                            are set.
+    giko_band_height_callback_t band_height:
+                            Asked for the height of the bands once the size
+                            of the image is known. May be NULL if colors is
+                            NULL.
+    void *user_data:        Passed to band_height.
+    giko_color_bands_t **colors:
+                            Set to the colour sums of the image. Pixels are
+                            weighted by their bit in the bitmap returned.
+                            Free with giko_free_color_bands. If NULL, the
+                            image is read like giko_load_image.
+
+Output:
+    - Returns a pointer to a giko_bitmap_t.
+    - Returns NULL without an error if the format is not supported, or if
+      band_height returns 0.
+    - Returns NULL if an error is encountered. Errors printed to stderr.
+ */
+giko_bitmap_t *giko_load_color_image(char *filepath, int invert,
+                                     giko_band_height_callback_t band_height,
+                                     void *user_data,
+                                     giko_color_bands_t **colors);
+
+/*
+    Read an image from a stream, also summing its colours. See
+    giko_load_color_image.
+ */
+giko_bitmap_t *giko_read_color_image(FILE *file, int invert,
+                                     giko_band_height_callback_t band_height,
+                                     void *user_data,
+                                     giko_color_bands_t **colors);
+
+/*
+    Read an image like giko_load_graymap, also summing its colours. Pixels
+    are weighted by their byte in the graymap. See giko_load_color_image.
+ */
+giko_graymap_t *giko_load_color_graymap(char *filepath, int invert,
+                                        giko_band_height_callback_t band_height,
+                                        void *user_data,
+                                        giko_color_bands_t **colors);
+
+/*
+    Read a graymap from a stream, also summing its colours. See
+    giko_load_color_graymap.
+ */
+giko_graymap_t *giko_read_color_graymap(FILE *file, int invert,
+                                        giko_band_height_callback_t band_height,
+                                        void *user_data,
+                                        giko_color_bands_t **colors);
+
 /*
     Write codepoints to a file in utf8 encoding.
 
@@ -260,6 +1043,20 @@ Output:
  */
 int giko_write_codepoint_str(giko_codepoint_t *string, char *out_filepath);
 
+/*
+    Write a bitmap to a file as a binary PBM image, set pixels being black.
+
+Input:
+    giko_bitmap_t *bitmap:  Bitmap to be written.
+
+    char *out_filepath:     String representing filepath to the output file.
+
+Output:
+    - Returns EXIT_SUCCESS if write is successful.
+    - Returns EXIT_FAILURE if write is unsuccessful. Errors printed to stderr.
+ */
+int giko_write_bitmap(giko_bitmap_t *bitmap, char *out_filepath);
+
 #ifdef _cplusplus
 }
 #endif
@@ -4,16 +4,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define DEFAULT_HEIGHT 32
-#define DEFAULT_BASE_ENCODING 10
-#define DEFAULT_CHUNKINESS 0.5
-#define DEFAULT_ACCURACY 0.5
-#define DEFAULT_DENOISE 0.05
-#define DEFAULT_SORT_ORDER NONE
-#define DEFAULT_FIDELITY HIGH
-#define DEFAULT_NEGATION 0
-#define DEFAULT_VERBOSE 0
-
 // Function prototypes
 void parse_config_file(const char *conf_path, config_t *config);
 void print_usage(const char *program_name);
@@ -31,7 +21,28 @@ int main(int argc, char *argv[]) {
                        DEFAULT_ACCURACY,
                        DEFAULT_DENOISE,
                        DEFAULT_FIDELITY,
-                       DEFAULT_NEGATION};
+                       DEFAULT_NEGATION,
+                       DEFAULT_THREADS,
+                       DEFAULT_CACHE,
+                       "",
+                       DEFAULT_LAZY,
+                       DEFAULT_SEARCH,
+                       "",
+                       "",
+                       DEFAULT_STREAM,
+                       DEFAULT_FRAMES,
+                       DEFAULT_SEGMENTATION,
+                       DEFAULT_SHORTLIST,
+                       DEFAULT_MODE,
+                       DEFAULT_COLOR,
+                       "",
+                       DEFAULT_SCORE,
+                       "",
+                       DEFAULT_SWEEP_LIMIT,
+                       DEFAULT_STATS,
+                       "",
+                       DEFAULT_MAX_MAPS,
+                       DEFAULT_MAX_PIXELS};
     char config_file[MAX_PATH_LEN] = "";
     int verbose = 0;
 
@@ -50,6 +61,25 @@ int main(int argc, char *argv[]) {
         {"denoise", required_argument, 0, 'd'},
         {"fidelity", required_argument, 0, 'F'},
         {"negate", no_argument, 0, 'n'},
+        {"threads", required_argument, 0, 't'},
+        {"cache-dir", required_argument, 0, 'D'},
+        {"no-cache", no_argument, 0, 'N'},
+        {"lazy", no_argument, 0, 'z'},
+        {"search", required_argument, 0, 'S'},
+        {"segmentation", required_argument, 0, 'r'},
+        {"shortlist", required_argument, 0, 'K'},
+        {"mode", required_argument, 0, 'm'},
+        {"color", required_argument, 0, 'P'},
+        {"render-file", required_argument, 0, 'R'},
+        {"score", no_argument, 0, 'Q'},
+        {"sweep", required_argument, 0, 'W'},
+        {"sweep-limit", required_argument, 0, 'L'},
+        {"stats", no_argument, 0, 'T'},
+        {"batch", required_argument, 0, 'B'},
+        {"output-dir", required_argument, 0, 'O'},
+        {"connect", required_argument, 0, 'x'},
+        {"stream", no_argument, 0, 's'},
+        {"frames", no_argument, 0, 'A'},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
@@ -57,7 +87,7 @@ int main(int argc, char *argv[]) {
     int opt;
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "c:i:f:o:C:H:b:s:g:k:a:d:F:nvh",
+    while ((opt = getopt_long(argc, argv, "c:i:f:o:C:H:b:sg:k:a:d:F:nt:D:NzS:r:K:m:P:R:QW:L:TB:O:x:Avh",
                               long_options, &option_index)) != -1) {
         switch (opt) {
         case 'C':
@@ -81,14 +111,14 @@ int main(int argc, char *argv[]) {
             break;
         case 'H':
             config.height = atoi(optarg);
-            if (config.height < 0) {
+            if (config.height <= 0) {
                 fprintf(stderr, "Error: --height must be positive.\n");
                 return EXIT_FAILURE;
             }
             break;
         case 'b':
             config.base_encoding = atoi(optarg);
-            if (config.height < 0) {
+            if (config.base_encoding <= 0) {
                 fprintf(stderr, "Error: --base-encoding must be positive.\n");
                 return EXIT_FAILURE;
             }
@@ -116,8 +146,9 @@ int main(int argc, char *argv[]) {
             break;
         case 'a':
             config.accuracy = atof(optarg);
-            if (config.accuracy < 0 || config.accuracy > 1) {
-                fprintf(stderr, "Error: --accuracy must be between 0 and 1.\n");
+            if (config.accuracy <= 0 || config.accuracy > 1) {
+                fprintf(stderr,
+                        "Error: --accuracy must be above 0 and at most 1.\n");
                 return EXIT_FAILURE;
             }
             break;
@@ -144,6 +175,114 @@ int main(int argc, char *argv[]) {
         case 'n':
             config.negate = 1;
             break;
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 0) {
+                fprintf(stderr, "Error: --threads must be positive, or 0 to "
+                                "use every CPU.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            strncpy(config.cache_dir, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'N':
+            config.cache = 0;
+            break;
+        case 'z':
+            config.lazy = 1;
+            break;
+        case 'S':
+            if (strcmp(optarg, "LINEAR") == 0) {
+                config.search = SEARCH_LINEAR;
+            } else if (strcmp(optarg, "BOUNDED") == 0) {
+                config.search = SEARCH_BOUNDED;
+            } else {
+                fprintf(stderr, "Invalid value for --search. Use LINEAR or "
+                                "BOUNDED.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "GREEDY") == 0) {
+                config.segmentation = SEGMENT_GREEDY;
+            } else if (strcmp(optarg, "OPTIMAL") == 0) {
+                config.segmentation = SEGMENT_OPTIMAL;
+            } else {
+                fprintf(stderr, "Invalid value for --segmentation. Use GREEDY "
+                                "or OPTIMAL.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'K':
+            config.shortlist = atoi(optarg);
+            if (config.shortlist < 0) {
+                fprintf(stderr, "Error: --shortlist must be positive, or 0 to "
+                                "compare every glyph.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "BILEVEL") == 0) {
+                config.mode = BILEVEL;
+            } else if (strcmp(optarg, "DITHER") == 0) {
+                config.mode = DITHER;
+            } else if (strcmp(optarg, "GRAY") == 0) {
+                config.mode = GRAY;
+            } else {
+                fprintf(stderr, "Invalid value for --mode. Use BILEVEL, "
+                                "DITHER, or GRAY.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "NONE") == 0) {
+                config.color = COLOR_NONE;
+            } else if (strcmp(optarg, "ANSI") == 0) {
+                config.color = COLOR_ANSI;
+            } else if (strcmp(optarg, "HTML") == 0) {
+                config.color = COLOR_HTML;
+            } else {
+                fprintf(stderr, "Invalid value for --color. Use NONE, ANSI, "
+                                "or HTML.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            strncpy(config.render_file, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'Q':
+            config.score = 1;
+            break;
+        case 'W':
+            strncpy(config.sweep_dir, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'L':
+            config.sweep_limit = atoi(optarg);
+            if (config.sweep_limit < 0) {
+                fprintf(stderr, "Error: --sweep-limit must be positive, or 0 "
+                                "to trace the whole grid.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            config.stats = 1;
+            break;
+        case 's':
+            config.stream = 1;
+            break;
+        case 'B':
+            strncpy(config.batch, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'O':
+            strncpy(config.output_dir, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'x':
+            strncpy(config.socket_path, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'A':
+            config.frames = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -156,22 +295,81 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Settings from a config file are not checked as they are read
+    const char *error = config_error(&config);
+    if (error) {
+        fprintf(stderr, "Error: %s.\n", error);
+        return EXIT_FAILURE;
+    }
+
     // Ensure required arguments are provided
-    if (strlen(config.charset_file) == 0 || strlen(config.image_file) == 0 ||
+    int batch = strlen(config.batch) > 0;
+    if (strlen(config.charset_file) == 0 ||
+        (strlen(config.image_file) == 0 && !batch && !config.frames) ||
         strlen(config.font_file) == 0) {
-        fprintf(stderr, "Error: charset file, image file, and font file must "
-                        "be specified.\n");
+        fprintf(stderr, "Error: charset file, image file (or batch), and font "
+                        "file must be specified.\n");
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
+    int render = strlen(config.render_file) > 0 || config.score;
+    if (render && (batch || config.frames)) {
+        fprintf(stderr, "Error: --render-file and --score only trace a "
+                        "single image, not --batch or --frames.\n");
+        return EXIT_FAILURE;
+    }
+    if (render && (config.stream || config.color != COLOR_NONE)) {
+        fprintf(stderr, "Error: --render-file and --score need the whole "
+                        "trace, not --stream or --color.\n");
+        return EXIT_FAILURE;
+    }
+    if (config.score && config.mode == GRAY) {
+        fprintf(stderr, "Error: --score compares bitmaps, not --mode GRAY. "
+                        "Use BILEVEL or DITHER.\n");
+        return EXIT_FAILURE;
+    }
+
+    int sweep = strlen(config.sweep_dir) > 0;
+    if (sweep && (batch || config.frames || render || config.stats)) {
+        fprintf(stderr, "Error: --sweep traces a single image, not with "
+                        "--batch, --frames, --render-file, --score or "
+                        "--stats.\n");
+        return EXIT_FAILURE;
+    }
+
+    int remote = strlen(config.socket_path) > 0;
+    if (remote && (batch || config.frames || sweep || render ||
+                   config.stats)) {
+        fprintf(stderr, "Error: --connect traces a single image, not with "
+                        "--batch, --frames, --sweep, --render-file, --score "
+                        "or --stats.\n");
+        return EXIT_FAILURE;
+    }
+
     if (verbose) {
         print_config(config);
     }
+    if (remote)
+        return giko_trace_remote(config);
 
-    giko_trace(config);
-
-    return EXIT_SUCCESS;
+    run_context = giko_new_context();
+    if (!run_context)
+        return EXIT_FAILURE;
+    int result;
+    if (sweep) {
+        result = giko_trace_sweep(config);
+    } else if (batch) {
+        result = giko_trace_batch(config);
+    } else if (config.frames) {
+        result = giko_trace_frames(config);
+    } else {
+        result = giko_trace(config);
+    }
+    if (config.stats)
+        print_stats(stderr, &run_stats);
+    giko_free_context(run_context);
+    return result;
 }
 
 void parse_config_file(const char *conf_path, config_t *config) {
@@ -181,54 +379,7 @@ void parse_config_file(const char *conf_path, config_t *config) {
         exit(EXIT_FAILURE);
     }
 
-    char line[512];
-    while (fgets(line, sizeof(line), file)) {
-        char key[128], value[MAX_PATH_LEN];
-        if (sscanf(line, "%127[^=]=%4095s", key, value) == 2) {
-            if (strcmp(key, "charset_file") == 0) {
-                strncpy(config->charset_file, value, MAX_PATH_LEN - 1);
-            } else if (strcmp(key, "image_file") == 0) {
-                strncpy(config->image_file, value, MAX_PATH_LEN - 1);
-            } else if (strcmp(key, "font_file") == 0) {
-                strncpy(config->font_file, value, MAX_PATH_LEN - 1);
-            } else if (strcmp(key, "output_file") == 0) {
-                strncpy(config->output_file, value, MAX_PATH_LEN - 1);
-            } else if (strcmp(key, "height") == 0) {
-                config->height = atoi(value);
-            } else if (strcmp(key, "base_encoding") == 0) {
-                config->base_encoding = atoi(value);
-            } else if (strcmp(key, "glyph_map_order") == 0) {
-                if (strcmp(value, "NONE") == 0) {
-                    config->glyph_map_order = NONE;
-                } else if (strcmp(value, "ASCENDING") == 0) {
-                    config->glyph_map_order = ASCENDING;
-                } else if (strcmp(value, "DESCENDING") == 0) {
-                    config->glyph_map_order = DESCENDING;
-                }
-            } else if (strcmp(key, "chunkiness") == 0) {
-                config->chunkiness = atof(value);
-            } else if (strcmp(key, "accuracy") == 0) {
-                config->accuracy = atof(value);
-            } else if (strcmp(key, "denoise") == 0) {
-                config->denoise = atof(value);
-            } else if (strcmp(key, "fidelity") == 0) {
-                if (strcmp(value, "LOW") == 0) {
-                    config->fidelity = LOW;
-                } else if (strcmp(value, "MEDIUM") == 0) {
-                    config->fidelity = MEDIUM;
-                } else if (strcmp(value, "HIGH") == 0) {
-                    config->fidelity = HIGH;
-                }
-            } else if (strcmp(key, "negate") == 0) {
-                if (strcmp(value, "true")) {
-                    config->negate = 1;
-                } else {
-                    config->negate = 0;
-                }
-            }
-        }
-    }
-
+    read_config(file, config);
     fclose(file);
 }
 
@@ -258,6 +409,43 @@ void print_usage(const char *program_name) {
            "(default: MEDIUM)\n");
     printf("  -n, --negate                  Negate (invert) colours of image"
            "of the image\n");
+    printf("  -t, --threads NUMBER          Number of threads tracing rows, or "
+           "images in batch mode (0 for every CPU, default: 1)\n");
+    printf("  -D, --cache-dir PATH          Glyph map cache directory (default: "
+           "~/.cache/giko)\n");
+    printf("  -N, --no-cache                Always rebuild the glyph map\n");
+    printf("  -z, --lazy                    Rasterize glyphs when they are "
+           "first searched\n");
+    printf("  -S, --search ENUM             Glyph search: LINEAR, BOUNDED "
+           "(default: LINEAR)\n");
+    printf("  -r, --segmentation ENUM       Row segmentation: GREEDY, OPTIMAL "
+           "(default: GREEDY)\n");
+    printf("  -K, --shortlist NUMBER        Only compare the closest NUMBER "
+           "glyphs of each width (default: 0, every glyph)\n");
+    printf("  -m, --mode ENUM               Image mode: BILEVEL, DITHER, GRAY "
+           "(default: BILEVEL)\n");
+    printf("  -P, --color ENUM              Colour each character like its "
+           "part of the image: NONE, ANSI, HTML (default: NONE)\n");
+    printf("  -R, --render-file PATH        Render the output back into a PBM "
+           "image\n");
+    printf("  -Q, --score                   Print the IoU of the reference and "
+           "the rendered output to stderr\n");
+    printf("  -W, --sweep DIR               Trace a grid of settings and write "
+           "the Pareto-optimal configs to DIR\n");
+    printf("  -L, --sweep-limit NUMBER      Only trace NUMBER settings of the "
+           "sweep grid (default: 0, every setting)\n");
+    printf("  -T, --stats                   Print where the time went as JSON "
+           "to stderr\n");
+    printf("  -s, --stream                  Write each row as soon as it is "
+           "traced\n");
+    printf("  -A, --frames                  Trace a stream of frames from the "
+           "image file or stdin, separated by form feeds\n");
+    printf("  -B, --batch SOURCE            Trace every image of a directory, "
+           "glob, or - for a list of paths on stdin\n");
+    printf("  -O, --output-dir PATH         Directory of batch outputs "
+           "(default: next to each image)\n");
+    printf("  -x, --connect SOCKET          Trace with the giko-traced daemon "
+           "listening on SOCKET\n");
     printf("  -v, --verbose                 Print argument list\n");
 }
 
@@ -280,4 +468,37 @@ void print_config(config_t config) {
                              : (config.fidelity == MEDIUM) ? "MEDIUM"
                                                            : "HIGH");
     printf("Negate: %s\n", (config.negate) ? "true" : "false");
+    printf("Threads: %d\n", config.threads);
+    printf("Glyph map cache: %s\n",
+           !config.cache                    ? "disabled"
+           : (strlen(config.cache_dir) > 0) ? config.cache_dir
+                                            : "default");
+    printf("Lazy glyph map: %s\n", (config.lazy) ? "true" : "false");
+    printf("Search: %s\n",
+           (config.search == SEARCH_BOUNDED) ? "BOUNDED" : "LINEAR");
+    printf("Segmentation: %s\n",
+           (config.segmentation == SEGMENT_OPTIMAL) ? "OPTIMAL" : "GREEDY");
+    printf("Shortlist: %d\n", config.shortlist);
+    printf("Mode: %s\n", (config.mode == BILEVEL)  ? "BILEVEL"
+                         : (config.mode == DITHER) ? "DITHER"
+                                                   : "GRAY");
+    printf("Color: %s\n", (config.color == COLOR_NONE)   ? "NONE"
+                          : (config.color == COLOR_ANSI) ? "ANSI"
+                                                         : "HTML");
+    if (strlen(config.render_file) > 0)
+        printf("Render file: %s\n", config.render_file);
+    printf("Score: %s\n", (config.score) ? "true" : "false");
+    if (strlen(config.sweep_dir) > 0) {
+        printf("Sweep directory: %s\n", config.sweep_dir);
+        printf("Sweep limit: %d\n", config.sweep_limit);
+    }
+    printf("Stats: %s\n", (config.stats) ? "true" : "false");
+    printf("Stream: %s\n", (config.stream) ? "true" : "false");
+    printf("Frames: %s\n", (config.frames) ? "true" : "false");
+    if (strlen(config.batch) > 0) {
+        printf("Batch: %s\n", config.batch);
+        printf("Output directory: %s\n", (strlen(config.output_dir) > 0)
+                                             ? config.output_dir
+                                             : "next to each image");
+    }
 }
@@ -1,41 +1,414 @@
 #include "giko.h"
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_GLYPH_H
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#ifdef GIKO_PNG
+#include <png.h>
+#endif
 
 #define LINE_FEED 10
 #define MAX_DIGITS_IN_CODEPOINT 8
 #define STRING_CHUNK_SIZE 256
 #define TERMINAL_CODEPOINT 0
 
-// Node of a linked list
+#define ATLAS_ALIGNMENT 64
+
+// Arena allocations are aligned like the atlas, after a header of this size
+#define ARENA_ALIGNMENT 64
+#define ARENA_HEADER_SIZE 64
+#define GLYPH_ARENA_BLOCK_SIZE (64 * 1024)
+#define SCRATCH_ARENA_BLOCK_SIZE (16 * 1024)
+
+// Glyph maps are rasterized by a thread per this many codepoints, up to one
+// per CPU. Each thread opens a face, which costs about as much as
+// rasterizing a few hundred glyphs. Threads claim RASTER_CHUNK_SIZE
+// codepoints at a time.
+#define GLYPHS_PER_RASTER_THREAD 512
+#define RASTER_CHUNK_SIZE 64
+
+// Glyphs and patches are summarised by the pixel density of a
+// SIGNATURE_GRID x SIGNATURE_GRID grid of cells, one byte per cell
+#define SIGNATURE_GRID 4
+#define SIGNATURE_SIZE (SIGNATURE_GRID * SIGNATURE_GRID)
+
+// ENGINE_AUTO compares bitmaps smaller than this with 64 bit words and
+// larger ones with the widest vector engine. Below it the vector kernels
+// were slower than words, e.g. at the 64 bytes of a 16 pixel glyph.
+#define AUTO_VECTOR_MIN_BYTES 128
+
+// Pixels with a luminance below this are dark
+#define LUMA_THRESHOLD 128
+
+// Sums per column of each colour band (see giko_color_bands_t), which fit
+// 32 bits for bands of up to MAX_COLOR_BAND rows
+#define COLOR_SUMS 7
+#define MAX_COLOR_BAND 65536
+
+// Graymaps and glyphs are blurred by em_height / GRAY_BLUR_DIVISOR pixels
+#define GRAY_BLUR_DIVISOR 8
+
+#define BMP_MAX_HEADER_SIZE (14 + 124)
+#define BMP_RGB 0
+#define BMP_BITFIELDS 3
+
+#ifdef GIKO_BENCH
+// Glyph comparisons made so far, read by the benchmark harness
+uint64_t bench_comparisons;
+#define COUNT_COMPARISON()                                                     \
+    __atomic_fetch_add(&bench_comparisons, 1, __ATOMIC_RELAXED)
+#else
+#define COUNT_COMPARISON()
+#endif
+
+// Stages are only timed, and counters only counted, when a giko_stats_t is
+// given, so unmeasured traces pay one branch per stage
+#define STAGE_BEGIN(stats) ((stats) ? giko_stats_clock() : 0)
+#define STAGE_END(stats, field, begin)                                         \
+    do {                                                                       \
+        if (stats)                                                             \
+            (stats)->field += giko_stats_clock() - (begin);                    \
+    } while (0)
+#define COUNT_STAT(stats, field)                                               \
+    do {                                                                       \
+        if (stats)                                                             \
+            (stats)->field++;                                                  \
+    } while (0)
+
+// Node of a linked list. Only used while building a glyph map, allocated
+// from its arena along with the bitmap.
 typedef struct giko_glyph {
     giko_codepoint_t codepoint;
     int advance;
+    int index; // Position in the charset, which breaks ties when sorting
     giko_bitmap_t *bitmap;
     struct giko_glyph *next;
 } giko_glyph_t;
 
-// Wrapper for an array of giko_glyph linked lists, stored in `glyphs`.
-// The array is indexed by the glyphs' width (aka advance).
-// E.g. The head of the linked list with glyphs of 16 pixel advance is stored
-// in glyphs[16].
+// Glyphs with the same advance, stored consecutively in the glyph arrays
+typedef struct glyph_bucket {
+    int32_t start; // Index of the first glyph of the bucket
+    int32_t count; // Number of glyphs in the bucket
+} glyph_bucket_t;
+
+// Glyphs of a lazy glyph map, loaded but not rendered. Each bucket is
+// rendered the first time it is searched. Everything but ready is guarded by
+// lock, and the outlines and staging buffers are freed once every bucket is
+// rendered.
+typedef struct lazy_glyphs {
+    pthread_mutex_t lock;
+    FT_Library library;
+    FT_Glyph *outlines; // [num_glyphs] Hinted outline of each glyph of the map
+                        // not yet rendered
+    int num_glyphs;
+    int ascent;
+    sort_order_t order;
+    uint8_t *ready; // [num_advances] Set once the bucket's glyphs are in the
+                    // map's arrays. Read without the lock.
+    int pending;    // Buckets left to render
+    // Sorting a bucket moves its glyphs through these, sized for the largest
+    // bucket. NULL with NONE, as buckets keep charset order.
+    uint8_t *staged_bitmaps;
+    giko_codepoint_t *staged_codepoints;
+    int32_t *staged_set_pixels;
+    int32_t *staged_order;
+} lazy_glyphs_t;
+
+// Glyphs of a map box blurred for graymap traces, built by the map's first
+// graymap trace and kept until the map is freed
+typedef struct gray_glyphs {
+    uint8_t *coverage; // Glyphs box blurred to a byte per pixel, laid out
+                       // like gray patches
+    size_t *offsets;   // [num_glyphs] Offset of each glyph in coverage
+    int *intensity;    // [num_glyphs] Sum of the bytes of each glyph
+    float densest;     // Highest mean coverage of a glyph, from 0 to 1
+} gray_glyphs_t;
+
+// Glyph atlas. Glyph bitmaps are packed back to back in `atlas`, bucket by
+// bucket, with the bitmaps of each bucket starting on a 64 byte boundary.
+// Glyphs are described by the parallel arrays `codepoints`, `set_pixels` and
+// `offsets` (byte offset of the bitmap in the atlas).
+// `by_set_pixels` holds each bucket's glyph indices again, sorted by
+// ascending set pixels, for the bounded search.
+// `signatures` holds SIGNATURE_SIZE density bytes per glyph, for shortlists.
+// `buckets` is indexed by the glyphs' width (aka advance).
+// E.g. The glyphs with a 16 pixel advance are glyphs
+// buckets[16].start to buckets[16].start + buckets[16].count - 1.
+// A glyph bitmap of advance a has a pitch of pitch_32bit(a) and em_height
+// rows.
+//
+// All arrays live in one block (`image`) whose layout is identical to the
+// body of a cache file, so a cache file can be used in place.
+//
+// A lazy map starts with only `buckets`, `offsets` and the codepoints of each
+// bucket in charset order. The other arrays of a bucket are filled, and its
+// codepoints sorted, by load_bucket.
 struct giko_glyph_map {
     int num_advances;
     int em_height;
-    giko_glyph_t **glyphs;
+    int num_glyphs;
+    glyph_bucket_t *buckets;
+    giko_codepoint_t *codepoints;
+    int32_t *set_pixels;
+    uint32_t *offsets;
+    int32_t *by_set_pixels;
+    uint8_t *signatures;
+    uint8_t *atlas;
+
+    void *image;       // Block holding the arrays above
+    size_t image_size; // Size of the block in bytes
+    void *mapping;     // Memory mapped cache file holding the block, or NULL
+                       // if the block is allocated by the map.
+    size_t mapping_size;
+    lazy_glyphs_t *lazy; // Rasterizes buckets on demand, or NULL if the map
+                         // was built in full
+    gray_glyphs_t *gray; // Set once by the first graymap trace, or NULL
 };
 
+// Byte offsets of the arrays inside a glyph map block
+typedef struct map_layout {
+    size_t buckets;
+    size_t codepoints;
+    size_t set_pixels;
+    size_t offsets;
+    size_t by_set_pixels;
+    size_t signatures;
+    size_t atlas;
+    size_t size;
+} map_layout_t;
+
+// A glyph map cache file is a glyph_map_file_header_t followed by the glyph
+// map block, all fields in native byte order. The header is 64 bytes so the
+// atlas stays aligned when the file is memory mapped.
+#define GLYPH_MAP_MAGIC "GIKOMAP"
+#define GLYPH_MAP_VERSION 5
+
+typedef struct glyph_map_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // 0x01020304 when written
+    uint64_t key;
+    uint64_t file_size;
+    int32_t num_advances;
+    int32_t em_height;
+    int32_t num_glyphs;
+    int32_t reserved;
+    uint64_t atlas_size;
+    uint8_t padding[8];
+} glyph_map_file_header_t;
+
 typedef struct giko_match {
     int codepoint;
     int advance;
     float similarity;
 } giko_match_t;
 
+// Growable codepoint string
+typedef struct codepoint_buffer {
+    giko_codepoint_t *codepoints;
+    int *advances; // Advance of each codepoint of a traced row, or NULL
+    int size;
+    int capacity;
+} codepoint_buffer_t;
+
+// Traced row waiting to be emitted
+typedef struct trace_slot {
+    codepoint_buffer_t string;
+    int done; // Set once the row is traced, cleared once emitted
+} trace_slot_t;
+
+// Shared state of a trace. Workers claim rows through next_row and trace
+// row r into slots[r % window]. The fields below lock are guarded by it.
+typedef struct trace_job {
+    giko_bitmap_t *reference; // Reference bitmap, or NULL for a graymap
+    giko_graymap_t *graymap;  // Reference graymap, or NULL for a bitmap
+    int width;                // Width of the reference
+    giko_glyph_map_t *map;
+    giko_trace_options_t options;
+    giko_row_callback_t callback;
+    void *user_data;
+    int rows;
+    int window;
+    trace_slot_t *slots;
+    pthread_mutex_t lock;
+    pthread_cond_t row_done;  // Signalled when a slot is done
+    pthread_cond_t slot_free; // Signalled when a row has been emitted
+    int next_row;
+    int emitted_rows;
+    int failed;
+    giko_frame_tracer_t *frames; // Matches of earlier frames, or NULL
+    // Graymaps are compared blurred, so that glyphs match by local density
+    uint8_t *blurred;            // Reference box blurred, with its pitch
+    const gray_glyphs_t *gray;   // Glyphs of the map blurred the same way
+} trace_job_t;
+
+// Reusable UTF-8 and colour buffers of emitted rows
+typedef struct row_encoder {
+    uint8_t *utf8;
+    int capacity;
+    giko_color_t *colors;
+    int color_capacity;
+} row_encoder_t;
+
+// Match of the chunk starting at one column of a row, and the frame it was
+// searched in
+typedef struct frame_cell {
+    giko_match_t match;
+    int frame; // 0 if the cell has not been searched
+} frame_cell_t;
+
+// A match only depends on the pixels of the columns its views cover. Cells
+// whose columns have not changed since they were searched are reused.
+struct giko_frame_tracer {
+    giko_glyph_map_t *map;
+    giko_trace_options_t options;
+    int width;
+    int height;
+    int pitch;
+    int rows;
+    int frame;           // Number of frames traced at this size
+    uint8_t *previous;   // Pixels of the last frame traced
+    int *last_change;    // [rows * width] Last frame each column changed in
+    frame_cell_t *cells; // [rows * width] Cell of each column of each row
+    // Kept between frames, so that once its buffers have grown to fit,
+    // frames are traced without allocating
+    struct trace_scratch *scratch; // NULL until the first frame
+};
+
+// Glyph of a codepoint, for looking glyphs up by codepoint
+typedef struct glyph_entry {
+    giko_codepoint_t codepoint;
+    int32_t glyph;   // Index in the glyph map
+    int32_t advance; // Advance of the glyph's bucket
+} glyph_entry_t;
+
+// Bitmap or graymap being filled one decoded row at a time. Dark pixels are
+// set, or light pixels when inverted. invert, gray, colors, band_height and
+// user_data are chosen by the caller, the rest by new_image_sink once the
+// decoder knows the size.
+typedef struct image_sink {
+    int width;
+    int height;
+    int pitch;
+    int invert;
+    int gray;   // Fill a graymap instead of a bitmap
+    int colors; // Also sum the colours of each band of rows into bands
+    giko_band_height_callback_t band_height;
+    void *user_data;
+    uint8_t *data;
+    uint8_t *rgb; // Colours of the row being decoded, width * 3 bytes, or
+                  // NULL. Filled by the decoder.
+    giko_color_bands_t *bands;
+} image_sink_t;
+
+// Block of an arena, followed by its bytes
+typedef struct arena_block {
+    struct arena_block *next; // Block allocated before this one
+    size_t size;              // Bytes after the header
+    size_t used;
+} arena_block_t;
+
+// Bump allocator. Allocations are freed all at once, by arena_reset or
+// arena_free. A reset arena keeps a single block large enough for all it
+// held, so filling it again the same way allocates nothing.
+typedef struct arena {
+    arena_block_t *blocks; // Block being allocated from, then older blocks
+    size_t block_size;     // Smallest size of a new block
+    size_t allocated;      // Bytes of every block allocated so far
+    int failed;            // Set once an allocation has failed
+} arena_t;
+
+// Per-thread scratch memory of a trace. Buffers are carved from arena.
+typedef struct trace_scratch {
+    arena_t arena;
+    uint8_t *patch;      // Patch of the reference, at most the widest pitch
+    uint8_t *wide_patch; // Patch of the widest advance, to be narrowed
+    int32_t *candidates; // Glyph indices, up to the largest bucket's count
+    int32_t *distances;  // Signature distance of each glyph of a bucket
+    int32_t *band_sums;  // Column prefix sums of set pixels of band_row
+    int band_row;        // Row whose band is summed, or -1
+    float *scores;       // Optimal segmentation: best score from each column
+    giko_match_t *first_matches; // First match of the best score
+    // [2 * num_advances] Match of a blank patch of each advance, then of a
+    // solid one, or 0 advances until first searched by uniform_match
+    giko_match_t *uniform_matches;
+    uint8_t *gray_patch; // Graymaps: patch with a byte per pixel
+    giko_stats_t counts; // Measures of this thread, added to the trace's
+                         // stats once it is done
+    giko_stats_t *stats; // &counts if the trace is measured, otherwise NULL
+    // Buffers of the thread leading a trace, grown as needed and kept across
+    // carves, so a pooled scratch traces the same sizes without allocating
+    codepoint_buffer_t string; // Row of a serial trace
+    row_encoder_t encoder;     // Rows being emitted
+    trace_slot_t *slots;       // Ring of rows of a parallel trace
+    int slot_capacity;
+    pthread_t *workers;
+    int worker_capacity;
+    uint8_t *blur; // Graymaps: row sums, then the reference blurred
+    size_t blur_capacity;
+    struct trace_scratch *next; // Next idle scratch of a context
+} trace_scratch_t;
+
+// Shared state of a glyph map build. Threads claim chunks of the charset
+// through next_index, and store the glyph of codepoint i in glyphs[i].
+typedef struct raster_job {
+    giko_codepoint_t *charset;
+    int num_codepoints;
+    int glyph_size;
+    giko_glyph_t **glyphs; // NULL where a codepoint has no glyph
+    int next_index;
+} raster_job_t;
+
+// Rasterizing thread of a glyph map build. Glyphs are allocated from the
+// thread's own arena, with its own face.
+typedef struct raster_worker {
+    raster_job_t *job;
+    FT_Face face;
+    arena_t arena;
+    uint64_t rasterized;
+} raster_worker_t;
+
+// Font face opened by a context. A face is used by one glyph map build at a
+// time, so builds of the same font at once each open a face.
+typedef struct context_face {
+    struct context_face *next;
+    char *filepath;
+    FT_Face face;
+    int in_use;
+} context_face_t;
+
+// The library, faces and idle scratches are guarded by lock. It is only held
+// while a face or scratch is handed out or returned, never while tracing.
+struct giko_context {
+    FT_Library library;
+    pthread_mutex_t lock;
+    context_face_t *faces;
+    trace_scratch_t *scratches;
+};
+
+// Counts the set bits of (a & b) over `size` bytes
+typedef int (*overlap_kernel_t)(const uint8_t *a, const uint8_t *b, int size);
+
+// Sums |a[i] - b[i]| over `size` bytes, a multiple of 32
+typedef int (*sad_kernel_t)(const uint8_t *a, const uint8_t *b, int size);
+
 // Precomputation for performance
 const int set_bits[256] = {
     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3, 2, 3, 3, 4,
@@ -52,48 +425,611 @@ const int set_bits[256] = {
 
 // Prototypes
 
-giko_glyph_t *new_glyph(FT_Face face, giko_codepoint_t codepoint);
+giko_glyph_t *new_glyph(FT_Face face, giko_codepoint_t codepoint,
+                        arena_t *arena);
 
-giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint);
+giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint,
+                                arena_t *arena);
 
-giko_glyph_t *insert_glyph(giko_glyph_t *glyph, giko_glyph_t *head,
-                           sort_order_t order);
+void init_bitmap(giko_bitmap_t *bitmap, int width, int height, uint8_t *data);
 
-giko_match_t best_scanline_match(giko_bitmap_t *reference,
-                                 giko_glyph_map_t *map, int x, int y,
-                                 float chunk_greed, float glyph_greed,
-                                 float noise_threshold,
-                                 int (*fidelity_function)(int));
+void *arena_alloc(arena_t *arena, size_t size);
 
-giko_match_t patch_match(giko_bitmap_t *reference, giko_glyph_t *head,
-                         float glyph_greed, float noise_threshold,
-                         int (*fidelity_function)(int));
+void arena_reset(arena_t *arena);
 
-float bitmap_similarity(giko_bitmap_t *reference, giko_bitmap_t *bitmap,
-                        float noise_threshold, int (*fidelity_function)(int));
+void arena_free(arena_t *arena);
 
-void free_glyph_list(giko_glyph_t *list);
+giko_glyph_map_t *rasterize_glyph_map(FT_Face *faces, int num_faces,
+                                      giko_codepoint_t *charset,
+                                      int glyph_size, sort_order_t order,
+                                      giko_stats_t *stats);
 
-// Helper functions
+int raster_threads(giko_codepoint_t *charset);
 
-int num_set_pixels(uint8_t pixel_byte) { return set_bits[pixel_byte]; }
+void *raster_worker(void *arg);
 
-int smaller_than(int x, int y) { return x < y; };
+int sort_glyph_lists(giko_glyph_t **glyphs, int num_glyphs,
+                     giko_glyph_t **lists, int num_advances,
+                     sort_order_t order);
 
-int larger_than(int x, int y) { return x > y; };
+int compare_glyphs_ascending(const void *a, const void *b);
 
-int return_true(int x, int y) {
-    (void)x;
-    (void)y;
-    return 1;
-}
+int compare_glyphs_descending(const void *a, const void *b);
+
+giko_glyph_map_t *measure_glyph_map(lazy_glyphs_t *lazy, FT_Face face,
+                                    giko_codepoint_t *charset, int glyph_size,
+                                    giko_stats_t *stats);
+
+void load_bucket(giko_glyph_map_t *map, int advance, giko_stats_t *stats);
+
+void load_all_buckets(giko_glyph_map_t *map, giko_stats_t *stats);
+
+void sort_lazy_bucket(giko_glyph_map_t *map, int advance);
+
+void finish_lazy_glyphs(lazy_glyphs_t *lazy);
+
+void free_lazy_glyphs(lazy_glyphs_t *lazy);
+
+void copy_glyph_bitmap(const FT_Bitmap *source, int x_offset, int y_offset,
+                       uint8_t *pixel_data, int width, int height);
+
+FT_Face acquire_face(giko_context_t *context, char *ttf_filepath);
+
+void release_face(giko_context_t *context, FT_Face face);
+
+giko_match_t best_scanline_match(trace_job_t *job, int x, int row,
+                                 trace_scratch_t *scratch);
+
+void load_band(trace_job_t *job, int row, trace_scratch_t *scratch);
+
+void band_patch(trace_job_t *job, int x, int advance, trace_scratch_t *scratch,
+                giko_bitmap_t *patch);
+
+void fill_patch(trace_job_t *job, int x, giko_bitmap_t *patch,
+                trace_scratch_t *scratch);
+
+void narrow_patch(const giko_bitmap_t *wide, giko_bitmap_t *patch);
+
+giko_match_t uniform_patch_match(trace_job_t *job, int advance, int solid,
+                                 trace_scratch_t *scratch);
+
+int uniform_match(trace_job_t *job, const giko_bitmap_t *patch,
+                  trace_scratch_t *scratch, giko_match_t *match);
+
+giko_match_t patch_match(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                         int advance, const giko_trace_options_t *options,
+                         trace_scratch_t *scratch);
+
+giko_match_t linear_patch_match(giko_bitmap_t *reference,
+                                giko_glyph_map_t *map, int advance,
+                                const giko_trace_options_t *options,
+                                trace_scratch_t *scratch);
+
+giko_match_t shortlist_patch_match(giko_bitmap_t *reference,
+                                   giko_glyph_map_t *map, int advance,
+                                   const giko_trace_options_t *options,
+                                   trace_scratch_t *scratch);
+
+void bitmap_signature(const uint8_t *data, int width, int height,
+                      uint8_t *signature);
+
+int signature_distance(const uint8_t *a, const uint8_t *b);
+
+int select_kth(int32_t *values, int count, int k);
+
+giko_match_t bounded_patch_match(giko_bitmap_t *reference,
+                                 giko_glyph_map_t *map, int advance,
+                                 const giko_trace_options_t *options,
+                                 trace_scratch_t *scratch);
+
+float similarity_bound(int reference_set_pixels, int glyph_set_pixels,
+                       int max_noise_pixels, int (*fidelity_function)(int));
+
+int compare_int32(const void *a, const void *b);
+
+float bucket_similarity_bound(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                              int advance, const giko_trace_options_t *options,
+                              trace_scratch_t *scratch);
+
+float bitmap_similarity(giko_bitmap_t *reference, const uint8_t *glyph,
+                        int glyph_set_pixels, float noise_threshold,
+                        int (*fidelity_function)(int));
+
+giko_glyph_map_t *pack_glyph_map(int num_advances, int em_height,
+                                 giko_glyph_t **lists);
+
+map_layout_t map_layout(int num_advances, int num_glyphs, size_t atlas_size);
+
+void set_map_arrays(giko_glyph_map_t *map, map_layout_t layout);
+
+size_t atlas_size(glyph_bucket_t *buckets, int num_advances, int em_height);
+
+void sort_by_set_pixels(giko_glyph_map_t *map);
+
+void sort_bucket_by_set_pixels(giko_glyph_map_t *map, int advance);
+
+size_t align_up(size_t size, size_t alignment);
+
+trace_scratch_t *new_scratch(trace_job_t *job);
+
+int carve_scratch(trace_job_t *job, trace_scratch_t *scratch);
+
+void free_scratch(trace_scratch_t *scratch);
+
+trace_scratch_t *acquire_scratch(trace_job_t *job);
+
+void release_scratch(trace_job_t *job, trace_scratch_t *scratch);
+
+size_t scratch_heap_bytes(trace_scratch_t *scratch);
+
+size_t string_bytes(codepoint_buffer_t *string);
+
+int reserve_slots(trace_scratch_t *scratch, int window, int num_threads);
+
+int push_codepoint(codepoint_buffer_t *string, giko_codepoint_t codepoint);
+
+int push_glyph(codepoint_buffer_t *string, giko_codepoint_t codepoint,
+               int advance);
+
+int trace_row(trace_job_t *job, int row, trace_scratch_t *scratch,
+              codepoint_buffer_t *string);
+
+uint64_t staged_ns(const giko_stats_t *stats);
+
+int trace_row_greedy(trace_job_t *job, int row, trace_scratch_t *scratch,
+                     codepoint_buffer_t *string);
+
+int trace_row_optimal(trace_job_t *job, int row, trace_scratch_t *scratch,
+                      codepoint_buffer_t *string);
+
+void init_trace_job(trace_job_t *job, int width, int height,
+                    giko_glyph_map_t *map, const giko_trace_options_t *options,
+                    giko_row_callback_t callback, void *user_data);
+
+int prepare_graymap_job(trace_job_t *job, trace_scratch_t *lead);
+
+gray_glyphs_t *map_gray_glyphs(giko_glyph_map_t *map, giko_stats_t *stats);
+
+gray_glyphs_t *new_gray_glyphs(giko_glyph_map_t *map, giko_stats_t *stats);
+
+void free_gray_glyphs(gray_glyphs_t *gray);
+
+void box_blur(const uint8_t *source, int source_pitch, uint8_t *destination,
+              int destination_pitch, int width, int height, int radius,
+              uint32_t *rows);
+
+giko_match_t gray_scanline_match(trace_job_t *job, int x, int row,
+                                 trace_scratch_t *scratch);
+
+giko_match_t gray_patch_match(trace_job_t *job, int x, int row, int advance,
+                              trace_scratch_t *scratch);
+
+int run_trace_job(trace_job_t *job);
+
+trace_scratch_t *acquire_lead_scratch(trace_job_t *job);
+
+int reset_frame_tracer(giko_frame_tracer_t *tracer, giko_bitmap_t *frame);
+
+void mark_frame_changes(giko_frame_tracer_t *tracer, giko_bitmap_t *frame);
+
+giko_match_t cached_scanline_match(trace_job_t *job, int row, int x,
+                                   trace_scratch_t *scratch);
+
+void *trace_worker(void *arg);
+
+int trace_rows_serial(trace_job_t *job, trace_scratch_t *lead);
+
+int trace_rows_parallel(trace_job_t *job, trace_scratch_t *lead,
+                        int num_threads);
+
+int emit_row(trace_job_t *job, int row, codepoint_buffer_t *string,
+             row_encoder_t *encoder, giko_stats_t *stats);
+
+void add_stats(giko_stats_t *total, const giko_stats_t *part);
+
+int sample_row_colors(trace_job_t *job, int row, codepoint_buffer_t *string,
+                      row_encoder_t *encoder);
+
+giko_color_t cell_color(trace_job_t *job, int x, int row, int advance);
+
+void free_row_encoder(row_encoder_t *encoder);
+
+glyph_entry_t *new_glyph_index(giko_glyph_map_t *map);
+
+int compare_glyph_entries(const void *a, const void *b);
+
+const glyph_entry_t *find_glyph(const glyph_entry_t *index, int num_glyphs,
+                                giko_codepoint_t codepoint);
+
+void draw_glyph(giko_bitmap_t *bitmap, int x, int y, const uint8_t *glyph,
+                int advance, int em_height);
+
+int append_row(const giko_row_t *row, void *user_data);
+
+int gather_view(const giko_bitmap_view_t *view, uint8_t *destination,
+                int pitch);
+
+int overlap_pixels(const uint8_t *a, const uint8_t *b, int size);
+
+int sad_pixels(const uint8_t *a, const uint8_t *b, int size);
+
+int decode_image(FILE *file, image_sink_t *sink);
+
+int read_pnm(FILE *file, char format, image_sink_t *sink);
+
+int read_bmp(FILE *file, image_sink_t *sink);
+
+#ifdef GIKO_PNG
+int read_png(FILE *file, image_sink_t *sink);
+
+int read_png_header(png_structp png, png_infop info, FILE *file);
+
+int read_png_rows(png_structp png, image_sink_t *sink, int channels, int rows,
+                  png_bytep *row_pointers, uint8_t *luma);
+#endif
+
+int read_pnm_value(FILE *file, int *value);
+
+int skip_bytes(FILE *file, long count);
+
+int new_image_sink(image_sink_t *sink, int width, int height);
+
+void sink_luma_row(image_sink_t *sink, int row, const uint8_t *luma);
+
+void sink_bits_row(image_sink_t *sink, int row, const uint8_t *bits);
+
+void sum_row_colors(image_sink_t *sink, int row);
+
+uint8_t *sink_rgb_row(image_sink_t *sink);
+
+void free_image_sink(image_sink_t *sink);
+
+void finish_color_sink(image_sink_t *sink, giko_color_bands_t **colors);
+
+giko_bitmap_t *finish_image_sink(image_sink_t *sink,
+                                 giko_color_bands_t **colors);
+
+giko_graymap_t *finish_graymap_sink(image_sink_t *sink,
+                                    giko_color_bands_t **colors);
+
+int valid_map_buckets(giko_glyph_map_t *map, uint64_t atlas_size);
+
+// Helper functions
+
+int num_set_pixels(uint8_t pixel_byte) { return set_bits[pixel_byte]; }
 
 int quadratic(int x) { return x * x; }
 
 int pitch_32bit(int width) { return ((width + 31) / 32) * 4; }
 
+int pitch_gray(int width) { return ((width + 31) / 32) * 32; }
+
 int floor_frac_pixel(long frac_pixel) { return frac_pixel >> 6; }
 
+// Rasterize a bucket of a lazy map if it is not yet. Once a bucket is ready
+// its arrays never change, so they are read without the lock.
+static inline void require_bucket(giko_glyph_map_t *map, int advance,
+                                  giko_stats_t *stats) {
+    if (map->lazy &&
+        !__atomic_load_n(&map->lazy->ready[advance], __ATOMIC_ACQUIRE))
+        load_bucket(map, advance, stats);
+}
+
+// Rec. 709 luminance of an 8 bit colour
+static inline uint8_t rgb_luma(int red, int green, int blue) {
+    return (54 * red + 183 * green + 19 * blue) >> 8;
+}
+
+// Similarity engines
+//
+// Every engine counts the set bits of (a & b). Bitmap buffers are padded to a
+// 32 bit pitch, so `size` is always a multiple of 4 bytes and the word engines
+// only need a single 32 bit tail. All engines return identical counts.
+
+static inline uint64_t load_u64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint32_t load_u32(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// Pixel data is stored most significant bit first, so words loaded from it
+// must be big-endian for shifts to move pixels left and right.
+static inline uint64_t load_u64_be(const uint8_t *p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(load_u64(p));
+#elif defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return load_u64(p);
+#else
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++) {
+        word = (word << 8) | p[i];
+    }
+    return word;
+#endif
+}
+
+static inline void store_u32_be(uint8_t *p, uint32_t word) {
+    p[0] = word >> 24;
+    p[1] = word >> 16;
+    p[2] = word >> 8;
+    p[3] = word;
+}
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define popcount64(x) __builtin_popcountll(x)
+#define popcount32(x) __builtin_popcount(x)
+#else
+#define ALWAYS_INLINE inline
+
+static inline int popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static inline int popcount32(uint32_t x) { return popcount64(x); }
+#endif
+
+static int overlap_lut(const uint8_t *a, const uint8_t *b, int size) {
+    int count = 0;
+    for (int i = 0; i < size; i++) {
+        count += num_set_pixels(a[i] & b[i]);
+    }
+    return count;
+}
+
+static ALWAYS_INLINE int overlap_words(const uint8_t *a, const uint8_t *b,
+                                       int size) {
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        count += popcount64(load_u64(a + i) & load_u64(b + i));
+    }
+    if (i < size) {
+        count += popcount32(load_u32(a + i) & load_u32(b + i));
+    }
+    return count;
+}
+
+static int overlap_word64(const uint8_t *a, const uint8_t *b, int size) {
+    return overlap_words(a, b, size);
+}
+
+#ifdef X86_DISPATCH
+__attribute__((target("popcnt"))) static int
+overlap_popcnt(const uint8_t *a, const uint8_t *b, int size) {
+    return overlap_words(a, b, size);
+}
+
+// Nibble lookup popcount (Mula et al.), summed with vpsadbw
+__attribute__((target("avx2,popcnt"))) static int
+overlap_avx2(const uint8_t *a, const uint8_t *b, int size) {
+    const __m256i lookup =
+        _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                         1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    __m256i sum = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i v = _mm256_and_si256(va, vb);
+        __m256i lo = _mm256_and_si256(v, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                        _mm256_shuffle_epi8(lookup, hi));
+        sum = _mm256_add_epi64(
+            sum, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+
+    int count = _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+                _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    return count + overlap_words(a + i, b + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) static int
+overlap_avx512(const uint8_t *a, const uint8_t *b, int size) {
+    __m512i sum = _mm512_setzero_si512();
+
+    int i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i va = _mm512_loadu_si512((const void *)(a + i));
+        __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+        sum = _mm512_add_epi64(sum,
+                               _mm512_popcnt_epi64(_mm512_and_si512(va, vb)));
+    }
+
+    int count = _mm512_reduce_add_epi64(sum);
+    return count + overlap_words(a + i, b + i, size - i);
+}
+#endif
+
+static int sad_scalar(const uint8_t *a, const uint8_t *b, int size) {
+    int sum = 0;
+    for (int i = 0; i < size; i++) {
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return sum;
+}
+
+#ifdef X86_DISPATCH
+__attribute__((target("sse2"))) static int
+sad_sse2(const uint8_t *a, const uint8_t *b, int size) {
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < size; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+    }
+    return _mm_cvtsi128_si32(_mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum)));
+}
+
+__attribute__((target("avx2"))) static int
+sad_avx2(const uint8_t *a, const uint8_t *b, int size) {
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < size; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(va, vb));
+    }
+    return _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+           _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+}
+#endif
+
+static giko_engine_t active_engine = ENGINE_AUTO;
+// Kernels of bitmaps smaller than AUTO_VECTOR_MIN_BYTES, and of the rest.
+// Only ENGINE_AUTO sets different ones.
+static overlap_kernel_t overlap_kernel = NULL;
+static overlap_kernel_t wide_overlap_kernel = NULL;
+static sad_kernel_t sad_kernel = NULL;
+
+// Widest engine supported by the CPU
+static giko_engine_t widest_engine(void) {
+#ifdef X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq"))
+        return ENGINE_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return ENGINE_AVX2;
+#endif
+    return ENGINE_WORD;
+}
+
+static overlap_kernel_t engine_kernel(giko_engine_t engine) {
+    switch (engine) {
+    case ENGINE_LUT:
+        return overlap_lut;
+    case ENGINE_WORD:
+#ifdef X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("popcnt"))
+            return overlap_popcnt;
+#endif
+        return overlap_word64;
+#ifdef X86_DISPATCH
+    case ENGINE_AVX2:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return overlap_avx2;
+        return NULL;
+    case ENGINE_AVX512:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512vpopcntdq"))
+            return overlap_avx512;
+        return NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+// Graymap kernel of an engine supported by the CPU
+static sad_kernel_t engine_sad_kernel(giko_engine_t engine) {
+#ifdef X86_DISPATCH
+    if (engine == ENGINE_AVX2 || engine == ENGINE_AVX512) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return sad_avx2;
+    }
+    if (engine != ENGINE_LUT)
+        return sad_sse2;
+#else
+    (void)engine;
+#endif
+    return sad_scalar;
+}
+
+int giko_set_engine(giko_engine_t engine) {
+    // Vector kernels only pay off once there are enough bytes to outweigh
+    // their setup and reduction, so small bitmaps are compared by words
+    giko_engine_t wide = engine == ENGINE_AUTO ? widest_engine() : engine;
+    overlap_kernel_t kernel =
+        engine_kernel(engine == ENGINE_AUTO ? ENGINE_WORD : engine);
+    overlap_kernel_t wide_kernel = engine_kernel(wide);
+    if (!kernel || !wide_kernel) {
+        fprintf(stderr, "Error: %s engine is not supported on this CPU\n",
+                giko_engine_name(engine));
+        return EXIT_FAILURE;
+    }
+
+    __atomic_store_n(&active_engine, engine, __ATOMIC_RELAXED);
+    __atomic_store_n(&sad_kernel, engine_sad_kernel(wide), __ATOMIC_RELEASE);
+    __atomic_store_n(&wide_overlap_kernel, wide_kernel, __ATOMIC_RELEASE);
+    __atomic_store_n(&overlap_kernel, kernel, __ATOMIC_RELEASE);
+    return EXIT_SUCCESS;
+}
+
+giko_engine_t giko_get_engine(void) {
+    if (!__atomic_load_n(&overlap_kernel, __ATOMIC_ACQUIRE))
+        giko_set_engine(ENGINE_AUTO);
+    return __atomic_load_n(&active_engine, __ATOMIC_RELAXED);
+}
+
+const char *giko_engine_name(giko_engine_t engine) {
+    switch (engine) {
+    case ENGINE_AUTO:
+        return "auto";
+    case ENGINE_LUT:
+        return "lut";
+    case ENGINE_WORD:
+        return "word64";
+    case ENGINE_AVX2:
+        return "avx2";
+    case ENGINE_AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+uint64_t giko_stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Add every counter of part to total. Traces may share a giko_stats_t, so
+// counters are added atomically. Every field is a uint64_t.
+void add_stats(giko_stats_t *total, const giko_stats_t *part) {
+    uint64_t *totals = (uint64_t *)total;
+    const uint64_t *parts = (const uint64_t *)part;
+    for (size_t i = 0; i < sizeof(giko_stats_t) / sizeof(uint64_t); i++) {
+        if (parts[i])
+            __atomic_fetch_add(&totals[i], parts[i], __ATOMIC_RELAXED);
+    }
+}
+
+int overlap_pixels(const uint8_t *a, const uint8_t *b, int size) {
+    overlap_kernel_t *slot =
+        size < AUTO_VECTOR_MIN_BYTES ? &overlap_kernel : &wide_overlap_kernel;
+    overlap_kernel_t kernel = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!kernel) {
+        giko_set_engine(ENGINE_AUTO);
+        kernel = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+    return kernel(a, b, size);
+}
+
+int sad_pixels(const uint8_t *a, const uint8_t *b, int size) {
+    sad_kernel_t kernel = __atomic_load_n(&sad_kernel, __ATOMIC_ACQUIRE);
+    if (!kernel) {
+        giko_set_engine(ENGINE_AUTO);
+        kernel = __atomic_load_n(&sad_kernel, __ATOMIC_ACQUIRE);
+    }
+    return kernel(a, b, size);
+}
+
 // Main functions
 
 giko_bitmap_t *giko_new_bitmap(int width, int height, uint8_t *data) {
@@ -102,7 +1038,11 @@ giko_bitmap_t *giko_new_bitmap(int width, int height, uint8_t *data) {
         perror("Error allocating memory");
         return NULL;
     }
+    init_bitmap(bitmap, width, height, data);
+    return bitmap;
+}
 
+void init_bitmap(giko_bitmap_t *bitmap, int width, int height, uint8_t *data) {
     int pitch = pitch_32bit(width);
     bitmap->width = width;
     bitmap->pitch = pitch;
@@ -111,13 +1051,20 @@ giko_bitmap_t *giko_new_bitmap(int width, int height, uint8_t *data) {
     bitmap->real_size = height * width;
     bitmap->data = data;
 
-    int num_pixels = 0;
-    for (int i = 0; i < bitmap->buffer_size; i++) {
-        num_pixels += num_set_pixels(bitmap->data[i]);
-    }
-    bitmap->set_pixels = num_pixels;
+    bitmap->set_pixels = overlap_pixels(data, data, bitmap->buffer_size);
+}
 
-    return bitmap;
+giko_graymap_t *giko_new_graymap(int width, int height, uint8_t *data) {
+    giko_graymap_t *graymap = malloc(sizeof(giko_graymap_t));
+    if (!graymap) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    graymap->width = width;
+    graymap->pitch = pitch_gray(width);
+    graymap->height = height;
+    graymap->data = data;
+    return graymap;
 }
 
 void giko_flip_bitmap(giko_bitmap_t *bitmap) {
@@ -145,6 +1092,47 @@ void giko_negate_bitmap(giko_bitmap_t *bitmap) {
     }
 }
 
+giko_bitmap_t *giko_dither_graymap(giko_graymap_t *graymap) {
+    int width = graymap->width;
+    int pitch = pitch_32bit(width);
+    uint8_t *pixel_data = calloc((size_t)pitch * graymap->height, 1);
+    // Error diffused into the current and next row, with a column of margin
+    // on both sides
+    int *errors = calloc(2 * (width + 2), sizeof(int));
+    if (!pixel_data || !errors) {
+        perror("Error allocating memory");
+        free(pixel_data);
+        free(errors);
+        return NULL;
+    }
+
+    int *current = errors + 1;
+    int *next = errors + width + 3;
+    for (int y = 0; y < graymap->height; y++) {
+        const uint8_t *row = graymap->data + (size_t)y * graymap->pitch;
+        uint8_t *destination = pixel_data + (size_t)y * pitch;
+        for (int x = 0; x < width; x++) {
+            int value = row[x] + current[x] / 16;
+            int set = value >= 128;
+            if (set)
+                destination[x / 8] |= 0x80 >> (x % 8);
+
+            int error = value - (set ? 255 : 0);
+            current[x + 1] += error * 7;
+            next[x - 1] += error * 3;
+            next[x] += error * 5;
+            next[x + 1] += error;
+        }
+        int *swap = current;
+        current = next;
+        next = swap;
+        memset(next - 1, 0, (width + 2) * sizeof(int));
+    }
+
+    free(errors);
+    return giko_new_bitmap(width, graymap->height, pixel_data);
+}
+
 giko_bitmap_t *giko_crop_bitmap(giko_bitmap_t *bitmap, int x_offset,
                                 int y_offset, int width, int height) {
     assert(x_offset >= 0);
@@ -153,160 +1141,921 @@ giko_bitmap_t *giko_crop_bitmap(giko_bitmap_t *bitmap, int x_offset,
     assert(height >= 0);
 
     int pitch = pitch_32bit(width);
-    uint8_t *pixel_data = calloc(pitch * height, sizeof(int8_t));
+    uint8_t *pixel_data = malloc(pitch * height * sizeof(uint8_t));
     if (!pixel_data) {
         perror("Error allocating memory");
         return NULL;
     }
 
-    // Copy patch
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int src_x = x + x_offset;
-            int src_y = y + y_offset;
+    giko_bitmap_view_t view =
+        giko_view_bitmap(bitmap, x_offset, y_offset, width, height);
+    gather_view(&view, pixel_data, pitch);
 
-            if (src_x < bitmap->width && src_y < bitmap->height) {
-                int src_byte_index = src_y * bitmap->pitch + (src_x / 8);
-                int src_bit_index = src_x % 8;
-                int dst_byte_index = y * pitch + (x / 8);
-                int dst_bit_index = x % 8;
+    return giko_new_bitmap(width, height, pixel_data);
+}
 
-                int8_t src_bit_mask = (1 << (7 - src_bit_index));
-                int8_t dst_bit_mask = (1 << (7 - dst_bit_index));
+giko_bitmap_view_t giko_view_bitmap(giko_bitmap_t *bitmap, int x_offset,
+                                    int y_offset, int width, int height) {
+    assert(x_offset >= 0);
+    assert(y_offset >= 0);
+    assert(width >= 0);
+    assert(height >= 0);
 
-                if (bitmap->data[src_byte_index] & src_bit_mask) {
-                    pixel_data[dst_byte_index] |= dst_bit_mask;
-                }
-            }
+    giko_bitmap_view_t view;
+    view.data = bitmap->data;
+    view.bit_offset = x_offset;
+    view.stride = bitmap->pitch;
+    view.width = width;
+    view.height = height;
+    view.valid_width = bitmap->width - x_offset;
+    view.valid_height = bitmap->height - y_offset;
+
+    if (view.valid_width > width)
+        view.valid_width = width;
+    if (view.valid_width < 0)
+        view.valid_width = 0;
+    if (view.valid_height > height)
+        view.valid_height = height;
+    if (view.valid_height < 0)
+        view.valid_height = 0;
+    if (view.valid_height > 0)
+        view.data += y_offset * bitmap->pitch;
+
+    return view;
+}
+
+// Load the 32 pixels of a view row starting at column word * 32, with
+// the left-most pixel in the most significant bit.
+static inline uint32_t view_word(const giko_bitmap_view_t *view, int row,
+                                 int word) {
+    int valid_bits = view->valid_width - word * 32;
+    if (valid_bits <= 0)
+        return 0;
+
+    int bit = view->bit_offset + word * 32;
+    int byte = bit >> 3;
+    const uint8_t *src = view->data + row * view->stride + byte;
+
+    uint64_t bits = 0;
+    if (byte + 8 <= view->stride) {
+        bits = load_u64_be(src);
+    } else {
+        // Near the end of the row, avoid reading past the end of the buffer
+        int remaining = view->stride - byte;
+        for (int i = 0; i < 8; i++) {
+            bits = (bits << 8) | (i < remaining ? src[i] : 0);
         }
     }
 
-    return giko_new_bitmap(width, height, pixel_data);
+    uint32_t pixels = (bits << (bit & 7)) >> 32;
+    if (valid_bits < 32)
+        pixels &= ~(uint32_t)0 << (32 - valid_bits);
+    return pixels;
+}
+
+// Copy the pixels of a view into a buffer with the given pitch, padding
+// with unset pixels. Returns the number of set pixels copied.
+int gather_view(const giko_bitmap_view_t *view, uint8_t *destination,
+                int pitch) {
+    int words = pitch / 4;
+    int set_pixels = 0;
+
+    for (int row = 0; row < view->height; row++) {
+        uint8_t *dst = destination + row * pitch;
+        if (row >= view->valid_height) {
+            memset(dst, 0, pitch);
+            continue;
+        }
+        for (int word = 0; word < words; word++) {
+            uint32_t pixels = view_word(view, row, word);
+            store_u32_be(dst + word * 4, pixels);
+            set_pixels += popcount32(pixels);
+        }
+    }
+
+    return set_pixels;
 }
 
 giko_glyph_map_t *giko_new_glyph_map(char *ttf_filepath,
                                      giko_codepoint_t *charset, int glyph_size,
-                                     sort_order_t order) {
+                                     sort_order_t order, giko_stats_t *stats) {
     assert(glyph_size > 0);
     assert(0 <= order && 3 >= order);
 
-    giko_glyph_map_t *map = malloc(sizeof(giko_glyph_map_t));
-    if (!map) {
-        perror("Error allocating memory");
-        return NULL;
-    }
-
     FT_Library library;
-    FT_Face face;
     int error;
     error = FT_Init_FreeType(&library);
     if (error) {
         fprintf(stderr, "Error: Freetype library initialisation\n");
         return NULL;
     }
-    error = FT_New_Face(library, ttf_filepath, 0, &face);
-    if (error) {
+    int num_faces = raster_threads(charset);
+    FT_Face *faces = malloc(num_faces * sizeof(FT_Face));
+    if (!faces) {
+        perror("Error allocating memory");
+        FT_Done_FreeType(library);
+        return NULL;
+    }
+    // Faces are opened here rather than by each thread, as the library is
+    // not safe to open faces with from several threads
+    for (int i = 0; i < num_faces; i++) {
+        if (FT_New_Face(library, ttf_filepath, 0, &faces[i])) {
+            num_faces = i;
+            break;
+        }
+    }
+    if (num_faces == 0) {
         fprintf(stderr, "Error: Freetype face could not be initialised. Check "
                         "that the filepath is correct and that the font file "
                         "is in a supported format\n");
+        free(faces);
+        FT_Done_FreeType(library);
+        return NULL;
     }
-    FT_Set_Pixel_Sizes(face, 0, glyph_size);
 
-    int max_advance = floor_frac_pixel(face->size->metrics.max_advance) + 1;
-    map->num_advances = max_advance;
-    map->em_height = floor_frac_pixel(face->size->metrics.height);
+    giko_glyph_map_t *map = rasterize_glyph_map(faces, num_faces, charset,
+                                                glyph_size, order, stats);
+    for (int i = 0; i < num_faces; i++)
+        FT_Done_Face(faces[i]);
+    free(faces);
+    FT_Done_FreeType(library);
+    return map;
+}
+
+// Build a glyph map from open faces of one font, which are left open. A
+// thread is started for each face but the first, which the calling thread
+// rasterizes with.
+giko_glyph_map_t *rasterize_glyph_map(FT_Face *faces, int num_faces,
+                                      giko_codepoint_t *charset,
+                                      int glyph_size, sort_order_t order,
+                                      giko_stats_t *stats) {
+    assert(glyph_size > 0);
+    assert(0 <= order && 3 >= order);
 
-    map->glyphs = calloc(max_advance, sizeof(giko_glyph_t *));
-    if (!map->glyphs) {
+    giko_stats_t counts = {0};
+    giko_stats_t *measure = stats ? &counts : NULL;
+    uint64_t begin = STAGE_BEGIN(measure);
+    FT_Set_Pixel_Sizes(faces[0], 0, glyph_size);
+    int max_advance =
+        floor_frac_pixel(faces[0]->size->metrics.max_advance) + 1;
+    int em_height = floor_frac_pixel(faces[0]->size->metrics.height);
+
+    raster_job_t job = {0};
+    job.charset = charset;
+    job.glyph_size = glyph_size;
+    while (charset[job.num_codepoints] != TERMINAL_CODEPOINT)
+        job.num_codepoints++;
+    job.glyphs = calloc(job.num_codepoints + 1, sizeof(giko_glyph_t *));
+    giko_glyph_t **lists = calloc(max_advance, sizeof(giko_glyph_t *));
+    raster_worker_t *workers = calloc(num_faces, sizeof(raster_worker_t));
+    pthread_t *threads = malloc(num_faces * sizeof(pthread_t));
+    if (!job.glyphs || !lists || !workers || !threads) {
         perror("Error allocating memory");
-        FT_Done_Face(face);
-        FT_Done_FreeType(library);
+        free(job.glyphs);
+        free(lists);
+        free(workers);
+        free(threads);
         return NULL;
     }
 
-    int index = 0;
-    int codepoint = charset[index];
-    while (codepoint != TERMINAL_CODEPOINT) {
-        giko_glyph_t *glyph = new_glyph(face, codepoint);
-        if (!glyph) {
-            index++;
-            codepoint = charset[index];
-            continue;
+    // Glyphs are only needed until they are packed into the atlas, so each
+    // thread allocates them from an arena
+    int started = 1;
+    for (int i = 0; i < num_faces; i++) {
+        workers[i].job = &job;
+        workers[i].face = faces[i];
+        workers[i].arena.block_size = GLYPH_ARENA_BLOCK_SIZE;
+    }
+    while (started < num_faces &&
+           pthread_create(&threads[started], NULL, raster_worker,
+                          &workers[started]) == 0)
+        started++;
+    raster_worker(&workers[0]);
+    int failed = 0;
+    for (int i = 0; i < started; i++) {
+        if (i > 0)
+            pthread_join(threads[i], NULL);
+        failed |= workers[i].arena.failed;
+        counts.glyphs_rasterized += workers[i].rasterized;
+        counts.bytes_allocated += workers[i].arena.allocated;
+    }
+    STAGE_END(measure, rasterize_ns, begin);
+
+    giko_glyph_map_t *map = NULL;
+    if (!failed) {
+        begin = STAGE_BEGIN(measure);
+        if (sort_glyph_lists(job.glyphs, job.num_codepoints, lists,
+                             max_advance, order) == EXIT_SUCCESS)
+            map = pack_glyph_map(max_advance, em_height, lists);
+        STAGE_END(measure, pack_ns, begin);
+    }
+    for (int i = 0; i < started; i++)
+        arena_free(&workers[i].arena);
+    free(job.glyphs);
+    free(lists);
+    free(workers);
+    free(threads);
+    if (map && stats) {
+        counts.bytes_allocated += sizeof(giko_glyph_map_t) + map->image_size;
+        add_stats(stats, &counts);
+    }
+    return map;
+}
+
+// Number of threads to rasterize a charset with
+int raster_threads(giko_codepoint_t *charset) {
+    int num_codepoints = 0;
+    while (charset[num_codepoints] != TERMINAL_CODEPOINT)
+        num_codepoints++;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = num_codepoints / GLYPHS_PER_RASTER_THREAD;
+    if (num_threads > num_cpus)
+        num_threads = num_cpus;
+    return num_threads > 1 ? num_threads : 1;
+}
+
+void *raster_worker(void *arg) {
+    raster_worker_t *worker = arg;
+    raster_job_t *job = worker->job;
+    FT_Set_Pixel_Sizes(worker->face, 0, job->glyph_size);
+    while (!worker->arena.failed) {
+        int start = __atomic_fetch_add(&job->next_index, RASTER_CHUNK_SIZE,
+                                       __ATOMIC_RELAXED);
+        if (start >= job->num_codepoints)
+            break;
+        int end = start + RASTER_CHUNK_SIZE;
+        if (end > job->num_codepoints)
+            end = job->num_codepoints;
+        for (int i = start; i < end && !worker->arena.failed; i++) {
+            giko_glyph_t *glyph =
+                new_glyph(worker->face, job->charset[i], &worker->arena);
+            if (!glyph)
+                continue;
+            glyph->index = i;
+            job->glyphs[i] = glyph;
+            worker->rasterized++;
         }
-        int advance = glyph->advance;
+    }
+    return NULL;
+}
 
-        map->glyphs[advance] =
-            insert_glyph(glyph, map->glyphs[advance], DESCENDING);
+// Link glyphs into a list per advance, sorted by set pixels in the given
+// order. Ties, and every glyph with NONE, keep the order of the charset.
+// Glyphs wider than the face's maximum advance cannot be bucketed and are
+// left out.
+int sort_glyph_lists(giko_glyph_t **glyphs, int num_glyphs,
+                     giko_glyph_t **lists, int num_advances,
+                     sort_order_t order) {
+    int *ends = calloc(num_advances + 1, sizeof(int));
+    giko_glyph_t **sorted = malloc((num_glyphs + 1) * sizeof(giko_glyph_t *));
+    if (!ends || !sorted) {
+        perror("Error allocating memory");
+        free(ends);
+        free(sorted);
+        return EXIT_FAILURE;
+    }
 
-        index++;
-        codepoint = charset[index];
+    // Counting sort the glyphs into buckets, keeping charset order. ends[a]
+    // starts as the first index of bucket a and ends one past its last.
+    for (int i = 0; i < num_glyphs; i++) {
+        if (glyphs[i] && glyphs[i]->advance < num_advances)
+            ends[glyphs[i]->advance + 1]++;
+    }
+    for (int advance = 0; advance < num_advances; advance++)
+        ends[advance + 1] += ends[advance];
+    for (int i = 0; i < num_glyphs; i++) {
+        if (glyphs[i] && glyphs[i]->advance < num_advances)
+            sorted[ends[glyphs[i]->advance]++] = glyphs[i];
+    }
+
+    int start = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        giko_glyph_t **bucket = sorted + start;
+        int count = ends[advance] - start;
+        if (order == ASCENDING)
+            qsort(bucket, count, sizeof(*bucket), compare_glyphs_ascending);
+        if (order == DESCENDING)
+            qsort(bucket, count, sizeof(*bucket), compare_glyphs_descending);
+        lists[advance] = NULL;
+        for (int i = count - 1; i >= 0; i--) {
+            bucket[i]->next = lists[advance];
+            lists[advance] = bucket[i];
+        }
+        start = ends[advance];
+    }
+    free(ends);
+    free(sorted);
+    return EXIT_SUCCESS;
+}
+
+int compare_glyphs_ascending(const void *a, const void *b) {
+    const giko_glyph_t *glyph_a = *(giko_glyph_t *const *)a;
+    const giko_glyph_t *glyph_b = *(giko_glyph_t *const *)b;
+    if (glyph_a->bitmap->set_pixels != glyph_b->bitmap->set_pixels)
+        return glyph_a->bitmap->set_pixels < glyph_b->bitmap->set_pixels ? -1
+                                                                         : 1;
+    return glyph_a->index - glyph_b->index;
+}
+
+int compare_glyphs_descending(const void *a, const void *b) {
+    const giko_glyph_t *glyph_a = *(giko_glyph_t *const *)a;
+    const giko_glyph_t *glyph_b = *(giko_glyph_t *const *)b;
+    if (glyph_a->bitmap->set_pixels != glyph_b->bitmap->set_pixels)
+        return glyph_a->bitmap->set_pixels > glyph_b->bitmap->set_pixels ? -1
+                                                                         : 1;
+    return glyph_a->index - glyph_b->index;
+}
+
+giko_glyph_map_t *giko_new_lazy_glyph_map(char *ttf_filepath,
+                                          giko_codepoint_t *charset,
+                                          int glyph_size, sort_order_t order,
+                                          giko_stats_t *stats) {
+    assert(glyph_size > 0);
+    assert(0 <= order && 3 >= order);
+
+    lazy_glyphs_t *lazy = calloc(1, sizeof(lazy_glyphs_t));
+    if (!lazy) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    pthread_mutex_init(&lazy->lock, NULL);
+    lazy->order = order;
+    if (FT_Init_FreeType(&lazy->library)) {
+        fprintf(stderr, "Error: Freetype library initialisation\n");
+        lazy->library = NULL;
+        free_lazy_glyphs(lazy);
+        return NULL;
+    }
+    FT_Face face;
+    if (FT_New_Face(lazy->library, ttf_filepath, 0, &face)) {
+        fprintf(stderr, "Error: Freetype face could not be initialised. Check "
+                        "that the filepath is correct and that the font file "
+                        "is in a supported format\n");
+        free_lazy_glyphs(lazy);
+        return NULL;
     }
 
+    // Outlines do not refer to the face, so it is closed straight away
+    giko_glyph_map_t *map =
+        measure_glyph_map(lazy, face, charset, glyph_size, stats);
     FT_Done_Face(face);
-    FT_Done_FreeType(library);
+    if (!map)
+        free_lazy_glyphs(lazy);
     return map;
 }
 
-giko_glyph_t *new_glyph(FT_Face face, giko_codepoint_t codepoint) {
-    giko_glyph_t *glyph = malloc(sizeof(giko_glyph_t));
-    if (!glyph) {
+// Lay out a lazy glyph map from the advance of each glyph of the charset,
+// keeping the hinted outlines to render later. Glyphs are placed in their
+// buckets in charset order.
+giko_glyph_map_t *measure_glyph_map(lazy_glyphs_t *lazy, FT_Face face,
+                                    giko_codepoint_t *charset, int glyph_size,
+                                    giko_stats_t *stats) {
+    giko_stats_t counts = {0};
+    giko_stats_t *measure = stats ? &counts : NULL;
+    uint64_t begin = STAGE_BEGIN(measure);
+    FT_Set_Pixel_Sizes(face, 0, glyph_size);
+    int num_advances = floor_frac_pixel(face->size->metrics.max_advance) + 1;
+    int em_height = floor_frac_pixel(face->size->metrics.height);
+    lazy->ascent = floor_frac_pixel(face->size->metrics.ascender);
+
+    int num_codepoints = 0;
+    while (charset[num_codepoints] != TERMINAL_CODEPOINT)
+        num_codepoints++;
+    // Outline and advance of each codepoint of the charset
+    FT_Glyph *outlines = calloc(num_codepoints + 1, sizeof(FT_Glyph));
+    int *advances = malloc((num_codepoints + 1) * sizeof(int));
+    glyph_bucket_t *buckets = calloc(num_advances, sizeof(glyph_bucket_t));
+    lazy->ready = calloc(num_advances, sizeof(uint8_t));
+    if (!outlines || !advances || !buckets || !lazy->ready) {
         perror("Error allocating memory");
+        free(outlines);
+        free(advances);
+        free(buckets);
         return NULL;
     }
-    glyph->codepoint = codepoint;
-    glyph->bitmap = new_glyph_bitmap(face, codepoint);
-    if (!glyph->bitmap) {
-        free(glyph);
+
+    // Glyphs wider than the face's maximum advance are left out, as in
+    // sort_glyph_lists
+    int failed = 0;
+    for (int i = 0; i < num_codepoints; i++) {
+        advances[i] = -1;
+        FT_Long glyph_index = FT_Get_Char_Index(face, charset[i]);
+        if (!glyph_index)
+            continue;
+        FT_Load_Glyph(face, glyph_index, FT_LOAD_MONOCHROME);
+        int advance = floor_frac_pixel(face->glyph->metrics.horiAdvance);
+        if (advance >= num_advances)
+            continue;
+        if (FT_Get_Glyph(face->glyph, &outlines[i])) {
+            fprintf(stderr, "Error: could not load the glyph of U+%04X\n",
+                    charset[i]);
+            failed = 1;
+            break;
+        }
+        advances[i] = advance;
+        buckets[advance].count++;
+        lazy->num_glyphs++;
+    }
+    STAGE_END(measure, rasterize_ns, begin);
+
+    begin = STAGE_BEGIN(measure);
+    int num_glyphs = 0;
+    int max_count = 0;
+    size_t max_bucket_size = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        buckets[advance].start = num_glyphs;
+        num_glyphs += buckets[advance].count;
+        size_t bucket_size =
+            (size_t)buckets[advance].count * pitch_32bit(advance) * em_height;
+        if (buckets[advance].count > max_count)
+            max_count = buckets[advance].count;
+        if (bucket_size > max_bucket_size)
+            max_bucket_size = bucket_size;
+        if (buckets[advance].count > 0)
+            lazy->pending++;
+        else
+            lazy->ready[advance] = 1;
+    }
+
+    map_layout_t layout =
+        map_layout(num_advances, num_glyphs,
+                   atlas_size(buckets, num_advances, em_height));
+    giko_glyph_map_t *map = malloc(sizeof(giko_glyph_map_t));
+    void *image = aligned_alloc(ATLAS_ALIGNMENT, layout.size);
+    lazy->outlines = calloc(num_glyphs + 1, sizeof(FT_Glyph));
+    if (lazy->order != NONE) {
+        lazy->staged_bitmaps = malloc(max_bucket_size ? max_bucket_size : 1);
+        lazy->staged_codepoints =
+            malloc((max_count + 1) * sizeof(giko_codepoint_t));
+        lazy->staged_set_pixels = malloc((max_count + 1) * sizeof(int32_t));
+        lazy->staged_order = malloc((max_count + 1) * sizeof(int32_t));
+    }
+    if (!map || !image || !lazy->outlines ||
+        (lazy->order != NONE &&
+         (!lazy->staged_bitmaps || !lazy->staged_codepoints ||
+          !lazy->staged_set_pixels || !lazy->staged_order))) {
+        perror("Error allocating memory");
+        failed = 1;
+    }
+    if (failed) {
+        for (int i = 0; i < num_codepoints; i++) {
+            if (outlines[i])
+                FT_Done_Glyph(outlines[i]);
+        }
+        free(outlines);
+        free(advances);
+        free(buckets);
+        free(map);
+        free(image);
         return NULL;
     }
-    glyph->advance = glyph->bitmap->width;
-    glyph->next = NULL;
+    memset(image, 0, layout.size);
 
-    return glyph;
+    map->num_advances = num_advances;
+    map->em_height = em_height;
+    map->num_glyphs = num_glyphs;
+    map->image = image;
+    map->image_size = layout.size;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+    map->lazy = lazy;
+    map->gray = NULL;
+    set_map_arrays(map, layout);
+    memcpy(map->buckets, buckets, num_advances * sizeof(glyph_bucket_t));
+
+    // buckets[a].start is reused as the next free index of bucket a
+    for (int i = 0; i < num_codepoints; i++) {
+        if (advances[i] < 0)
+            continue;
+        int index = buckets[advances[i]].start++;
+        map->codepoints[index] = charset[i];
+        lazy->outlines[index] = outlines[i];
+    }
+    size_t offset = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        glyph_bucket_t bucket = map->buckets[advance];
+        offset = align_up(offset, ATLAS_ALIGNMENT);
+        for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+            map->offsets[i] = offset;
+            offset += pitch_32bit(advance) * em_height;
+        }
+    }
+    free(outlines);
+    free(advances);
+    free(buckets);
+    if (lazy->pending == 0)
+        finish_lazy_glyphs(lazy);
+    STAGE_END(measure, pack_ns, begin);
+
+    if (stats) {
+        counts.bytes_allocated += sizeof(giko_glyph_map_t) + map->image_size;
+        add_stats(stats, &counts);
+    }
+    return map;
+}
+
+// Render the glyphs of a bucket of a lazy map into its arrays, then sort
+// them like sort_glyph_lists. The time and glyphs are added to stats.
+void load_bucket(giko_glyph_map_t *map, int advance, giko_stats_t *stats) {
+    lazy_glyphs_t *lazy = map->lazy;
+    pthread_mutex_lock(&lazy->lock);
+    if (lazy->ready[advance]) {
+        // Rendered by another thread while this one waited
+        pthread_mutex_unlock(&lazy->lock);
+        return;
+    }
+
+    uint64_t begin = STAGE_BEGIN(stats);
+    glyph_bucket_t bucket = map->buckets[advance];
+    int bitmap_size = pitch_32bit(advance) * map->em_height;
+    for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+        uint8_t *data = map->atlas + map->offsets[i];
+        FT_Glyph glyph = lazy->outlines[i];
+        lazy->outlines[i] = NULL;
+        // The outline is replaced by its bitmap, or left on error
+        if (!FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_MONO, NULL, 1)) {
+            FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
+            copy_glyph_bitmap(&bitmap->bitmap, bitmap->left,
+                              lazy->ascent - bitmap->top, data, advance,
+                              map->em_height);
+        }
+        FT_Done_Glyph(glyph);
+        map->set_pixels[i] = overlap_pixels(data, data, bitmap_size);
+    }
+    sort_bucket_by_set_pixels(map, advance);
+    if (lazy->order != NONE)
+        sort_lazy_bucket(map, advance);
+    for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+        bitmap_signature(map->atlas + map->offsets[i], advance,
+                         map->em_height, map->signatures + i * SIGNATURE_SIZE);
+    }
+    if (stats)
+        stats->glyphs_rasterized += bucket.count;
+    STAGE_END(stats, rasterize_ns, begin);
+
+    __atomic_store_n(&lazy->ready[advance], 1, __ATOMIC_RELEASE);
+    if (--lazy->pending == 0)
+        finish_lazy_glyphs(lazy);
+    pthread_mutex_unlock(&lazy->lock);
+}
+
+// Render every bucket of a map not yet rendered, for uses of the whole map at
+// once
+void load_all_buckets(giko_glyph_map_t *map, giko_stats_t *stats) {
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        require_bucket(map, advance, stats);
+    }
 }
 
-giko_glyph_t *insert_glyph(giko_glyph_t *glyph, giko_glyph_t *head,
-                           sort_order_t order) {
-    if (head == NULL) {
-        return glyph;
+// Reorder a rendered bucket, held in charset order, by set pixels. Ties keep
+// charset order, which by_set_pixels already sorts them by.
+void sort_lazy_bucket(giko_glyph_map_t *map, int advance) {
+    lazy_glyphs_t *lazy = map->lazy;
+    glyph_bucket_t bucket = map->buckets[advance];
+    int32_t *sorted = map->by_set_pixels + bucket.start;
+    int32_t *order = lazy->staged_order;
+    if (lazy->order == ASCENDING) {
+        memcpy(order, sorted, bucket.count * sizeof(int32_t));
+    } else {
+        // Runs of equal set pixels are taken from the end, each kept in
+        // charset order
+        int count = 0;
+        int end = bucket.count;
+        while (end > 0) {
+            int start = end - 1;
+            while (start > 0 && map->set_pixels[sorted[start - 1]] ==
+                                    map->set_pixels[sorted[end - 1]])
+                start--;
+            for (int i = start; i < end; i++) {
+                order[count++] = sorted[i];
+            }
+            end = start;
+        }
     }
 
-    int (*conditional)(int, int) = return_true;
-    if (order == ASCENDING)
-        conditional = smaller_than;
-    if (order == DESCENDING)
-        conditional = larger_than;
+    int bitmap_size = pitch_32bit(advance) * map->em_height;
+    memcpy(lazy->staged_bitmaps, map->atlas + map->offsets[bucket.start],
+           (size_t)bucket.count * bitmap_size);
+    memcpy(lazy->staged_codepoints, map->codepoints + bucket.start,
+           bucket.count * sizeof(giko_codepoint_t));
+    memcpy(lazy->staged_set_pixels, map->set_pixels + bucket.start,
+           bucket.count * sizeof(int32_t));
+    for (int i = 0; i < bucket.count; i++) {
+        int source = order[i] - bucket.start;
+        int destination = bucket.start + i;
+        map->codepoints[destination] = lazy->staged_codepoints[source];
+        map->set_pixels[destination] = lazy->staged_set_pixels[source];
+        memcpy(map->atlas + map->offsets[destination],
+               lazy->staged_bitmaps + (size_t)source * bitmap_size,
+               bitmap_size);
+    }
+    sort_bucket_by_set_pixels(map, advance);
+}
 
-    if (conditional(glyph->bitmap->set_pixels, head->bitmap->set_pixels)) {
-        // Insert at head
-        giko_glyph_t *tmp = head;
-        glyph->next = tmp;
-        return glyph;
+// Free the outlines left, the staging buffers and the library of a lazy map,
+// once every bucket is rendered or the map is freed
+void finish_lazy_glyphs(lazy_glyphs_t *lazy) {
+    for (int i = 0; lazy->outlines && i < lazy->num_glyphs; i++) {
+        if (lazy->outlines[i])
+            FT_Done_Glyph(lazy->outlines[i]);
     }
+    if (lazy->library)
+        FT_Done_FreeType(lazy->library);
+    lazy->library = NULL;
+    free(lazy->outlines);
+    free(lazy->staged_bitmaps);
+    free(lazy->staged_codepoints);
+    free(lazy->staged_set_pixels);
+    free(lazy->staged_order);
+    lazy->outlines = NULL;
+    lazy->staged_bitmaps = NULL;
+    lazy->staged_codepoints = NULL;
+    lazy->staged_set_pixels = NULL;
+    lazy->staged_order = NULL;
+}
 
-    giko_glyph_t *prev = head;
-    giko_glyph_t *curr = head->next;
+void free_lazy_glyphs(lazy_glyphs_t *lazy) {
+    finish_lazy_glyphs(lazy);
+    free(lazy->ready);
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy);
+}
 
-    if (curr == NULL) {
-        // Append glyph on one-node list
-        head->next = glyph;
-        return head;
+giko_context_t *giko_new_context(void) {
+    giko_context_t *context = calloc(1, sizeof(giko_context_t));
+    if (!context) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    if (FT_Init_FreeType(&context->library)) {
+        fprintf(stderr, "Error: Freetype library initialisation\n");
+        free(context);
+        return NULL;
     }
+    pthread_mutex_init(&context->lock, NULL);
+    return context;
+}
 
-    while (curr->next != NULL) {
-        if (conditional(glyph->bitmap->set_pixels, curr->bitmap->set_pixels))
+giko_glyph_map_t *giko_context_glyph_map(giko_context_t *context,
+                                         char *ttf_filepath,
+                                         giko_codepoint_t *charset,
+                                         int glyph_size, sort_order_t order,
+                                         giko_stats_t *stats) {
+    assert(context);
+    int num_faces = raster_threads(charset);
+    FT_Face *faces = malloc(num_faces * sizeof(FT_Face));
+    if (!faces) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    for (int i = 0; i < num_faces; i++) {
+        faces[i] = acquire_face(context, ttf_filepath);
+        if (!faces[i]) {
+            num_faces = i;
             break;
-        prev = curr;
-        curr = curr->next;
+        }
+    }
+
+    giko_glyph_map_t *map = NULL;
+    if (num_faces > 0)
+        map = rasterize_glyph_map(faces, num_faces, charset, glyph_size, order,
+                                  stats);
+    for (int i = 0; i < num_faces; i++)
+        release_face(context, faces[i]);
+    free(faces);
+    return map;
+}
+
+void giko_free_context(giko_context_t *context) {
+    if (!context)
+        return;
+    while (context->scratches) {
+        trace_scratch_t *next = context->scratches->next;
+        free_scratch(context->scratches);
+        context->scratches = next;
+    }
+    while (context->faces) {
+        context_face_t *next = context->faces->next;
+        FT_Done_Face(context->faces->face);
+        free(context->faces->filepath);
+        free(context->faces);
+        context->faces = next;
+    }
+    FT_Done_FreeType(context->library);
+    pthread_mutex_destroy(&context->lock);
+    free(context);
+}
+
+// Take an idle face of a font from the context, opening one if every face of
+// it is in use. FreeType faces are not safe to use from two threads at once.
+FT_Face acquire_face(giko_context_t *context, char *ttf_filepath) {
+    pthread_mutex_lock(&context->lock);
+    context_face_t *entry = context->faces;
+    while (entry &&
+           (entry->in_use || strcmp(entry->filepath, ttf_filepath) != 0))
+        entry = entry->next;
+    if (entry) {
+        entry->in_use = 1;
+        pthread_mutex_unlock(&context->lock);
+        return entry->face;
+    }
+
+    entry = calloc(1, sizeof(context_face_t));
+    char *filepath = strdup(ttf_filepath);
+    if (!entry || !filepath) {
+        perror("Error allocating memory");
+        free(entry);
+        free(filepath);
+        pthread_mutex_unlock(&context->lock);
+        return NULL;
+    }
+    // Opening a face adds it to the library, so it is done under the lock
+    if (FT_New_Face(context->library, ttf_filepath, 0, &entry->face)) {
+        fprintf(stderr, "Error: Freetype face could not be initialised. Check "
+                        "that the filepath is correct and that the font file "
+                        "is in a supported format\n");
+        free(entry);
+        free(filepath);
+        pthread_mutex_unlock(&context->lock);
+        return NULL;
+    }
+    entry->filepath = filepath;
+    entry->in_use = 1;
+    entry->next = context->faces;
+    context->faces = entry;
+    pthread_mutex_unlock(&context->lock);
+    return entry->face;
+}
+
+void release_face(giko_context_t *context, FT_Face face) {
+    pthread_mutex_lock(&context->lock);
+    for (context_face_t *entry = context->faces; entry; entry = entry->next) {
+        if (entry->face == face)
+            entry->in_use = 0;
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+giko_glyph_map_t *pack_glyph_map(int num_advances, int em_height,
+                                 giko_glyph_t **lists) {
+    giko_glyph_map_t *map = malloc(sizeof(giko_glyph_map_t));
+    glyph_bucket_t *buckets = calloc(num_advances, sizeof(glyph_bucket_t));
+    if (!map || !buckets) {
+        perror("Error allocating memory");
+        free(map);
+        free(buckets);
+        return NULL;
+    }
+
+    int num_glyphs = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        buckets[advance].start = num_glyphs;
+        for (giko_glyph_t *curr = lists[advance]; curr; curr = curr->next) {
+            buckets[advance].count++;
+        }
+        num_glyphs += buckets[advance].count;
+    }
+
+    map_layout_t layout =
+        map_layout(num_advances, num_glyphs,
+                   atlas_size(buckets, num_advances, em_height));
+    void *image = aligned_alloc(ATLAS_ALIGNMENT, layout.size);
+    if (!image) {
+        perror("Error allocating memory");
+        free(map);
+        free(buckets);
+        return NULL;
+    }
+    memset(image, 0, layout.size);
+
+    map->num_advances = num_advances;
+    map->em_height = em_height;
+    map->num_glyphs = num_glyphs;
+    map->image = image;
+    map->image_size = layout.size;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+    map->lazy = NULL;
+    map->gray = NULL;
+    set_map_arrays(map, layout);
+    memcpy(map->buckets, buckets, num_advances * sizeof(glyph_bucket_t));
+    free(buckets);
+
+    size_t offset = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        int bitmap_size = pitch_32bit(advance) * em_height;
+        int index = map->buckets[advance].start;
+        offset = align_up(offset, ATLAS_ALIGNMENT);
+        for (giko_glyph_t *curr = lists[advance]; curr; curr = curr->next) {
+            map->codepoints[index] = curr->codepoint;
+            map->set_pixels[index] = curr->bitmap->set_pixels;
+            map->offsets[index] = offset;
+            memcpy(map->atlas + offset, curr->bitmap->data, bitmap_size);
+            bitmap_signature(curr->bitmap->data, advance, em_height,
+                             map->signatures + index * SIGNATURE_SIZE);
+            offset += bitmap_size;
+            index++;
+        }
+    }
+    sort_by_set_pixels(map);
+
+    return map;
+}
+
+// Glyph set pixels for the comparison function of qsort
+static const int32_t *sort_set_pixels;
+
+static int compare_set_pixels(const void *a, const void *b) {
+    int32_t index_a = *(const int32_t *)a;
+    int32_t index_b = *(const int32_t *)b;
+    int32_t pixels_a = sort_set_pixels[index_a];
+    int32_t pixels_b = sort_set_pixels[index_b];
+    if (pixels_a != pixels_b)
+        return pixels_a < pixels_b ? -1 : 1;
+    return index_a < index_b ? -1 : (index_a > index_b);
+}
+
+static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sort_by_set_pixels(giko_glyph_map_t *map) {
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        sort_bucket_by_set_pixels(map, advance);
+    }
+}
+
+// Fill a bucket's part of by_set_pixels from the set pixels of its glyphs
+void sort_bucket_by_set_pixels(giko_glyph_map_t *map, int advance) {
+    glyph_bucket_t bucket = map->buckets[advance];
+    for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+        map->by_set_pixels[i] = i;
+    }
+
+    pthread_mutex_lock(&sort_lock);
+    sort_set_pixels = map->set_pixels;
+    qsort(map->by_set_pixels + bucket.start, bucket.count, sizeof(int32_t),
+          compare_set_pixels);
+    pthread_mutex_unlock(&sort_lock);
+}
+
+size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+size_t atlas_size(glyph_bucket_t *buckets, int num_advances, int em_height) {
+    size_t size = 0;
+    for (int advance = 0; advance < num_advances; advance++) {
+        size = align_up(size, ATLAS_ALIGNMENT);
+        size += (size_t)buckets[advance].count * pitch_32bit(advance) *
+                em_height;
     }
+    return align_up(size, ATLAS_ALIGNMENT);
+}
+
+map_layout_t map_layout(int num_advances, int num_glyphs, size_t atlas_size) {
+    map_layout_t layout;
+    layout.buckets = 0;
+    layout.codepoints = layout.buckets + num_advances * sizeof(glyph_bucket_t);
+    layout.set_pixels = layout.codepoints + num_glyphs * sizeof(uint32_t);
+    layout.offsets = layout.set_pixels + num_glyphs * sizeof(int32_t);
+    layout.by_set_pixels = layout.offsets + num_glyphs * sizeof(uint32_t);
+    layout.signatures = layout.by_set_pixels + num_glyphs * sizeof(int32_t);
+    layout.atlas = align_up(layout.signatures + num_glyphs * SIGNATURE_SIZE,
+                            ATLAS_ALIGNMENT);
+    layout.size = layout.atlas + atlas_size;
+    return layout;
+}
+
+void set_map_arrays(giko_glyph_map_t *map, map_layout_t layout) {
+    uint8_t *image = map->image;
+    map->buckets = (glyph_bucket_t *)(image + layout.buckets);
+    map->codepoints = (giko_codepoint_t *)(image + layout.codepoints);
+    map->set_pixels = (int32_t *)(image + layout.set_pixels);
+    map->offsets = (uint32_t *)(image + layout.offsets);
+    map->by_set_pixels = (int32_t *)(image + layout.by_set_pixels);
+    map->signatures = image + layout.signatures;
+    map->atlas = image + layout.atlas;
+}
 
-    // Insert or append glyph
-    glyph->next = curr;
-    prev->next = glyph;
-    return head;
+// Rasterize a glyph into a list node allocated from arena. Returns NULL if
+// the face has no glyph for the codepoint, or on error.
+giko_glyph_t *new_glyph(FT_Face face, giko_codepoint_t codepoint,
+                        arena_t *arena) {
+    giko_bitmap_t *bitmap = new_glyph_bitmap(face, codepoint, arena);
+    if (!bitmap)
+        return NULL;
+    giko_glyph_t *glyph = arena_alloc(arena, sizeof(giko_glyph_t));
+    if (!glyph)
+        return NULL;
+    glyph->codepoint = codepoint;
+    glyph->bitmap = bitmap;
+    glyph->advance = glyph->bitmap->width;
+    glyph->next = NULL;
+
+    return glyph;
 }
 
-giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint) {
+giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint,
+                                arena_t *arena) {
     FT_Long glyph_index = FT_Get_Char_Index(face, codepoint);
     if (!glyph_index) {
         return NULL;
@@ -314,21 +2063,31 @@ giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint) {
     FT_Load_Glyph(face, glyph_index, FT_LOAD_MONOCHROME);
 
     FT_Render_Glyph(face->glyph, FT_RENDER_MODE_MONO);
-    FT_Bitmap *src_bitmap = &face->glyph->bitmap;
 
     int width = floor_frac_pixel(face->glyph->metrics.horiAdvance);
     int height = floor_frac_pixel(face->size->metrics.height);
     int pitch = pitch_32bit(width);
 
-    uint8_t *pixel_data = calloc(height * pitch, sizeof(uint8_t));
-    if (!pixel_data) {
-        perror("Error allocating memory");
+    giko_bitmap_t *bitmap = arena_alloc(arena, sizeof(giko_bitmap_t));
+    uint8_t *pixel_data = arena_alloc(arena, height * pitch);
+    if (!bitmap || !pixel_data)
         return NULL;
-    }
-
+    memset(pixel_data, 0, height * pitch);
     int ascent = floor_frac_pixel(face->size->metrics.ascender);
-    int x_offset = face->glyph->bitmap_left;
-    int y_offset = ascent - face->glyph->bitmap_top;
+    copy_glyph_bitmap(&face->glyph->bitmap, face->glyph->bitmap_left,
+                      ascent - face->glyph->bitmap_top, pixel_data, width,
+                      height);
+
+    init_bitmap(bitmap, width, height, pixel_data);
+    return bitmap;
+}
+
+// Set the pixels of a rendered glyph, offset from the top-left corner, in
+// cleared pixel data of the given width (with a pitch of pitch_32bit(width))
+// and height
+void copy_glyph_bitmap(const FT_Bitmap *src_bitmap, int x_offset, int y_offset,
+                       uint8_t *pixel_data, int width, int height) {
+    int pitch = pitch_32bit(width);
 
     for (unsigned int y = 0; y < src_bitmap->rows; y++) {
         for (unsigned int x = 0; x < src_bitmap->width; x++) {
@@ -350,285 +2109,2889 @@ giko_bitmap_t *new_glyph_bitmap(FT_Face face, giko_codepoint_t codepoint) {
             }
         }
     }
+}
 
-    return giko_new_bitmap(width, height, pixel_data);
+giko_trace_options_t giko_default_trace_options(void) {
+    giko_trace_options_t options;
+    options.chunk_greed = DEFAUKT_CHUNK_GREED;
+    options.glyph_greed = DEFAULT_GLYPH_GREED;
+    options.noise_threshold = DEFAULT_NOISE_THRESHOLD;
+    options.fidelity_function = NULL;
+    options.num_threads = DEFAULT_NUM_THREADS;
+    options.search = SEARCH_LINEAR;
+    options.segmentation = SEGMENT_GREEDY;
+    options.shortlist = 0;
+    options.colors = NULL;
+    options.stats = NULL;
+    options.context = NULL;
+    return options;
 }
 
 giko_codepoint_t *giko_new_art_str(giko_bitmap_t *reference,
                                    giko_glyph_map_t *map, float chunk_greed,
                                    float glyph_greed, float noise_threshold,
-                                   int (*fidelity_function)(int)) {
-    assert(0 <= chunk_greed && 1 >= chunk_greed);
-    assert(0 < glyph_greed && 1 >= glyph_greed);
-    assert(0 <= noise_threshold && 1 >= noise_threshold);
-
-    if (fidelity_function == NULL)
-        fidelity_function = quadratic;
+                                   int (*fidelity_function)(int),
+                                   giko_stats_t *stats) {
+    giko_trace_options_t options = giko_default_trace_options();
+    options.chunk_greed = chunk_greed;
+    options.glyph_greed = glyph_greed;
+    options.noise_threshold = noise_threshold;
+    options.fidelity_function = fidelity_function;
+    options.num_threads = 1;
+    options.stats = stats;
+    return giko_trace_art_str(reference, map, &options);
+}
 
-    int size = 0;
-    int capacity = STRING_CHUNK_SIZE;
-    giko_codepoint_t *codepoints = malloc(capacity * sizeof(giko_codepoint_t));
-    if (!codepoints) {
-        perror("Error allocating memory");
+giko_codepoint_t *giko_trace_art_str(giko_bitmap_t *reference,
+                                     giko_glyph_map_t *map,
+                                     const giko_trace_options_t *options) {
+    codepoint_buffer_t string = {0};
+    if (giko_trace_rows(reference, map, options, append_row, &string) ||
+        push_codepoint(&string, TERMINAL_CODEPOINT)) {
+        free(string.codepoints);
         return NULL;
     }
+    return string.codepoints;
+}
 
-    int height = reference->height;
-    int width = reference->width;
-    int em_height = map->em_height;
-    int rows = (height + (em_height - 1)) / em_height; // Ceiling function
-
-    for (int row = 0; row < rows; row++) {
-        int x = 0;
-        while (x < width) {
-            if (size >= capacity - 1) {
-                capacity += STRING_CHUNK_SIZE;
-                codepoints =
-                    realloc(codepoints, capacity * sizeof(giko_codepoint_t));
-                if (!codepoints) {
-                    perror("Error allocating memory");
-                    return NULL;
-                }
-            }
-            int y = row * em_height;
-            giko_match_t best_match = best_scanline_match(
-                reference, map, x, y, chunk_greed, glyph_greed, noise_threshold,
-                fidelity_function);
-            codepoints[size] = best_match.codepoint;
-            size++;
-            x += best_match.advance;
-        }
-        codepoints[size] = LINE_FEED;
-        size++;
-    }
+int giko_trace_rows(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                    const giko_trace_options_t *options,
+                    giko_row_callback_t callback, void *user_data) {
+    trace_job_t job = {0};
+    job.reference = reference;
+    init_trace_job(&job, reference->width, reference->height, map, options,
+                   callback, user_data);
+    return run_trace_job(&job);
+}
 
-    codepoints[size] = 0;
-    return codepoints;
+int giko_trace_graymap_rows(giko_graymap_t *reference, giko_glyph_map_t *map,
+                            const giko_trace_options_t *options,
+                            giko_row_callback_t callback, void *user_data) {
+    trace_job_t job = {0};
+    job.graymap = reference;
+    init_trace_job(&job, reference->width, reference->height, map, options,
+                   callback, user_data);
+    return run_trace_job(&job);
 }
 
-giko_match_t best_scanline_match(giko_bitmap_t *reference,
-                                 giko_glyph_map_t *map, int x, int y,
-                                 float chunk_greed, float glyph_greed,
-                                 float noise_threshold,
-                                 int (*fidelity_function)(int)) {
-    assert(x >= 0);
-    assert(y >= 0);
+giko_codepoint_t *giko_trace_graymap_str(giko_graymap_t *reference,
+                                         giko_glyph_map_t *map,
+                                         const giko_trace_options_t *options) {
+    codepoint_buffer_t string = {0};
+    if (giko_trace_graymap_rows(reference, map, options, append_row,
+                                &string) ||
+        push_codepoint(&string, TERMINAL_CODEPOINT)) {
+        free(string.codepoints);
+        return NULL;
+    }
+    return string.codepoints;
+}
 
-    giko_match_t best_match = {0};
-    int advance = map->num_advances - 1;
-    giko_bitmap_t *patch = NULL;
-    while (advance > 0 && best_match.similarity < chunk_greed) {
-        patch = giko_crop_bitmap(reference, x, y, advance, map->em_height);
+giko_bitmap_t *giko_render_art_str(giko_codepoint_t *art, giko_glyph_map_t *map,
+                                   int width, int height) {
+    load_all_buckets(map, NULL);
+    glyph_entry_t *index = new_glyph_index(map);
+    if (!index)
+        return NULL;
+
+    // Measure the art for any size left to fit it
+    int rows = 0;
+    int row_width = 0;
+    int widest = 0;
+    int length = 0;
+    while (art[length] != TERMINAL_CODEPOINT) {
+        length++;
+    }
+    if (length > 0 && art[length - 1] != LINE_FEED)
+        rows++; // Last row without a line feed
+    for (int i = 0; i < length; i++) {
+        if (art[i] == LINE_FEED) {
+            rows++;
+            row_width = 0;
+            continue;
+        }
+        const glyph_entry_t *entry =
+            find_glyph(index, map->num_glyphs, art[i]);
+        if (!entry) {
+            fprintf(stderr, "Codepoint U+%04X is not in the glyph map\n",
+                    art[i]);
+            continue;
+        }
+        row_width += entry->advance;
+        if (row_width > widest)
+            widest = row_width;
+    }
+    if (width <= 0)
+        width = widest;
+    if (height <= 0)
+        height = rows * map->em_height;
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error: nothing to render\n");
+        free(index);
+        return NULL;
+    }
+
+    uint8_t *data = calloc((size_t)pitch_32bit(width) * height, 1);
+    giko_bitmap_t *bitmap = data ? giko_new_bitmap(width, height, data) : NULL;
+    if (!bitmap) {
+        if (!data)
+            perror("Error allocating memory");
+        free(data);
+        free(index);
+        return NULL;
+    }
+
+    int x = 0;
+    int y = 0;
+    for (int i = 0; art[i] != TERMINAL_CODEPOINT && y < height; i++) {
+        if (art[i] == LINE_FEED) {
+            x = 0;
+            y += map->em_height;
+            continue;
+        }
+        const glyph_entry_t *entry =
+            find_glyph(index, map->num_glyphs, art[i]);
+        if (!entry)
+            continue;
+        if (x < width)
+            draw_glyph(bitmap, x, y, map->atlas + map->offsets[entry->glyph],
+                       entry->advance, map->em_height);
+        x += entry->advance;
+    }
+    free(index);
+
+    // Glyphs clipped at the right edge may have drawn into the padding
+    int tail = width % 32;
+    for (int row = 0; tail && row < height; row++) {
+        uint8_t *bytes = bitmap->data + (size_t)row * bitmap->pitch;
+        for (int column = width; column < bitmap->pitch * 8; column++) {
+            bytes[column / 8] &= ~(0x80 >> (column % 8));
+        }
+    }
+    bitmap->set_pixels =
+        overlap_pixels(bitmap->data, bitmap->data, bitmap->buffer_size);
+    return bitmap;
+}
+
+// Every glyph of the map sorted by codepoint, to be searched by find_glyph
+glyph_entry_t *new_glyph_index(giko_glyph_map_t *map) {
+    glyph_entry_t *index =
+        malloc((map->num_glyphs ? map->num_glyphs : 1) * sizeof(glyph_entry_t));
+    if (!index) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        glyph_bucket_t bucket = map->buckets[advance];
+        for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+            index[i].codepoint = map->codepoints[i];
+            index[i].glyph = i;
+            index[i].advance = advance;
+        }
+    }
+    qsort(index, map->num_glyphs, sizeof(glyph_entry_t),
+          compare_glyph_entries);
+    return index;
+}
+
+int compare_glyph_entries(const void *a, const void *b) {
+    giko_codepoint_t x = ((const glyph_entry_t *)a)->codepoint;
+    giko_codepoint_t y = ((const glyph_entry_t *)b)->codepoint;
+    return (x > y) - (x < y);
+}
+
+const glyph_entry_t *find_glyph(const glyph_entry_t *index, int num_glyphs,
+                                giko_codepoint_t codepoint) {
+    glyph_entry_t key = {codepoint, 0, 0};
+    return bsearch(&key, index, num_glyphs, sizeof(glyph_entry_t),
+                   compare_glyph_entries);
+}
+
+// OR a glyph of the atlas into the bitmap with its top-left pixel at (x, y).
+// Rows below the bitmap are clipped, and columns right of its pitch.
+void draw_glyph(giko_bitmap_t *bitmap, int x, int y, const uint8_t *glyph,
+                int advance, int em_height) {
+    int glyph_pitch = pitch_32bit(advance);
+    int glyph_bytes = (advance + 7) / 8;
+    int shift = x % 8;
+    for (int row = 0; row < em_height && y + row < bitmap->height; row++) {
+        const uint8_t *source = glyph + row * glyph_pitch;
+        uint8_t *destination =
+            bitmap->data + (size_t)(y + row) * bitmap->pitch;
+        for (int i = 0; i < glyph_bytes; i++) {
+            int byte = x / 8 + i;
+            if (byte >= bitmap->pitch)
+                break;
+            destination[byte] |= source[i] >> shift;
+            if (shift && byte + 1 < bitmap->pitch)
+                destination[byte + 1] |= (uint8_t)(source[i] << (8 - shift));
+        }
+    }
+}
+
+float giko_bitmap_iou(giko_bitmap_t *a, giko_bitmap_t *b) {
+    if (a->width != b->width || a->height != b->height) {
+        fprintf(stderr, "Error: bitmaps of different sizes, %dx%d and %dx%d\n",
+                a->width, a->height, b->width, b->height);
+        return -1;
+    }
+    int overlap = overlap_pixels(a->data, b->data, a->buffer_size);
+    int either = a->set_pixels + b->set_pixels - overlap;
+    if (either == 0)
+        return 1;
+    return (float)overlap / either;
+}
+
+// Set up the parts of a job shared by bitmaps and graymaps. The caller sets
+// the reference.
+void init_trace_job(trace_job_t *job, int width, int height,
+                    giko_glyph_map_t *map, const giko_trace_options_t *options,
+                    giko_row_callback_t callback, void *user_data) {
+    assert(0 <= options->chunk_greed && 1 >= options->chunk_greed);
+    assert(0 < options->glyph_greed && 1 >= options->glyph_greed);
+    assert(0 <= options->noise_threshold && 1 >= options->noise_threshold);
+    assert(options->num_threads >= 0);
+
+    job->width = width;
+    job->map = map;
+    job->options = *options;
+    if (job->options.fidelity_function == NULL)
+        job->options.fidelity_function = quadratic;
+    job->callback = callback;
+    job->user_data = user_data;
+
+    int em_height = map->em_height;
+    job->rows = (height + (em_height - 1)) / em_height; // Ceiling
+}
+
+// Blur the reference like the glyphs of the map, which are blurred by the
+// map's first graymap trace. Pixel by pixel, a bilevel glyph can only
+// threshold a grey patch; blurred, the glyphs whose density is closest to the
+// patch's match best. The blurred reference is kept in the lead scratch.
+int prepare_graymap_job(trace_job_t *job, trace_scratch_t *lead) {
+    giko_graymap_t *reference = job->graymap;
+    job->gray = map_gray_glyphs(job->map, job->options.stats);
+    if (!job->gray)
+        return EXIT_FAILURE;
+
+    size_t size = (size_t)reference->pitch * reference->height;
+    size_t sums_size = (size_t)reference->width * reference->height *
+                       sizeof(uint32_t);
+    if (sums_size + size > lead->blur_capacity) {
+        uint8_t *grown = realloc(lead->blur, sums_size + size);
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        lead->blur = grown;
+        lead->blur_capacity = sums_size + size;
+    }
+    job->blurred = lead->blur + sums_size;
+    uint64_t begin = STAGE_BEGIN(lead->stats);
+    int radius = job->map->em_height / GRAY_BLUR_DIVISOR;
+    box_blur(reference->data, reference->pitch, job->blurred, reference->pitch,
+             reference->width, reference->height, radius,
+             (uint32_t *)lead->blur);
+
+    // Scale intensities to the glyphs' range, so that set areas are matched
+    // by the densest glyph rather than all look alike
+    uint8_t scale[256];
+    for (int value = 0; value < 256; value++) {
+        scale[value] = value * job->gray->densest + 0.5f;
+    }
+    for (size_t byte = 0; byte < size; byte++) {
+        job->blurred[byte] = scale[job->blurred[byte]];
+    }
+    STAGE_END(lead->stats, crop_ns, begin);
+    return EXIT_SUCCESS;
+}
+
+// The blurred glyphs of a map, building them if no trace has yet. Traces
+// racing to build them each build a copy, and all but the first published
+// are freed.
+gray_glyphs_t *map_gray_glyphs(giko_glyph_map_t *map, giko_stats_t *stats) {
+    gray_glyphs_t *gray = __atomic_load_n(&map->gray, __ATOMIC_ACQUIRE);
+    if (gray)
+        return gray;
+    gray = new_gray_glyphs(map, stats);
+    if (!gray)
+        return NULL;
+    gray_glyphs_t *published = NULL;
+    if (!__atomic_compare_exchange_n(&map->gray, &published, gray, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_gray_glyphs(gray);
+        gray = published;
+    }
+    return gray;
+}
+
+// Expand every glyph of the map to a byte per pixel, box blurred by
+// em_height / GRAY_BLUR_DIVISOR and padded like the gray patches it is
+// compared with
+gray_glyphs_t *new_gray_glyphs(giko_glyph_map_t *map, giko_stats_t *stats) {
+    load_all_buckets(map, stats);
+    int em_height = map->em_height;
+    int radius = em_height / GRAY_BLUR_DIVISOR;
+    int max_pitch = pitch_gray(map->num_advances - 1);
+
+    gray_glyphs_t *gray = calloc(1, sizeof(gray_glyphs_t));
+    if (!gray) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    size_t size = 0;
+    gray->offsets = malloc((map->num_glyphs + 1) * sizeof(size_t));
+    gray->intensity = malloc((map->num_glyphs + 1) * sizeof(int));
+    if (gray->offsets) {
+        for (int advance = 0; advance < map->num_advances; advance++) {
+            glyph_bucket_t bucket = map->buckets[advance];
+            for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+                gray->offsets[i] = size;
+                size += (size_t)pitch_gray(advance) * em_height;
+            }
+        }
+    }
+    gray->coverage = calloc(size ? size : 1, 1);
+    uint8_t *expanded = malloc(max_pitch * em_height * sizeof(uint8_t));
+    uint32_t *rows = malloc(max_pitch * em_height * sizeof(uint32_t));
+    if (!gray->offsets || !gray->intensity || !gray->coverage || !expanded ||
+        !rows) {
+        perror("Error allocating memory");
+        free(expanded);
+        free(rows);
+        free_gray_glyphs(gray);
+        return NULL;
+    }
+
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        glyph_bucket_t bucket = map->buckets[advance];
+        int pitch = pitch_32bit(advance);
+        int gray_pitch = pitch_gray(advance);
+        for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+            const uint8_t *glyph = map->atlas + map->offsets[i];
+            for (int y = 0; y < em_height; y++) {
+                const uint8_t *bits = glyph + y * pitch;
+                for (int x = 0; x < advance; x++) {
+                    expanded[y * advance + x] =
+                        bits[x / 8] << (x % 8) & 0x80 ? 0xff : 0;
+                }
+            }
+            uint8_t *coverage = gray->coverage + gray->offsets[i];
+            box_blur(expanded, advance, coverage, gray_pitch, advance,
+                     em_height, radius, rows);
+
+            int intensity = 0;
+            for (int byte = 0; byte < gray_pitch * em_height; byte++) {
+                intensity += coverage[byte];
+            }
+            gray->intensity[i] = intensity;
+            float density = intensity / (255.0f * advance * em_height);
+            if (density > gray->densest)
+                gray->densest = density;
+        }
+    }
+    free(expanded);
+    free(rows);
+    if (stats) {
+        giko_stats_t counts = {0};
+        counts.bytes_allocated =
+            size + (map->num_glyphs + 1) * (sizeof(size_t) + sizeof(int)) +
+            max_pitch * em_height * (sizeof(uint8_t) + sizeof(uint32_t));
+        add_stats(stats, &counts);
+    }
+    return gray;
+}
+
+void free_gray_glyphs(gray_glyphs_t *gray) {
+    free(gray->coverage);
+    free(gray->offsets);
+    free(gray->intensity);
+    free(gray);
+}
+
+// Average each pixel with its neighbours up to `radius` pixels away in both
+// directions, pixels outside the image reading as 0. Separable running sums
+// make it linear in the number of pixels, whatever the radius. rows holds
+// the width * height row sums.
+void box_blur(const uint8_t *source, int source_pitch, uint8_t *destination,
+              int destination_pitch, int width, int height, int radius,
+              uint32_t *rows) {
+    // Row sums are 32 bits and column sums 64, as the radius grows with the
+    // glyph height
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = source + (size_t)y * source_pitch;
+        uint32_t *sums = rows + (size_t)y * width;
+        uint32_t sum = 0;
+        for (int x = 0; x < radius && x < width; x++) {
+            sum += row[x];
+        }
+        for (int x = 0; x < width; x++) {
+            if (x + radius < width)
+                sum += row[x + radius];
+            if (x - radius - 1 >= 0)
+                sum -= row[x - radius - 1];
+            sums[x] = sum;
+        }
+    }
+
+    uint64_t area = (uint64_t)(2 * radius + 1) * (2 * radius + 1);
+    for (int x = 0; x < width; x++) {
+        uint64_t sum = 0;
+        for (int y = 0; y < radius && y < height; y++) {
+            sum += rows[(size_t)y * width + x];
+        }
+        for (int y = 0; y < height; y++) {
+            if (y + radius < height)
+                sum += rows[(size_t)(y + radius) * width + x];
+            if (y - radius - 1 >= 0)
+                sum -= rows[(size_t)(y - radius - 1) * width + x];
+            destination[(size_t)y * destination_pitch + x] =
+                (sum + area / 2) / area;
+        }
+    }
+}
+
+int run_trace_job(trace_job_t *job) {
+    const giko_color_bands_t *colors = job->options.colors;
+    int height = job->reference ? job->reference->height : job->graymap->height;
+    if (colors && (colors->width != job->width || colors->height != height)) {
+        fprintf(stderr,
+                "Error: colors are %dx%d but the reference is %dx%d\n",
+                colors->width, colors->height, job->width, height);
+        return EXIT_FAILURE;
+    }
+    if (colors && colors->band_height != job->map->em_height) {
+        fprintf(stderr,
+                "Error: colors are summed in bands of %d rows but the glyph "
+                "map's em_height is %d\n",
+                colors->band_height, job->map->em_height);
+        return EXIT_FAILURE;
+    }
+
+    int num_threads = job->options.num_threads;
+    if (num_threads == 0)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > job->rows)
+        num_threads = job->rows;
+
+    trace_scratch_t *lead = acquire_lead_scratch(job);
+    if (!lead)
+        return EXIT_FAILURE;
+    size_t held = scratch_heap_bytes(lead);
+    uint64_t begin = STAGE_BEGIN(job->options.stats);
+    int result = EXIT_SUCCESS;
+    if (job->graymap)
+        result = prepare_graymap_job(job, lead);
+    if (result == EXIT_SUCCESS)
+        result = num_threads > 1 ? trace_rows_parallel(job, lead, num_threads)
+                                 : trace_rows_serial(job, lead);
+    if (lead->stats) {
+        lead->counts.trace_ns = giko_stats_clock() - begin;
+        lead->counts.bytes_allocated += scratch_heap_bytes(lead) - held;
+        add_stats(job->options.stats, lead->stats);
+        memset(&lead->counts, 0, sizeof(giko_stats_t));
+    }
+    if (!job->frames)
+        release_scratch(job, lead);
+    return result;
+}
+
+// Scratch of the thread calling a trace, which also holds the trace's row
+// buffers. Frame tracers keep theirs for the next frame.
+trace_scratch_t *acquire_lead_scratch(trace_job_t *job) {
+    giko_frame_tracer_t *frames = job->frames;
+    if (!frames)
+        return acquire_scratch(job);
+    if (!frames->scratch) {
+        frames->scratch = new_scratch(job);
+        return frames->scratch;
+    }
+    if (carve_scratch(job, frames->scratch))
+        return NULL;
+    return frames->scratch;
+}
+
+giko_frame_tracer_t *giko_new_frame_tracer(giko_glyph_map_t *map,
+                                           const giko_trace_options_t *options) {
+    giko_frame_tracer_t *tracer = calloc(1, sizeof(giko_frame_tracer_t));
+    if (!tracer) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    tracer->map = map;
+    tracer->options = *options;
+    tracer->options.colors = NULL; // Each frame would need its own colours
+    return tracer;
+}
+
+int giko_trace_frame(giko_frame_tracer_t *tracer, giko_bitmap_t *frame,
+                     giko_row_callback_t callback, void *user_data) {
+    if (frame->width != tracer->width || frame->height != tracer->height ||
+        frame->pitch != tracer->pitch) {
+        if (reset_frame_tracer(tracer, frame))
+            return EXIT_FAILURE;
+        tracer->frame = 1;
+    } else {
+        tracer->frame++;
+        mark_frame_changes(tracer, frame);
+    }
+
+    trace_job_t job = {0};
+    job.reference = frame;
+    init_trace_job(&job, frame->width, frame->height, tracer->map,
+                   &tracer->options, callback, user_data);
+    job.frames = tracer;
+    int result = run_trace_job(&job);
+    if (result == EXIT_SUCCESS) {
+        memcpy(tracer->previous, frame->data,
+               (size_t)tracer->pitch * tracer->height);
+    } else {
+        // Rows after the failure were not traced. Start over next frame.
+        tracer->width = 0;
+    }
+    return result;
+}
+
+void giko_free_frame_tracer(giko_frame_tracer_t *tracer) {
+    if (!tracer)
+        return;
+    free(tracer->previous);
+    free(tracer->last_change);
+    free(tracer->cells);
+    if (tracer->scratch)
+        free_scratch(tracer->scratch);
+    free(tracer);
+}
+
+// Size the tracer for frames like `frame`, forgetting every match
+int reset_frame_tracer(giko_frame_tracer_t *tracer, giko_bitmap_t *frame) {
+    int em_height = tracer->map->em_height;
+    int rows = (frame->height + (em_height - 1)) / em_height; // Ceiling
+    size_t num_cells = (size_t)rows * frame->width;
+
+    free(tracer->previous);
+    free(tracer->last_change);
+    free(tracer->cells);
+    tracer->previous = malloc((size_t)frame->pitch * frame->height);
+    tracer->last_change = calloc(num_cells, sizeof(int));
+    tracer->cells = calloc(num_cells, sizeof(frame_cell_t));
+    if (!tracer->previous || !tracer->last_change || !tracer->cells) {
+        perror("Error allocating memory");
+        free(tracer->previous);
+        free(tracer->last_change);
+        free(tracer->cells);
+        tracer->previous = NULL;
+        tracer->last_change = NULL;
+        tracer->cells = NULL;
+        tracer->width = 0;
+        return EXIT_FAILURE;
+    }
+    tracer->width = frame->width;
+    tracer->height = frame->height;
+    tracer->pitch = frame->pitch;
+    tracer->rows = rows;
+    tracer->frame = 0;
+    return EXIT_SUCCESS;
+}
+
+// XOR the frame with the previous one, 32 bits at a time, and record the
+// current frame as the last change of every column of a row that differs
+void mark_frame_changes(giko_frame_tracer_t *tracer, giko_bitmap_t *frame) {
+    int em_height = tracer->map->em_height;
+    int pitch = tracer->pitch;
+    for (int row = 0; row < tracer->rows; row++) {
+        int top = row * em_height;
+        int bottom = top + em_height;
+        if (bottom > tracer->height)
+            bottom = tracer->height;
+        int *last_change = tracer->last_change + (size_t)row * tracer->width;
+
+        for (int word = 0; word < pitch; word += 4) {
+            uint32_t diff = 0;
+            for (int y = top; y < bottom; y++) {
+                uint32_t a, b;
+                memcpy(&a, frame->data + (size_t)y * pitch + word, 4);
+                memcpy(&b, tracer->previous + (size_t)y * pitch + word, 4);
+                diff |= a ^ b;
+            }
+            if (diff == 0)
+                continue;
+
+            // Bytes of the word are in memory order, leftmost pixel first
+            uint8_t bytes[4];
+            memcpy(bytes, &diff, 4);
+            for (int i = 0; i < 4; i++) {
+                for (int bit = 0; bytes[i] && bit < 8; bit++) {
+                    int x = (word + i) * 8 + bit;
+                    if (bytes[i] & (0x80 >> bit) && x < tracer->width)
+                        last_change[x] = tracer->frame;
+                }
+            }
+        }
+    }
+}
+
+// best_scanline_match, reusing the match of an earlier frame if none of the
+// columns covered by the widest advance have changed since it was searched
+giko_match_t cached_scanline_match(trace_job_t *job, int row, int x,
+                                   trace_scratch_t *scratch) {
+    giko_frame_tracer_t *tracer = job->frames;
+    frame_cell_t *cell = &tracer->cells[(size_t)row * tracer->width + x];
+    if (cell->frame) {
+        const int *last_change =
+            tracer->last_change + (size_t)row * tracer->width;
+        int end = x + job->map->num_advances - 1;
+        if (end > tracer->width)
+            end = tracer->width;
+        int column = x;
+        while (column < end && last_change[column] <= cell->frame)
+            column++;
+        if (column == end)
+            return cell->match;
+    }
+
+    cell->match = best_scanline_match(job, x, row, scratch);
+    cell->frame = tracer->frame;
+    return cell->match;
+}
+
+// Trace and emit rows one after the other on the calling thread, reusing
+// the lead scratch's row string
+int trace_rows_serial(trace_job_t *job, trace_scratch_t *lead) {
+    int result = EXIT_SUCCESS;
+    for (int row = 0; row < job->rows && result == EXIT_SUCCESS; row++) {
+        lead->string.size = 0;
+        result = trace_row(job, row, lead, &lead->string);
+        if (result == EXIT_SUCCESS)
+            result = emit_row(job, row, &lead->string, &lead->encoder,
+                              lead->stats);
+    }
+    return result;
+}
+
+// Workers trace rows into a ring of slots while the calling thread emits
+// them in order. Workers stay at most `window` rows ahead of the emitter,
+// so memory does not grow with the height of the reference. The ring and
+// the workers' handles are kept in the lead scratch.
+int trace_rows_parallel(trace_job_t *job, trace_scratch_t *lead,
+                        int num_threads) {
+    job->window = 2 * num_threads;
+    if (reserve_slots(lead, job->window, num_threads))
+        return EXIT_FAILURE;
+    job->slots = lead->slots;
+    for (int i = 0; i < job->window; i++) {
+        job->slots[i].done = 0;
+    }
+    pthread_t *workers = lead->workers;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->row_done, NULL);
+    pthread_cond_init(&job->slot_free, NULL);
+
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&workers[started], NULL, trace_worker, job)) {
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    int result = EXIT_SUCCESS;
+    if (started == 0) {
+        result = trace_rows_serial(job, lead);
+    } else {
+        for (int row = 0; row < job->rows; row++) {
+            trace_slot_t *slot = &job->slots[row % job->window];
+            pthread_mutex_lock(&job->lock);
+            while (!slot->done && !job->failed) {
+                pthread_cond_wait(&job->row_done, &job->lock);
+            }
+            int failed = job->failed;
+            pthread_mutex_unlock(&job->lock);
+            if (failed) {
+                result = EXIT_FAILURE;
+                break;
+            }
+
+            result = emit_row(job, row, &slot->string, &lead->encoder,
+                              lead->stats);
+
+            pthread_mutex_lock(&job->lock);
+            slot->done = 0;
+            job->emitted_rows++;
+            if (result)
+                job->failed = 1;
+            pthread_cond_broadcast(&job->slot_free);
+            pthread_mutex_unlock(&job->lock);
+            if (result)
+                break;
+        }
+
+        // Release workers waiting for a slot after an early stop
+        pthread_mutex_lock(&job->lock);
+        if (result)
+            job->failed = 1;
+        pthread_cond_broadcast(&job->slot_free);
+        pthread_mutex_unlock(&job->lock);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->row_done);
+    pthread_cond_destroy(&job->slot_free);
+    return result;
+}
+
+// Grow the scratch's ring to `window` slots and its handles to `num_threads`
+// workers. Slots keep their row strings as the ring grows.
+int reserve_slots(trace_scratch_t *scratch, int window, int num_threads) {
+    if (window > scratch->slot_capacity) {
+        trace_slot_t *grown =
+            realloc(scratch->slots, window * sizeof(trace_slot_t));
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        memset(grown + scratch->slot_capacity, 0,
+               (window - scratch->slot_capacity) * sizeof(trace_slot_t));
+        scratch->slots = grown;
+        scratch->slot_capacity = window;
+    }
+    if (num_threads > scratch->worker_capacity) {
+        pthread_t *grown =
+            realloc(scratch->workers, num_threads * sizeof(pthread_t));
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        scratch->workers = grown;
+        scratch->worker_capacity = num_threads;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Encode a traced row as UTF-8 and hand it to the callback. stats, if not
+// NULL, belongs to the calling thread.
+int emit_row(trace_job_t *job, int row, codepoint_buffer_t *string,
+             row_encoder_t *encoder, giko_stats_t *stats) {
+    uint64_t begin = STAGE_BEGIN(stats);
+    COUNT_STAT(stats, rows_traced);
+    int needed = string->size * 4;
+    if (needed > encoder->capacity) {
+        uint8_t *grown = realloc(encoder->utf8, needed);
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        encoder->utf8 = grown;
+        encoder->capacity = needed;
+    }
+
+    int utf8_length = 0;
+    for (int i = 0; i < string->size; i++) {
+        int length = giko_codepoint_to_utf8(encoder->utf8 + utf8_length,
+                                            string->codepoints[i]);
+        if (length > 0) {
+            utf8_length += length;
+        } else {
+            fprintf(stderr, "Invalid codepoint: U+%04X\n",
+                    string->codepoints[i]);
+        }
+    }
+
+    if (job->options.colors && sample_row_colors(job, row, string, encoder))
+        return EXIT_FAILURE;
+
+    giko_row_t traced;
+    traced.index = row;
+    traced.codepoints = string->codepoints;
+    traced.length = string->size;
+    traced.utf8 = encoder->utf8;
+    traced.utf8_length = utf8_length;
+    traced.advances = string->advances;
+    traced.colors = job->options.colors ? encoder->colors : NULL;
+    int result = job->callback(&traced, job->user_data);
+    STAGE_END(stats, output_ns, begin);
+    return result;
+}
+
+// Heap memory of the buffers a scratch keeps across carves, outside its
+// arena
+size_t scratch_heap_bytes(trace_scratch_t *scratch) {
+    size_t bytes = scratch->encoder.capacity +
+                   scratch->encoder.color_capacity * sizeof(giko_color_t) +
+                   scratch->slot_capacity * sizeof(trace_slot_t) +
+                   scratch->worker_capacity * sizeof(pthread_t) +
+                   scratch->blur_capacity +
+                   string_bytes(&scratch->string);
+    for (int i = 0; i < scratch->slot_capacity; i++) {
+        bytes += string_bytes(&scratch->slots[i].string);
+    }
+    return bytes;
+}
+
+// Heap memory of a codepoint string, with its advances if it has them
+size_t string_bytes(codepoint_buffer_t *string) {
+    return string->capacity * (sizeof(giko_codepoint_t) +
+                               (string->advances ? sizeof(int) : 0));
+}
+
+// Sample the colour of each cell of a traced row into the encoder
+int sample_row_colors(trace_job_t *job, int row, codepoint_buffer_t *string,
+                      row_encoder_t *encoder) {
+    if (string->size > encoder->color_capacity) {
+        giko_color_t *grown =
+            realloc(encoder->colors, string->size * sizeof(giko_color_t));
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        encoder->colors = grown;
+        encoder->color_capacity = string->size;
+    }
+
+    int x = 0;
+    for (int i = 0; i < string->size; i++) {
+        int advance = string->advances[i];
+        encoder->colors[i] = (giko_color_t){0};
+        if (advance > 0 && x < job->width)
+            encoder->colors[i] = cell_color(job, x, row, advance);
+        x += advance;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Average colour of the cell at column x of a row, each pixel weighted by
+// how much it is set, so that a glyph takes the colour of the strokes it
+// traces rather than of the background around them. Cells without set pixels
+// average every pixel. The cell's columns are summed from the row's band.
+giko_color_t cell_color(trace_job_t *job, int x, int row, int advance) {
+    const giko_color_bands_t *colors = job->options.colors;
+    int end_x = x + advance < job->width ? x + advance : job->width;
+    int top = row * colors->band_height;
+    int rows = top + colors->band_height < colors->height
+                   ? colors->band_height
+                   : colors->height - top;
+
+    uint64_t totals[COLOR_SUMS] = {0};
+    const uint32_t *sums =
+        colors->sums + ((size_t)row * colors->width + x) * COLOR_SUMS;
+    for (int column = x; column < end_x; column++, sums += COLOR_SUMS) {
+        for (int i = 0; i < COLOR_SUMS; i++) {
+            totals[i] += sums[i];
+        }
+    }
+
+    uint64_t total_weight = totals[3];
+    uint64_t *channels = total_weight ? totals : totals + 4;
+    uint64_t count =
+        total_weight ? total_weight : (uint64_t)(end_x - x) * rows;
+    if (count == 0)
+        return (giko_color_t){0};
+    giko_color_t color;
+    color.red = (channels[0] + count / 2) / count;
+    color.green = (channels[1] + count / 2) / count;
+    color.blue = (channels[2] + count / 2) / count;
+    return color;
+}
+
+void free_row_encoder(row_encoder_t *encoder) {
+    free(encoder->utf8);
+    free(encoder->colors);
+}
+
+// Row callback of giko_trace_art_str, joining rows into one string
+int append_row(const giko_row_t *row, void *user_data) {
+    codepoint_buffer_t *string = user_data;
+    for (int i = 0; i < row->length; i++) {
+        if (push_codepoint(string, row->codepoints[i]))
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+trace_scratch_t *new_scratch(trace_job_t *job) {
+    trace_scratch_t *scratch = calloc(1, sizeof(trace_scratch_t));
+    if (!scratch) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    scratch->arena.block_size = SCRATCH_ARENA_BLOCK_SIZE;
+    if (carve_scratch(job, scratch)) {
+        free_scratch(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+// Carve the buffers of a scratch for a job from its arena, reset first. Once
+// the arena has grown to fit, carving for a job of the same size allocates
+// nothing.
+int carve_scratch(trace_job_t *job, trace_scratch_t *scratch) {
+    giko_glyph_map_t *map = job->map;
+    int columns = pitch_32bit(job->width) * 8;
+    int max_pitch = pitch_32bit(map->num_advances - 1);
+    int max_count = 1;
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        if (map->buckets[advance].count > max_count)
+            max_count = map->buckets[advance].count;
+    }
+
+    arena_t *arena = &scratch->arena;
+    size_t allocated = arena->allocated;
+    arena_reset(arena);
+    scratch->patch = arena_alloc(arena, max_pitch * map->em_height);
+    scratch->wide_patch = arena_alloc(arena, max_pitch * map->em_height);
+    scratch->candidates = arena_alloc(arena, max_count * sizeof(int32_t));
+    scratch->distances = arena_alloc(arena, max_count * sizeof(int32_t));
+    scratch->band_sums = arena_alloc(arena, (columns + 1) * sizeof(int32_t));
+    scratch->band_row = -1;
+    scratch->scores = arena_alloc(arena, (columns + 1) * sizeof(float));
+    scratch->first_matches =
+        arena_alloc(arena, (columns + 1) * sizeof(giko_match_t));
+    scratch->uniform_matches =
+        arena_alloc(arena, 2 * map->num_advances * sizeof(giko_match_t));
+    scratch->gray_patch = NULL;
+    if (job->graymap)
+        scratch->gray_patch = arena_alloc(
+            arena, pitch_gray(map->num_advances - 1) * map->em_height);
+    if (arena->failed)
+        return EXIT_FAILURE;
+
+    memset(scratch->uniform_matches, 0,
+           2 * map->num_advances * sizeof(giko_match_t));
+
+    scratch->stats = job->options.stats ? &scratch->counts : NULL;
+    if (scratch->stats)
+        scratch->counts.bytes_allocated += arena->allocated - allocated;
+    return EXIT_SUCCESS;
+}
+
+void free_scratch(trace_scratch_t *scratch) {
+    arena_free(&scratch->arena);
+    free(scratch->string.codepoints);
+    free(scratch->string.advances);
+    free_row_encoder(&scratch->encoder);
+    for (int i = 0; i < scratch->slot_capacity; i++) {
+        free(scratch->slots[i].string.codepoints);
+        free(scratch->slots[i].string.advances);
+    }
+    free(scratch->slots);
+    free(scratch->workers);
+    free(scratch->blur);
+    free(scratch);
+}
+
+// Take a scratch for one thread of a job. With a context, an idle scratch of
+// the context is carved again, and only allocates if the job is larger than
+// the jobs it was carved for before.
+trace_scratch_t *acquire_scratch(trace_job_t *job) {
+    giko_context_t *context = job->options.context;
+    if (!context)
+        return new_scratch(job);
+
+    pthread_mutex_lock(&context->lock);
+    trace_scratch_t *scratch = context->scratches;
+    if (scratch)
+        context->scratches = scratch->next;
+    pthread_mutex_unlock(&context->lock);
+    if (!scratch)
+        return new_scratch(job);
+
+    memset(&scratch->counts, 0, sizeof(giko_stats_t));
+    if (carve_scratch(job, scratch)) {
+        free_scratch(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+// Return a scratch to the job's context, or free it without one
+void release_scratch(trace_job_t *job, trace_scratch_t *scratch) {
+    giko_context_t *context = job->options.context;
+    if (!context) {
+        free_scratch(scratch);
+        return;
+    }
+    pthread_mutex_lock(&context->lock);
+    scratch->next = context->scratches;
+    context->scratches = scratch;
+    pthread_mutex_unlock(&context->lock);
+}
+
+int push_codepoint(codepoint_buffer_t *string, giko_codepoint_t codepoint) {
+    if (string->size >= string->capacity) {
+        // Doubling keeps appends amortised O(1) for long strings
+        int capacity = string->capacity ? string->capacity * 2
+                                        : STRING_CHUNK_SIZE;
+        giko_codepoint_t *grown =
+            realloc(string->codepoints, capacity * sizeof(giko_codepoint_t));
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        string->codepoints = grown;
+        string->capacity = capacity;
+    }
+    string->codepoints[string->size] = codepoint;
+    string->size++;
+    return EXIT_SUCCESS;
+}
+
+// Append a traced glyph and its advance. Row strings are only grown here,
+// and push_codepoint grows codepoints to the same capacity as advances.
+int push_glyph(codepoint_buffer_t *string, giko_codepoint_t codepoint,
+               int advance) {
+    if (string->size >= string->capacity) {
+        int capacity = string->capacity ? string->capacity * 2
+                                        : STRING_CHUNK_SIZE;
+        int *grown = realloc(string->advances, capacity * sizeof(int));
+        if (!grown) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        string->advances = grown;
+    }
+    string->advances[string->size] = advance;
+    return push_codepoint(string, codepoint);
+}
+
+// Rows are timed as a whole rather than patch by patch, which would cost
+// more clock reads than some comparisons. Loading the row's band is crop_ns
+// and the rest of the row, cutting patches and comparing them with glyphs,
+// similarity_ns.
+int trace_row(trace_job_t *job, int row, trace_scratch_t *scratch,
+              codepoint_buffer_t *string) {
+    giko_stats_t *stats = scratch->stats;
+    uint64_t begin = STAGE_BEGIN(stats);
+    uint64_t staged = stats ? staged_ns(stats) : 0;
+    int result = job->options.segmentation == SEGMENT_OPTIMAL
+                     ? trace_row_optimal(job, row, scratch, string)
+                     : trace_row_greedy(job, row, scratch, string);
+    if (stats) {
+        stats->similarity_ns +=
+            giko_stats_clock() - begin - (staged_ns(stats) - staged);
+    }
+    return result;
+}
+
+// Time of the stages that may run within a row: loading its band and
+// rasterizing the buckets of lazy maps
+uint64_t staged_ns(const giko_stats_t *stats) {
+    return stats->crop_ns + stats->rasterize_ns + stats->pack_ns;
+}
+
+// Match the glyphs of a row from the left, widest advance first
+int trace_row_greedy(trace_job_t *job, int row, trace_scratch_t *scratch,
+                     codepoint_buffer_t *string) {
+    int width = job->width;
+
+    int x = 0;
+    while (x < width) {
+        giko_match_t best_match;
+        if (job->frames) {
+            best_match = cached_scanline_match(job, row, x, scratch);
+        } else if (job->graymap) {
+            best_match = gray_scanline_match(job, x, row, scratch);
+        } else {
+            best_match = best_scanline_match(job, x, row, scratch);
+        }
+        if (best_match.advance <= 0)
+            break; // Glyph map has no glyphs with an advance
+        if (push_glyph(string, best_match.codepoint, best_match.advance))
+            return EXIT_FAILURE;
+        x += best_match.advance;
+    }
+
+    return push_glyph(string, LINE_FEED, 0);
+}
+
+// Choose the glyphs of a row that maximise the sum of each match's
+// similarity times the columns it covers, by a dynamic program from the right
+// edge. scores[x] is the best total of columns x..width, reached by starting
+// with first_matches[x]. Each (x, advance) is searched once and shared by
+// every segmentation passing through x.
+int trace_row_optimal(trace_job_t *job, int row, trace_scratch_t *scratch,
+                      codepoint_buffer_t *string) {
+    giko_glyph_map_t *map = job->map;
+    giko_trace_options_t *options = &job->options;
+    int width = job->width;
+    if (!job->graymap)
+        load_band(job, row, scratch);
+    float *scores = scratch->scores;
+    giko_match_t *first_matches = scratch->first_matches;
+
+    int max_advance = map->num_advances - 1;
+    scores[width] = 0;
+    for (int x = width - 1; x >= 0; x--) {
+        giko_match_t best_match = {0};
+        float best_score = -1;
+
+        // Every advance at x is cut from one patch of the widest advance
+        giko_bitmap_t wide;
+        if (!job->graymap) {
+            band_patch(job, x, max_advance, scratch, &wide);
+            wide.data = scratch->wide_patch;
+            fill_patch(job, x, &wide, scratch);
+        }
+
+        for (int advance = max_advance; advance > 0; advance--) {
+            if (map->buckets[advance].count == 0)
+                continue;
+            int end = x + advance < width ? x + advance : width;
+            int covered = end - x;
+            if (covered + scores[end] <= best_score)
+                continue; // Even a similarity of 1 cannot improve on it
+
+            giko_match_t match;
+            giko_bitmap_t patch;
+            if (job->graymap) {
+                match = gray_patch_match(job, x, row, advance, scratch);
+            } else {
+                band_patch(job, x, advance, scratch, &patch);
+                if (options->search == SEARCH_BOUNDED &&
+                    best_match.advance != 0 &&
+                    covered * bucket_similarity_bound(&patch, map, advance,
+                                                      options, scratch) +
+                            scores[end] <=
+                        best_score) {
+                    // No glyph of this advance can improve on the best score
+                    continue;
+                }
+                if (!uniform_match(job, &patch, scratch, &match)) {
+                    narrow_patch(&wide, &patch);
+                    match =
+                        patch_match(&patch, map, advance, options, scratch);
+                }
+            }
+            float score = covered * match.similarity + scores[end];
+            if (score > best_score) {
+                best_score = score;
+                best_match = match;
+            }
+        }
+        scores[x] = best_score;
+        first_matches[x] = best_match;
+    }
+
+    int x = 0;
+    while (x < width && first_matches[x].advance > 0) {
+        if (push_glyph(string, first_matches[x].codepoint,
+                       first_matches[x].advance))
+            return EXIT_FAILURE;
+        x += first_matches[x].advance;
+    }
+
+    return push_glyph(string, LINE_FEED, 0);
+}
+
+void *trace_worker(void *arg) {
+    trace_job_t *job = arg;
+    trace_scratch_t *scratch = acquire_scratch(job);
+
+    pthread_mutex_lock(&job->lock);
+    if (!scratch) {
+        job->failed = 1;
+        pthread_cond_broadcast(&job->row_done);
+    }
+    while (scratch && !job->failed && job->next_row < job->rows) {
+        if (job->next_row >= job->emitted_rows + job->window) {
+            // Every slot holds a row the emitter has not reached yet
+            pthread_cond_wait(&job->slot_free, &job->lock);
+            continue;
+        }
+        int row = job->next_row++;
+        trace_slot_t *slot = &job->slots[row % job->window];
+        pthread_mutex_unlock(&job->lock);
+
+        slot->string.size = 0;
+        int result = trace_row(job, row, scratch, &slot->string);
+
+        pthread_mutex_lock(&job->lock);
+        if (result)
+            job->failed = 1;
+        slot->done = 1;
+        pthread_cond_broadcast(&job->row_done);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (scratch) {
+        if (scratch->stats)
+            add_stats(job->options.stats, scratch->stats);
+        release_scratch(job, scratch);
+    }
+    return NULL;
+}
+
+giko_match_t best_scanline_match(trace_job_t *job, int x, int row,
+                                 trace_scratch_t *scratch) {
+    assert(x >= 0);
+    assert(row >= 0);
+
+    giko_glyph_map_t *map = job->map;
+    const giko_trace_options_t *options = &job->options;
+    load_band(job, row, scratch);
+
+    giko_match_t best_match = {0};
+    int advance = map->num_advances - 1;
+    // Always take the first match, even when chunk_greed is 0
+    while (advance > 0 && (best_match.advance == 0 ||
+                           best_match.similarity < options->chunk_greed)) {
+        if (map->buckets[advance].count == 0) {
+            advance--;
+            continue;
+        }
+
+        // Bounds only need the set pixels, so pixels are not read yet
+        giko_bitmap_t patch;
+        band_patch(job, x, advance, scratch, &patch);
+        if (options->search == SEARCH_BOUNDED && best_match.advance != 0 &&
+            bucket_similarity_bound(&patch, map, advance, options,
+                                    scratch) <
+                best_match.similarity) {
+            // No glyph of this advance can replace the best match
+            advance--;
+            continue;
+        }
+
+        giko_match_t match;
+        if (!uniform_match(job, &patch, scratch, &match)) {
+            fill_patch(job, x, &patch, scratch);
+            match = patch_match(&patch, map, advance, options, scratch);
+        }
+
+        if (match.similarity >= best_match.similarity) {
+            best_match = match;
+        }
+        advance--;
+    }
+    if (advance > 0)
+        COUNT_STAT(scratch->stats, chunk_greed_exits);
+
+    return best_match;
+}
+
+// best_scanline_match of a graymap
+giko_match_t gray_scanline_match(trace_job_t *job, int x, int row,
+                                 trace_scratch_t *scratch) {
+    giko_glyph_map_t *map = job->map;
+    giko_match_t best_match = {0};
+    int advance = map->num_advances - 1;
+    // Always take the first match, even when chunk_greed is 0
+    while (advance > 0 && (best_match.advance == 0 ||
+                           best_match.similarity < job->options.chunk_greed)) {
+        if (map->buckets[advance].count > 0) {
+            giko_match_t match =
+                gray_patch_match(job, x, row, advance, scratch);
+            if (match.similarity >= best_match.similarity)
+                best_match = match;
+        }
+        advance--;
+    }
+    if (advance > 0)
+        COUNT_STAT(scratch->stats, chunk_greed_exits);
+    return best_match;
+}
+
+// Compare each glyph of an advance with the graymap patch at column x of
+// band `row` by the sum of absolute differences of their bytes, over their
+// total intensity. For a bilevel patch this is 1 minus the Dice coefficient,
+// so similarities span 0 to 1 like bitmap_similarity and glyph_greed means
+// the same. Glyphs are visited like patch_match.
+giko_match_t gray_patch_match(trace_job_t *job, int x, int row, int advance,
+                              trace_scratch_t *scratch) {
+    giko_glyph_map_t *map = job->map;
+    giko_graymap_t *reference = job->graymap;
+    int em_height = map->em_height;
+    int pitch = pitch_gray(advance);
+    int size = pitch * em_height;
+
+    // Pixels outside of the graymap are unset
+    uint8_t *patch = scratch->gray_patch;
+    int top = row * em_height;
+    int columns = x + advance < reference->width ? advance
+                                                 : reference->width - x;
+    int intensity = 0;
+    memset(patch, 0, size);
+    for (int y = 0; y < em_height && top + y < reference->height; y++) {
+        uint8_t *destination = patch + y * pitch;
+        memcpy(destination,
+               job->blurred + (size_t)(top + y) * reference->pitch + x,
+               columns);
+        for (int column = 0; column < columns; column++) {
+            intensity += destination[column];
+        }
+    }
+
+    giko_match_t best_match = {0};
+    best_match.advance = advance;
+    int max_noise = job->options.noise_threshold * 255 * advance * em_height;
+
+    int start = map->buckets[advance].start;
+    int end = start + map->buckets[advance].count;
+    for (int i = start; i < end; i++) {
+        COUNT_COMPARISON();
+        COUNT_STAT(scratch->stats, similarity_calls);
+        int glyph_intensity = job->gray->intensity[i];
+        float similarity = 1;
+        if (glyph_intensity > 0 || intensity > max_noise) {
+            int difference = sad_pixels(
+                patch, job->gray->coverage + job->gray->offsets[i], size);
+            similarity = 1 - (float)difference / (intensity + glyph_intensity);
+        }
+        if (similarity >= best_match.similarity) {
+            best_match.similarity = similarity;
+            best_match.codepoint = map->codepoints[i];
+
+            if (similarity >= job->options.glyph_greed) {
+                COUNT_STAT(scratch->stats, glyph_greed_exits);
+                break;
+            }
+        }
+    }
+
+    return best_match;
+}
+
+// Sum the set pixels of each column over the band of rows `row`, then
+// accumulate them left to right. This is the summed-area table of the
+// reference sampled at the band's edges, which is all that windows aligned to
+// bands need: a window's set pixels are sums[x + advance] - sums[x].
+void load_band(trace_job_t *job, int row, trace_scratch_t *scratch) {
+    if (scratch->band_row == row)
+        return;
+    uint64_t begin = STAGE_BEGIN(scratch->stats);
+    giko_bitmap_t *reference = job->reference;
+    int pitch = reference->pitch;
+    int columns = pitch * 8;
+    int32_t *sums = scratch->band_sums;
+    memset(sums, 0, (columns + 1) * sizeof(int32_t));
+
+    int top = row * job->map->em_height;
+    int bottom = top + job->map->em_height;
+    if (bottom > reference->height)
+        bottom = reference->height;
+    for (int y = top; y < bottom; y++) {
+        const uint8_t *data = reference->data + y * pitch;
+        for (int byte = 0; byte < pitch; byte++) {
+            uint8_t pixels = data[byte];
+            if (!pixels)
+                continue;
+            int32_t *column = sums + byte * 8 + 1;
+            for (int bit = 0; bit < 8; bit++) {
+                column[bit] += (pixels >> (7 - bit)) & 1;
+            }
+        }
+    }
+    for (int x = 0; x < columns; x++) {
+        sums[x + 1] += sums[x];
+    }
+    scratch->band_row = row;
+    STAGE_END(scratch->stats, crop_ns, begin);
+}
+
+// Describe the advance x em_height patch at column x of the loaded band,
+// with its set pixels counted from the band sums. Its pixels are not read
+// until fill_patch.
+void band_patch(trace_job_t *job, int x, int advance, trace_scratch_t *scratch,
+                giko_bitmap_t *patch) {
+    int width = job->reference->width;
+    int em_height = job->map->em_height;
+    int end = x + advance < width ? x + advance : width;
+    int pitch = pitch_32bit(advance);
+    patch->width = advance;
+    patch->pitch = pitch;
+    patch->height = em_height;
+    patch->real_size = advance * em_height;
+    patch->buffer_size = pitch * em_height;
+    patch->data = scratch->patch;
+    patch->set_pixels = scratch->band_sums[end] - scratch->band_sums[x];
+}
+
+// Gather the pixels of a band_patch into its data. Blank patches are
+// cleared without reading the reference.
+void fill_patch(trace_job_t *job, int x, giko_bitmap_t *patch,
+                trace_scratch_t *scratch) {
+    if (patch->set_pixels == 0) {
+        memset(patch->data, 0, patch->buffer_size);
+        return;
+    }
+    giko_bitmap_view_t view =
+        giko_view_bitmap(job->reference, x, scratch->band_row * patch->height,
+                         patch->width, patch->height);
+    gather_view(&view, patch->data, patch->pitch);
+}
+
+// Copy the leftmost columns of a wider patch into a band_patch's data.
+// Cheaper than gathering each advance from the reference again.
+void narrow_patch(const giko_bitmap_t *wide, giko_bitmap_t *patch) {
+    if (patch->set_pixels == 0) {
+        memset(patch->data, 0, patch->buffer_size);
+        return;
+    }
+    int pitch = patch->pitch;
+    int words = pitch / 4;
+    // Mask of the last word's columns, in memory byte order
+    int last_bits = patch->width - (words - 1) * 32;
+    uint8_t mask_bytes[4];
+    store_u32_be(mask_bytes, ~(uint32_t)0 << (32 - last_bits));
+    uint32_t mask = load_u32(mask_bytes);
+
+    for (int row = 0; row < wide->height; row++) {
+        const uint8_t *src = wide->data + row * wide->pitch;
+        uint8_t *dst = patch->data + row * pitch;
+        for (int word = 0; word < words; word++) {
+            uint32_t pixels = load_u32(src + word * 4);
+            if (word == words - 1)
+                pixels &= mask;
+            memcpy(dst + word * 4, &pixels, 4);
+        }
+    }
+}
+
+// Search a blank or a solid patch of an advance. Blank and solid chunks, the
+// bulk of most references, take the match of the first one met, as every
+// blank (or solid) patch of an advance is the same bits.
+giko_match_t uniform_patch_match(trace_job_t *job, int advance, int solid,
+                                 trace_scratch_t *scratch) {
+    giko_glyph_map_t *map = job->map;
+    giko_bitmap_t patch;
+    patch.width = advance;
+    patch.pitch = pitch_32bit(advance);
+    patch.height = map->em_height;
+    patch.real_size = advance * map->em_height;
+    patch.buffer_size = patch.pitch * map->em_height;
+    patch.data = scratch->patch;
+
+    memset(patch.data, 0, patch.buffer_size);
+    patch.set_pixels = 0;
+    for (int y = 0; solid && y < patch.height; y++) {
+        uint8_t *row = patch.data + y * patch.pitch;
+        memset(row, 0xFF, advance / 8);
+        if (advance % 8)
+            row[advance / 8] = 0xFF << (8 - advance % 8);
+    }
+    if (solid)
+        patch.set_pixels = patch.real_size;
+    return patch_match(&patch, map, advance, &job->options, scratch);
+}
+
+// Look up the match of a band_patch with no set pixels, or only set pixels,
+// searching it the first time. Returns 1 if it is one, otherwise 0 and the
+// patch must be searched. The band_patch's data is not filled yet, so the
+// search may use it.
+int uniform_match(trace_job_t *job, const giko_bitmap_t *patch,
+                  trace_scratch_t *scratch, giko_match_t *match) {
+    int solid;
+    if (patch->set_pixels == 0) {
+        solid = 0;
+    } else if (patch->set_pixels == patch->real_size) {
+        // Columns past the right edge are never set, so the patch is inside
+        solid = 1;
+    } else {
+        return 0;
+    }
+    giko_match_t *uniform = scratch->uniform_matches +
+                            solid * job->map->num_advances + patch->width;
+    if (uniform->advance == 0)
+        *uniform = uniform_patch_match(job, patch->width, solid, scratch);
+    *match = *uniform;
+    return 1;
+}
+
+giko_match_t patch_match(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                         int advance, const giko_trace_options_t *options,
+                         trace_scratch_t *scratch) {
+    require_bucket(map, advance, scratch->stats);
+    giko_match_t match;
+    if (options->shortlist > 0 &&
+        map->buckets[advance].count > options->shortlist) {
+        match = shortlist_patch_match(reference, map, advance, options,
+                                      scratch);
+    } else if (options->search == SEARCH_BOUNDED) {
+        match = bounded_patch_match(reference, map, advance, options, scratch);
+    } else {
+        match = linear_patch_match(reference, map, advance, options, scratch);
+    }
+    return match;
+}
+
+// Compare the glyphs of an advance in glyph map order, until one reaches
+// glyph_greed
+giko_match_t linear_patch_match(giko_bitmap_t *reference,
+                                giko_glyph_map_t *map, int advance,
+                                const giko_trace_options_t *options,
+                                trace_scratch_t *scratch) {
+    giko_match_t best_match = {0};
+    best_match.advance = advance;
+
+    int start = map->buckets[advance].start;
+    int end = start + map->buckets[advance].count;
+    for (int i = start; i < end; i++) {
+        COUNT_STAT(scratch->stats, similarity_calls);
+        float similarity = bitmap_similarity(
+            reference, map->atlas + map->offsets[i], map->set_pixels[i],
+            options->noise_threshold, options->fidelity_function);
+        if (similarity >= best_match.similarity) {
+            best_match.similarity = similarity;
+            best_match.codepoint = map->codepoints[i];
+
+            if (similarity >= options->glyph_greed) {
+                COUNT_STAT(scratch->stats, glyph_greed_exits);
+                return best_match;
+            }
+        }
+    }
+
+    return best_match;
+}
+
+// Compare only the options->shortlist glyphs of the bucket whose signatures
+// are closest to the patch's, in glyph map order like patch_match
+giko_match_t shortlist_patch_match(giko_bitmap_t *reference,
+                                   giko_glyph_map_t *map, int advance,
+                                   const giko_trace_options_t *options,
+                                   trace_scratch_t *scratch) {
+    uint8_t signature[SIGNATURE_SIZE];
+    bitmap_signature(reference->data, advance, reference->height, signature);
+
+    int start = map->buckets[advance].start;
+    int count = map->buckets[advance].count;
+    int32_t *distances = scratch->distances;
+    for (int j = 0; j < count; j++) {
+        distances[j] = signature_distance(
+            signature, map->signatures + (size_t)(start + j) * SIGNATURE_SIZE);
+    }
+    memcpy(scratch->candidates, distances, count * sizeof(int32_t));
+    int limit = options->shortlist;
+    int threshold = select_kth(scratch->candidates, count, limit - 1);
+
+    // Glyphs closer than the threshold are shortlisted, and the rest of the
+    // places go to the latest glyphs at the threshold, as the linear search
+    // keeps the last of equally similar glyphs
+    int ties = limit;
+    for (int j = 0; j < count; j++) {
+        ties -= distances[j] < threshold;
+    }
+    for (int j = count - 1; j >= 0 && ties > 0; j--) {
+        if (distances[j] == threshold) {
+            distances[j] = -1;
+            ties--;
+        }
+    }
+
+    giko_match_t best_match = {0};
+    best_match.advance = advance;
+    for (int j = 0; j < count; j++) {
+        if (distances[j] >= threshold)
+            continue;
+        int i = start + j;
+        COUNT_STAT(scratch->stats, similarity_calls);
+        float similarity = bitmap_similarity(
+            reference, map->atlas + map->offsets[i], map->set_pixels[i],
+            options->noise_threshold, options->fidelity_function);
+        if (similarity >= best_match.similarity) {
+            best_match.similarity = similarity;
+            best_match.codepoint = map->codepoints[i];
+
+            if (similarity >= options->glyph_greed) {
+                COUNT_STAT(scratch->stats, glyph_greed_exits);
+                return best_match;
+            }
+        }
+    }
+
+    return best_match;
+}
+
+// The k-th smallest (from 0) of `count` values, reordering them
+int select_kth(int32_t *values, int count, int k) {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int32_t pivot = values[low + (high - low) / 2];
+        int i = low;
+        int j = high;
+        while (i <= j) {
+            while (values[i] < pivot)
+                i++;
+            while (values[j] > pivot)
+                j--;
+            if (i <= j) {
+                int32_t tmp = values[i];
+                values[i++] = values[j];
+                values[j--] = tmp;
+            }
+        }
+        if (k <= j) {
+            high = j;
+        } else if (k >= i) {
+            low = i;
+        } else {
+            break; // values[j + 1 .. i - 1] all equal the pivot
+        }
+    }
+    return values[k];
+}
+
+// Density of each cell of a SIGNATURE_GRID x SIGNATURE_GRID grid over a
+// bitmap of pitch pitch_32bit(width), scaled to 0-255
+void bitmap_signature(const uint8_t *data, int width, int height,
+                      uint8_t *signature) {
+    int pitch = pitch_32bit(width);
+    int counts[SIGNATURE_SIZE] = {0};
+    int column_cell[SIGNATURE_GRID + 1];
+    int row_cell[SIGNATURE_GRID + 1];
+    for (int c = 0; c <= SIGNATURE_GRID; c++) {
+        column_cell[c] = c * width / SIGNATURE_GRID;
+        row_cell[c] = c * height / SIGNATURE_GRID;
+    }
+
+    // Rows of up to 64 pixels are counted a cell at a time with masks
+    uint64_t masks[SIGNATURE_GRID];
+    for (int cx = 0; cx < SIGNATURE_GRID && width <= 64; cx++) {
+        int span = column_cell[cx + 1] - column_cell[cx];
+        masks[cx] = span ? (~(uint64_t)0 >> (64 - span))
+                               << (64 - column_cell[cx + 1])
+                         : 0;
+    }
+
+    for (int cy = 0; cy < SIGNATURE_GRID; cy++) {
+        for (int y = row_cell[cy]; y < row_cell[cy + 1]; y++) {
+            const uint8_t *row = data + y * pitch;
+            int *cell_counts = counts + cy * SIGNATURE_GRID;
+            if (width <= 64) {
+                uint64_t bits = pitch == 8 ? load_u64_be(row)
+                                           : (uint64_t)row[0] << 56 |
+                                                 (uint64_t)row[1] << 48 |
+                                                 (uint64_t)row[2] << 40 |
+                                                 (uint64_t)row[3] << 32;
+                for (int cx = 0; cx < SIGNATURE_GRID; cx++) {
+                    cell_counts[cx] += popcount64(bits & masks[cx]);
+                }
+                continue;
+            }
+            for (int cx = 0; cx < SIGNATURE_GRID; cx++) {
+                for (int x = column_cell[cx]; x < column_cell[cx + 1]; x++) {
+                    cell_counts[cx] += (row[x >> 3] >> (7 - (x & 7))) & 1;
+                }
+            }
+        }
+    }
+
+    for (int cy = 0; cy < SIGNATURE_GRID; cy++) {
+        for (int cx = 0; cx < SIGNATURE_GRID; cx++) {
+            int area = (row_cell[cy + 1] - row_cell[cy]) *
+                       (column_cell[cx + 1] - column_cell[cx]);
+            int cell = cy * SIGNATURE_GRID + cx;
+            signature[cell] =
+                area ? (counts[cell] * 255 + area / 2) / area : 0;
+        }
+    }
+}
+
+// Sum of absolute differences of two signatures
+int signature_distance(const uint8_t *a, const uint8_t *b) {
+#if defined(__SSE2__) && SIGNATURE_SIZE == 16
+    __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)a),
+                               _mm_loadu_si128((const __m128i *)b));
+    return _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+#else
+    int distance = 0;
+    for (int i = 0; i < SIGNATURE_SIZE; i++) {
+        distance += abs(a[i] - b[i]);
+    }
+    return distance;
+#endif
+}
+
+// Branch and bound version of patch_match, returning the same match.
+//
+// The overlap of a glyph and the reference is at most the smaller of their
+// set pixels, which bounds the similarity from the set pixel counts alone
+// (see similarity_bound). The bound increases with the glyph's set pixels up
+// to the reference's set pixels and decreases after, apart from empty glyphs
+// when the reference is within the noise threshold.
+//
+// The linear search returns the first glyph reaching glyph_greed, otherwise
+// the last glyph with the highest similarity. So:
+//  1. Glyphs whose bound reaches glyph_greed, a window of by_set_pixels around
+//     the reference's set pixels, are compared in list order. The first to
+//     reach glyph_greed is returned.
+//  2. Otherwise the other glyphs are visited outwards from that window, in
+//     order of descending bound, until no bound can reach the best match.
+// Requires a non-decreasing fidelity function.
+giko_match_t bounded_patch_match(giko_bitmap_t *reference,
+                                 giko_glyph_map_t *map, int advance,
+                                 const giko_trace_options_t *options,
+                                 trace_scratch_t *scratch) {
+    int (*fidelity_function)(int) = options->fidelity_function;
+    float glyph_greed = options->glyph_greed;
+    int reference_set_pixels = reference->set_pixels;
+    int max_noise_pixels = options->noise_threshold * reference->real_size;
+
+    glyph_bucket_t bucket = map->buckets[advance];
+    int32_t *sorted = map->by_set_pixels + bucket.start;
+    int32_t *set_pixels = map->set_pixels;
+
+    giko_match_t best_match = {0};
+    best_match.advance = advance;
+    int best_index = -1;
+
+    // First glyph with more set pixels than the reference
+    int low = 0;
+    int high = bucket.count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (set_pixels[sorted[middle]] <= reference_set_pixels) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // Window [low, high) of glyphs that could reach glyph_greed
+    while (low > 0 &&
+           similarity_bound(reference_set_pixels, set_pixels[sorted[low - 1]],
+                            max_noise_pixels,
+                            fidelity_function) >= glyph_greed) {
+        low--;
+    }
+    while (high < bucket.count &&
+           similarity_bound(reference_set_pixels, set_pixels[sorted[high]],
+                            max_noise_pixels,
+                            fidelity_function) >= glyph_greed) {
+        high++;
+    }
+    // Empty glyphs are a perfect match for a reference within the noise
+    // threshold
+    int empty = 0;
+    if (reference_set_pixels <= max_noise_pixels) {
+        while (empty < bucket.count && set_pixels[sorted[empty]] == 0) {
+            empty++;
+        }
+    }
+    if (empty >= low)
+        low = 0;
+
+    int num_candidates = 0;
+    int32_t *candidates = scratch->candidates;
+    for (int i = 0; i < empty && i < low; i++) {
+        candidates[num_candidates++] = sorted[i];
+    }
+    for (int i = low; i < high; i++) {
+        candidates[num_candidates++] = sorted[i];
+    }
+    qsort(candidates, num_candidates, sizeof(int32_t), compare_int32);
+
+    for (int c = 0; c < num_candidates; c++) {
+        int i = candidates[c];
+        COUNT_STAT(scratch->stats, similarity_calls);
+        float similarity = bitmap_similarity(
+            reference, map->atlas + map->offsets[i], set_pixels[i],
+            options->noise_threshold, fidelity_function);
+        if (similarity >= best_match.similarity) {
+            best_match.similarity = similarity;
+            best_match.codepoint = map->codepoints[i];
+            best_index = i;
+
+            if (similarity >= glyph_greed) {
+                COUNT_STAT(scratch->stats, glyph_greed_exits);
+                return best_match;
+            }
+        }
+    }
+
+    int left = low - 1;
+    int right = high;
+    int left_end = low == 0 ? 0 : empty; // Empty glyphs are already compared
+    float left_bound = -1;
+    float right_bound = -1;
+    while (left >= left_end || right < bucket.count) {
+        if (left >= left_end && left_bound < 0)
+            left_bound =
+                similarity_bound(reference_set_pixels, set_pixels[sorted[left]],
+                                 max_noise_pixels, fidelity_function);
+        if (right < bucket.count && right_bound < 0)
+            right_bound = similarity_bound(reference_set_pixels,
+                                           set_pixels[sorted[right]],
+                                           max_noise_pixels, fidelity_function);
+
+        int i;
+        float bound;
+        if (left >= left_end && left_bound >= right_bound) {
+            i = sorted[left--];
+            bound = left_bound;
+            left_bound = -1;
+        } else {
+            i = sorted[right++];
+            bound = right_bound;
+            right_bound = -1;
+        }
+
+        if (bound < best_match.similarity)
+            break; // No remaining glyph can reach the best match
+
+        // A bound of 0 means no overlap is possible, so the similarity is 0
+        float similarity = 0;
+        if (bound > 0) {
+            COUNT_STAT(scratch->stats, similarity_calls);
+            similarity = bitmap_similarity(
+                reference, map->atlas + map->offsets[i], set_pixels[i],
+                options->noise_threshold, fidelity_function);
+        }
+
+        // Ties go to the glyph later in the list, as in the linear search
+        if (similarity > best_match.similarity ||
+            (similarity == best_match.similarity && i > best_index)) {
+            best_match.similarity = similarity;
+            best_match.codepoint = map->codepoints[i];
+            best_index = i;
+        }
+    }
+
+    return best_match;
+}
+
+int compare_int32(const void *a, const void *b) {
+    int32_t value_a = *(const int32_t *)a;
+    int32_t value_b = *(const int32_t *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+// Upper bound of bitmap_similarity from set pixel counts alone
+float similarity_bound(int reference_set_pixels, int glyph_set_pixels,
+                       int max_noise_pixels, int (*fidelity_function)(int)) {
+    if (glyph_set_pixels == 0 && reference_set_pixels <= max_noise_pixels)
+        return 1;
+
+    int overlapping_pixels = reference_set_pixels < glyph_set_pixels
+                                 ? reference_set_pixels
+                                 : glyph_set_pixels;
+    int extranuous_pixels = glyph_set_pixels - overlapping_pixels;
+    int set_pixels =
+        reference_set_pixels + glyph_set_pixels - overlapping_pixels;
+
+    return (float)overlapping_pixels /
+           (set_pixels + fidelity_function(extranuous_pixels));
+}
+
+// Upper bound of the similarity of any glyph of an advance. The largest
+// bounds are next to the reference's set pixels, or an empty glyph.
+float bucket_similarity_bound(giko_bitmap_t *reference, giko_glyph_map_t *map,
+                              int advance, const giko_trace_options_t *options,
+                              trace_scratch_t *scratch) {
+    require_bucket(map, advance, scratch->stats);
+    glyph_bucket_t bucket = map->buckets[advance];
+    int32_t *sorted = map->by_set_pixels + bucket.start;
+    int reference_set_pixels = reference->set_pixels;
+    int max_noise_pixels = options->noise_threshold * reference->real_size;
+
+    int low = 0;
+    int high = bucket.count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (map->set_pixels[sorted[middle]] <= reference_set_pixels) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
 
-        giko_glyph_t *list = map->glyphs[advance];
-        if (!list) {
-            advance--;
+    int candidates[3] = {0, low - 1, low};
+    float bound = 0;
+    for (int i = 0; i < 3; i++) {
+        if (candidates[i] < 0 || candidates[i] >= bucket.count)
             continue;
+        float candidate = similarity_bound(
+            reference_set_pixels, map->set_pixels[sorted[candidates[i]]],
+            max_noise_pixels, options->fidelity_function);
+        if (candidate > bound)
+            bound = candidate;
+    }
+    return bound;
+}
+
+// Compare a glyph bitmap against a reference patch of the same advance
+float bitmap_similarity(giko_bitmap_t *reference, const uint8_t *glyph,
+                        int glyph_set_pixels, float noise_threshold,
+                        int (*fidelity_function)(int)) {
+    COUNT_COMPARISON();
+    int reference_set_pixels = reference->set_pixels;
+    int bitmap_set_pixels = glyph_set_pixels;
+
+    int empty_glyph = bitmap_set_pixels == 0;
+    int max_noise_pixels = noise_threshold * reference->real_size;
+    if (empty_glyph && reference_set_pixels <= max_noise_pixels) {
+        return 1;
+    }
+
+    // Nothing can overlap an empty bitmap, so its pixels are not read
+    int overlapping_pixels = 0;
+    if (reference_set_pixels > 0 && !empty_glyph)
+        overlapping_pixels =
+            overlap_pixels(reference->data, glyph, reference->buffer_size);
+
+    int extranuous_pixels = bitmap_set_pixels - overlapping_pixels;
+    int extranuous_penalty = fidelity_function(extranuous_pixels);
+    int set_pixels =
+        reference_set_pixels + bitmap_set_pixels - overlapping_pixels;
+
+    return (float)overlapping_pixels / (set_pixels + extranuous_penalty);
+}
+
+void giko_free_bitmap(giko_bitmap_t *bitmap) {
+    free(bitmap->data);
+    free(bitmap);
+}
+
+void giko_free_graymap(giko_graymap_t *graymap) {
+    free(graymap->data);
+    free(graymap);
+}
+
+void giko_free_color_bands(giko_color_bands_t *colors) {
+    free(colors->sums);
+    free(colors);
+}
+
+int giko_glyph_map_em_height(const giko_glyph_map_t *map) {
+    return map->em_height;
+}
+
+void giko_free_glyph_map(giko_glyph_map_t *map) {
+    if (map->lazy)
+        free_lazy_glyphs(map->lazy);
+    if (map->gray)
+        free_gray_glyphs(map->gray);
+    if (map->mapping) {
+        munmap(map->mapping, map->mapping_size);
+    } else {
+        free(map->image);
+    }
+    free(map);
+}
+
+// Allocate size bytes, aligned to ARENA_ALIGNMENT, from the arena's current
+// block or a new one. Returns NULL and sets arena->failed on error.
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = align_up(size ? size : 1, ARENA_ALIGNMENT);
+    arena_block_t *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = arena->block_size > size ? arena->block_size : size;
+        block = aligned_alloc(ARENA_ALIGNMENT, ARENA_HEADER_SIZE + block_size);
+        if (!block) {
+            perror("Error allocating memory");
+            arena->failed = 1;
+            return NULL;
         }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        arena->allocated += ARENA_HEADER_SIZE + block_size;
+    }
+    void *memory = (uint8_t *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return memory;
+}
 
-        giko_match_t match = patch_match(patch, list, glyph_greed,
-                                         noise_threshold, fidelity_function);
+// Free everything allocated from the arena, keeping its memory. Blocks are
+// merged into one of their total size, allocated on next use, so an arena
+// filled the same way again needs a single block.
+void arena_reset(arena_t *arena) {
+    arena->failed = 0;
+    if (!arena->blocks)
+        return;
+    if (!arena->blocks->next) {
+        arena->blocks->used = 0;
+        return;
+    }
+    size_t total = 0;
+    for (arena_block_t *block = arena->blocks; block; block = block->next) {
+        total += block->size;
+    }
+    arena_free(arena);
+    if (total > arena->block_size)
+        arena->block_size = total;
+}
 
-        if (match.similarity >= best_match.similarity) {
-            best_match = match;
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+int giko_codepoint_to_utf8(uint8_t *destination, giko_codepoint_t codepoint) {
+    if (codepoint <= 0x7F) {
+        destination[0] = codepoint;
+        return 1;
+    }
+    if (codepoint <= 0x7FF) {
+        destination[0] = 0xC0 | (codepoint >> 6);
+        destination[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    }
+    if (codepoint <= 0xFFFF) {
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
+            return 0;
+        destination[0] = 0xE0 | (codepoint >> 12);
+        destination[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        destination[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    if (codepoint <= 0x10FFFF) {
+        destination[0] = 0xF0 | (codepoint >> 18);
+        destination[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+        destination[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+        destination[3] = 0x80 | (codepoint & 0x3F);
+        return 4;
+    }
+    return 0;
+}
+
+giko_codepoint_t *giko_load_charset(char *filepath, int base_encoding) {
+    assert(base_encoding > 0);
+
+    FILE *charset_f = fopen(filepath, "rb");
+    if (!charset_f) {
+        perror(filepath);
+        return NULL;
+    }
+
+    int capacity = STRING_CHUNK_SIZE;
+    int size = 0;
+    giko_codepoint_t *codepoints = malloc(capacity * sizeof(giko_codepoint_t));
+    if (!codepoints) {
+        perror("Error allocating memory");
+        fclose(charset_f);
+        return NULL;
+    }
+
+    errno = 0;
+    char *endptr;
+    char codepoint_str[MAX_DIGITS_IN_CODEPOINT];
+
+    while (fgets(codepoint_str, MAX_DIGITS_IN_CODEPOINT, charset_f)) {
+        int codepoint = strtol(codepoint_str, &endptr, base_encoding);
+
+        if (errno) {
+            perror(codepoint_str);
+            free(codepoints);
+            fclose(charset_f);
+            return NULL;
         }
-        advance--;
+        if (*endptr == codepoint)
+            continue;
+
+        if (size >= capacity - 1) {
+            // Doubling, like push_codepoint, for large CJK charsets
+            capacity *= 2;
+            giko_codepoint_t *grown =
+                realloc(codepoints, capacity * sizeof(giko_codepoint_t));
+            if (!grown) {
+                perror("Error allocating memory");
+                free(codepoints);
+                fclose(charset_f);
+                return NULL;
+            }
+            codepoints = grown;
+        }
+        codepoints[size] = codepoint;
+        size++;
     }
 
-    if (patch)
-        giko_free_bitmap(patch);
-    return best_match;
+    fclose(charset_f);
+    codepoints[size] = TERMINAL_CODEPOINT;
+    return codepoints;
 }
 
-giko_match_t patch_match(giko_bitmap_t *reference, giko_glyph_t *head,
-                         float glyph_greed, float noise_threshold,
-                         int (*fidelity_function)(int)) {
-    giko_match_t best_match = {0};
-    best_match.advance = head->advance;
-    giko_glyph_t *curr;
-    for (curr = head; curr != NULL; curr = curr->next) {
-        float similarity = bitmap_similarity(
-            reference, curr->bitmap, noise_threshold, fidelity_function);
-        if (similarity >= best_match.similarity) {
-            best_match.similarity = similarity;
-            best_match.codepoint = curr->codepoint;
+giko_bitmap_t *giko_load_bitmap(char *bmp_filepath) {
+    FILE *bitmap_f = fopen(bmp_filepath, "rb");
+    if (!bitmap_f) {
+        perror(bmp_filepath);
+        return NULL;
+    }
 
-            if (similarity >= glyph_greed) {
-                return best_match;
+    int width;
+    int height;
+
+    fseek(bitmap_f, 18, SEEK_SET);
+    fread(&width, 4, 1, bitmap_f);
+    fread(&height, 4, 1, bitmap_f);
+
+    uint32_t pixel_data_offset;
+    fseek(bitmap_f, 10, SEEK_SET);
+    fread(&pixel_data_offset, 4, 1, bitmap_f);
+
+    int bitmap_size = pitch_32bit(width) * height;
+    uint8_t *pixel_data = malloc(bitmap_size * sizeof(uint8_t));
+    if (!pixel_data) {
+        perror("Error allocating memory");
+        fclose(bitmap_f);
+        return NULL;
+    }
+    fseek(bitmap_f, pixel_data_offset, SEEK_SET);
+    fread(pixel_data, 1, bitmap_size, bitmap_f);
+
+    fclose(bitmap_f);
+
+    giko_bitmap_t *bitmap = giko_new_bitmap(width, height, pixel_data);
+    if (!bitmap)
+        return NULL;
+    giko_flip_bitmap(bitmap);
+
+    return bitmap;
+}
+
+// Image decoding
+
+giko_bitmap_t *giko_load_image(char *filepath, int invert) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror(filepath);
+        return NULL;
+    }
+    giko_bitmap_t *bitmap = giko_read_image(file, invert);
+    fclose(file);
+    return bitmap;
+}
+
+giko_bitmap_t *giko_read_image(FILE *file, int invert) {
+    return giko_read_color_image(file, invert, NULL, NULL, NULL);
+}
+
+giko_graymap_t *giko_load_graymap(char *filepath, int invert) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror(filepath);
+        return NULL;
+    }
+    giko_graymap_t *graymap = giko_read_graymap(file, invert);
+    fclose(file);
+    return graymap;
+}
+
+giko_graymap_t *giko_read_graymap(FILE *file, int invert) {
+    return giko_read_color_graymap(file, invert, NULL, NULL, NULL);
+}
+
+giko_bitmap_t *giko_load_color_image(char *filepath, int invert,
+                                     giko_band_height_callback_t band_height,
+                                     void *user_data,
+                                     giko_color_bands_t **colors) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror(filepath);
+        return NULL;
+    }
+    giko_bitmap_t *bitmap =
+        giko_read_color_image(file, invert, band_height, user_data, colors);
+    fclose(file);
+    return bitmap;
+}
+
+giko_bitmap_t *giko_read_color_image(FILE *file, int invert,
+                                     giko_band_height_callback_t band_height,
+                                     void *user_data,
+                                     giko_color_bands_t **colors) {
+    assert(!colors || band_height);
+    image_sink_t sink = {0};
+    sink.invert = invert;
+    sink.colors = colors != NULL;
+    sink.band_height = band_height;
+    sink.user_data = user_data;
+    if (decode_image(file, &sink))
+        return NULL;
+    return finish_image_sink(&sink, colors);
+}
+
+giko_graymap_t *giko_load_color_graymap(char *filepath, int invert,
+                                        giko_band_height_callback_t band_height,
+                                        void *user_data,
+                                        giko_color_bands_t **colors) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror(filepath);
+        return NULL;
+    }
+    giko_graymap_t *graymap =
+        giko_read_color_graymap(file, invert, band_height, user_data, colors);
+    fclose(file);
+    return graymap;
+}
+
+giko_graymap_t *giko_read_color_graymap(FILE *file, int invert,
+                                        giko_band_height_callback_t band_height,
+                                        void *user_data,
+                                        giko_color_bands_t **colors) {
+    assert(!colors || band_height);
+    image_sink_t sink = {0};
+    sink.invert = invert;
+    sink.gray = 1;
+    sink.colors = colors != NULL;
+    sink.band_height = band_height;
+    sink.user_data = user_data;
+    if (decode_image(file, &sink))
+        return NULL;
+    return finish_graymap_sink(&sink, colors);
+}
+
+// Decode an image of any supported format into the sink. Unsupported
+// formats fail without an error.
+int decode_image(FILE *file, image_sink_t *sink) {
+    uint8_t signature[8];
+    if (fread(signature, 1, 2, file) != 2)
+        return EXIT_FAILURE;
+
+    if (signature[0] == 'P' && signature[1] >= '1' && signature[1] <= '6')
+        return read_pnm(file, signature[1], sink);
+    if (signature[0] == 'B' && signature[1] == 'M')
+        return read_bmp(file, sink);
+#ifdef GIKO_PNG
+    if (fread(signature + 2, 1, 6, file) == 6 &&
+        png_sig_cmp(signature, 0, 8) == 0)
+        return read_png(file, sink);
+#endif
+    return EXIT_FAILURE;
+}
+
+int new_image_sink(image_sink_t *sink, int width, int height) {
+    int pitch = sink->gray ? pitch_gray(width) : pitch_32bit(width);
+    if (width <= 0 || height <= 0 || (int64_t)pitch * height > INT32_MAX) {
+        fprintf(stderr, "Error: invalid image size %dx%d\n", width, height);
+        return EXIT_FAILURE;
+    }
+    // Asked before anything is allocated, as it may build a glyph map or
+    // refuse the image
+    int band_height = 0;
+    if (sink->band_height) {
+        band_height = sink->band_height(width, height, sink->user_data);
+        if (band_height <= 0)
+            return EXIT_FAILURE;
+    }
+    if (sink->colors) {
+        if (band_height > MAX_COLOR_BAND) {
+            fprintf(stderr, "Error: colour bands of %d rows are too tall\n",
+                    band_height);
+            return EXIT_FAILURE;
+        }
+    }
+    sink->width = width;
+    sink->height = height;
+    sink->pitch = pitch;
+    sink->data = calloc(sink->pitch * height, sizeof(uint8_t));
+    int failed = !sink->data;
+    if (sink->colors) {
+        int bands = (height + band_height - 1) / band_height;
+        sink->rgb = malloc((size_t)width * 3 * sizeof(uint8_t));
+        sink->bands = malloc(sizeof(giko_color_bands_t));
+        if (sink->bands) {
+            sink->bands->width = width;
+            sink->bands->height = height;
+            sink->bands->band_height = band_height;
+            sink->bands->sums =
+                calloc((size_t)bands * width * COLOR_SUMS, sizeof(uint32_t));
+        }
+        failed = failed || !sink->rgb || !sink->bands || !sink->bands->sums;
+    }
+    if (failed) {
+        perror("Error allocating memory");
+        free_image_sink(sink);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Threshold a row of 8 bit luminance into row `row` of the bitmap, or
+// store its darkness in the graymap
+void sink_luma_row(image_sink_t *sink, int row, const uint8_t *luma) {
+    uint8_t *destination = sink->data + row * sink->pitch;
+    uint8_t flip = sink->invert ? 0xff : 0;
+    int width = sink->width;
+    if (sink->gray) {
+        for (int x = 0; x < width; x++) {
+            destination[x] = luma[x] ^ flip ^ 0xff;
+        }
+        sum_row_colors(sink, row);
+        return;
+    }
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8_t byte = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            byte |= (luma[x + bit] < LUMA_THRESHOLD) << (7 - bit);
+        }
+        *destination++ = byte ^ flip;
+    }
+    if (x < width) {
+        uint8_t byte = 0;
+        for (int bit = 0; x + bit < width; bit++) {
+            byte |= (luma[x + bit] < LUMA_THRESHOLD) << (7 - bit);
+        }
+        *destination = (byte ^ flip) & (uint8_t)(0xff << (8 - (width - x)));
+    }
+    sum_row_colors(sink, row);
+}
+
+// Copy a row of packed pixels, 1 bits being dark, into row `row`
+void sink_bits_row(image_sink_t *sink, int row, const uint8_t *bits) {
+    uint8_t *destination = sink->data + row * sink->pitch;
+    uint8_t flip = sink->invert ? 0xff : 0;
+    int bytes = (sink->width + 7) / 8;
+    uint8_t *rgb = sink_rgb_row(sink);
+    if (rgb) {
+        for (int x = 0; x < sink->width; x++) {
+            memset(rgb + 3 * x, bits[x / 8] << (x % 8) & 0x80 ? 0 : 0xff, 3);
+        }
+    }
+    if (sink->gray) {
+        for (int x = 0; x < sink->width; x++) {
+            destination[x] = (bits[x / 8] << (x % 8) & 0x80 ? 0xff : 0) ^ flip;
+        }
+        sum_row_colors(sink, row);
+        return;
+    }
+
+    for (int i = 0; i < bytes; i++) {
+        destination[i] = bits[i] ^ flip;
+    }
+    if (sink->width % 8) {
+        destination[bytes - 1] &= (uint8_t)(0xff << (8 - sink->width % 8));
+    }
+    sum_row_colors(sink, row);
+}
+
+// Add the colours of decoded row `row` to the sums of its band, each pixel
+// weighted by how much it is set in the row just filled
+void sum_row_colors(image_sink_t *sink, int row) {
+    if (!sink->bands)
+        return;
+    const uint8_t *set = sink->data + (size_t)row * sink->pitch;
+    const uint8_t *rgb = sink->rgb;
+    giko_color_bands_t *bands = sink->bands;
+    uint32_t *sums = bands->sums + (size_t)(row / bands->band_height) *
+                                       sink->width * COLOR_SUMS;
+    for (int x = 0; x < sink->width; x++, sums += COLOR_SUMS, rgb += 3) {
+        uint32_t weight = sink->gray ? set[x] : set[x / 8] >> (7 - x % 8) & 1;
+        for (int c = 0; c < 3; c++) {
+            sums[c] += weight * rgb[c];
+            sums[4 + c] += rgb[c];
+        }
+        sums[3] += weight;
+    }
+}
+
+// Colours of the row being decoded, to be filled by the decoder before the
+// row is sunk, or NULL if they are not summed
+uint8_t *sink_rgb_row(image_sink_t *sink) { return sink->rgb; }
+
+void free_image_sink(image_sink_t *sink) {
+    free(sink->data);
+    free(sink->rgb);
+    if (sink->bands)
+        giko_free_color_bands(sink->bands);
+    sink->data = NULL;
+    sink->rgb = NULL;
+    sink->bands = NULL;
+}
+
+// Hand the colour sums to *colors, if the caller asked for them
+void finish_color_sink(image_sink_t *sink, giko_color_bands_t **colors) {
+    free(sink->rgb);
+    sink->rgb = NULL;
+    if (colors) {
+        *colors = sink->bands;
+        sink->bands = NULL;
+    }
+}
+
+giko_bitmap_t *finish_image_sink(image_sink_t *sink,
+                                 giko_color_bands_t **colors) {
+    finish_color_sink(sink, colors);
+    giko_bitmap_t *bitmap =
+        giko_new_bitmap(sink->width, sink->height, sink->data);
+    if (!bitmap) {
+        free(sink->data);
+        if (colors) {
+            giko_free_color_bands(*colors);
+            *colors = NULL;
+        }
+    }
+    return bitmap;
+}
+
+giko_graymap_t *finish_graymap_sink(image_sink_t *sink,
+                                    giko_color_bands_t **colors) {
+    finish_color_sink(sink, colors);
+    giko_graymap_t *graymap =
+        giko_new_graymap(sink->width, sink->height, sink->data);
+    if (!graymap) {
+        free(sink->data);
+        if (colors) {
+            giko_free_color_bands(*colors);
+            *colors = NULL;
+        }
+    }
+    return graymap;
+}
+
+// Read an unsigned integer of a PNM header, skipping whitespace and comments.
+// The single whitespace character following the integer is consumed.
+int read_pnm_value(FILE *file, int *value) {
+    int c = fgetc(file);
+    while (c == '#' || (c != EOF && isspace(c))) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(file);
             }
         }
+        c = fgetc(file);
     }
+    if (c == EOF || !isdigit(c))
+        return EXIT_FAILURE;
 
-    return best_match;
+    int64_t result = 0;
+    while (c != EOF && isdigit(c)) {
+        result = result * 10 + (c - '0');
+        if (result > INT32_MAX)
+            return EXIT_FAILURE;
+        c = fgetc(file);
+    }
+    *value = result;
+    return EXIT_SUCCESS;
 }
 
-float bitmap_similarity(giko_bitmap_t *reference, giko_bitmap_t *bitmap,
-                        float noise_threshold, int (*fidelity_function)(int)) {
-    assert(reference->height == bitmap->height);
-    assert(reference->pitch == bitmap->pitch);
-
-    int reference_set_pixels = reference->set_pixels;
-    int bitmap_set_pixels = bitmap->set_pixels;
-    int overlapping_pixels = 0;
+int read_pnm(FILE *file, char format, image_sink_t *sink) {
+    int bilevel = format == '1' || format == '4';
+    int channels = (format == '3' || format == '6') ? 3 : 1;
+    int ascii = format <= '3';
 
-    for (int i = 0; i < bitmap->buffer_size; i++) {
-        uint8_t reference_byte = reference->data[i];
-        uint8_t bitmap_byte = bitmap->data[i];
-        overlapping_pixels += num_set_pixels(reference_byte & bitmap_byte);
+    int width, height;
+    int max_value = 1;
+    if (read_pnm_value(file, &width) || read_pnm_value(file, &height) ||
+        (!bilevel && read_pnm_value(file, &max_value)) || max_value <= 0 ||
+        max_value > 65535) {
+        fprintf(stderr, "Error: invalid PNM header\n");
+        return EXIT_FAILURE;
     }
 
-    int empty_glyph = bitmap_set_pixels == 0;
-    int max_noise_pixels = noise_threshold * bitmap->real_size;
-    if (empty_glyph && reference_set_pixels <= max_noise_pixels) {
-        return 1;
+    if (new_image_sink(sink, width, height))
+        return EXIT_FAILURE;
+
+    int sample_size = max_value > 255 ? 2 : 1;
+    size_t row_size = bilevel ? (size_t)(width + 7) / 8
+                              : (size_t)width * channels * sample_size;
+    uint8_t *raw = malloc(row_size);
+    uint8_t *luma = malloc(width);
+    if (!raw || !luma) {
+        perror("Error allocating memory");
+        free(raw);
+        free(luma);
+        free_image_sink(sink);
+        return EXIT_FAILURE;
     }
 
-    int extranuous_pixels = bitmap_set_pixels - overlapping_pixels;
-    int extranuous_penalty = fidelity_function(extranuous_pixels);
-    int set_pixels =
-        reference_set_pixels + bitmap_set_pixels - overlapping_pixels;
+    int error = 0;
+    for (int y = 0; y < height && !error; y++) {
+        if (!ascii) {
+            error = fread(raw, 1, row_size, file) != row_size;
+        } else if (bilevel) {
+            // P1 digits may be packed without whitespace
+            memset(raw, 0, row_size);
+            for (int x = 0; x < width && !error; x++) {
+                int c = fgetc(file);
+                while (c == '#' || (c != EOF && isspace(c))) {
+                    if (c == '#') {
+                        while (c != '\n' && c != EOF) {
+                            c = fgetc(file);
+                        }
+                    }
+                    c = fgetc(file);
+                }
+                error = c != '0' && c != '1';
+                if (c == '1')
+                    raw[x / 8] |= 0x80 >> (x % 8);
+            }
+        } else {
+            for (int i = 0; i < width * channels && !error; i++) {
+                int sample;
+                error = read_pnm_value(file, &sample) || sample > max_value;
+                if (sample_size == 2) {
+                    raw[2 * i] = sample >> 8;
+                    raw[2 * i + 1] = sample & 0xff;
+                } else {
+                    raw[i] = sample;
+                }
+            }
+        }
+        if (error)
+            break;
 
-    return (float)overlapping_pixels / (set_pixels + extranuous_penalty);
+        if (bilevel) {
+            sink_bits_row(sink, y, raw);
+            continue;
+        }
+        uint8_t *rgb = sink_rgb_row(sink);
+        for (int x = 0; x < width; x++) {
+            int samples[3];
+            for (int c = 0; c < channels; c++) {
+                int i = x * channels + c;
+                int sample = sample_size == 2
+                                 ? (raw[2 * i] << 8) | raw[2 * i + 1]
+                                 : raw[i];
+                samples[c] = max_value == 255
+                                 ? sample
+                                 : (sample * 255 + max_value / 2) / max_value;
+            }
+            luma[x] = channels == 3
+                          ? rgb_luma(samples[0], samples[1], samples[2])
+                          : samples[0];
+            if (rgb) {
+                for (int c = 0; c < 3; c++) {
+                    rgb[3 * x + c] = samples[channels == 3 ? c : 0];
+                }
+            }
+        }
+        sink_luma_row(sink, y, luma);
+    }
+
+    free(raw);
+    free(luma);
+    if (error) {
+        fprintf(stderr, "Error: PNM pixel data is truncated or invalid\n");
+        free_image_sink(sink);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-void giko_free_bitmap(giko_bitmap_t *bitmap) {
-    free(bitmap->data);
-    free(bitmap);
+// Scale the channel of a BMP pixel selected by a bit mask to 8 bits
+static uint8_t mask_channel(uint32_t pixel, uint32_t mask) {
+    if (!mask)
+        return 0;
+    int shift = __builtin_ctz(mask);
+    uint32_t max = mask >> shift;
+    return (uint64_t)((pixel & mask) >> shift) * 255 / max;
 }
 
-void giko_free_glyph_map(giko_glyph_map_t *map) {
-    for (int i = 0; i < map->num_advances; i++) {
-        free_glyph_list(map->glyphs[i]);
+static uint32_t load_le(const uint8_t *p, int size) {
+    uint32_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
     }
-    free(map->glyphs);
-    free(map);
+    return value;
 }
 
-void free_glyph_list(giko_glyph_t *list) {
-    giko_glyph_t *curr;
-    giko_glyph_t *tmp = NULL;
-    for (curr = list; curr != NULL; curr = tmp) {
-        tmp = curr->next;
-        giko_free_bitmap(curr->bitmap);
-        free(curr);
+int skip_bytes(FILE *file, long count) {
+    uint8_t buffer[256];
+    while (count > 0) {
+        size_t chunk =
+            count < (long)sizeof(buffer) ? (size_t)count : sizeof(buffer);
+        if (fread(buffer, 1, chunk, file) != chunk)
+            return EXIT_FAILURE;
+        count -= chunk;
     }
+    return EXIT_SUCCESS;
 }
 
-int giko_codepoint_to_utf8(uint8_t *destination, giko_codepoint_t codepoint) {
-    if (codepoint <= 0x7F) {
-        destination[0] = codepoint;
-        return 1;
+// Read a BMP after its "BM" signature. Rows are written bottom-up into the
+// sink as they arrive, so nothing needs flipping afterwards.
+// Compressed (RLE, JPEG, PNG) BMPs are not supported and fail without an
+// error, so callers can fall back to another decoder.
+int read_bmp(FILE *file, image_sink_t *sink) {
+    uint8_t header[BMP_MAX_HEADER_SIZE];
+    if (fread(header, 1, 16, file) != 16) {
+        fprintf(stderr, "Error: BMP header is truncated\n");
+        return EXIT_FAILURE;
     }
-    if (codepoint <= 0x7FF) {
-        destination[0] = 0xC0 | (codepoint >> 6);
-        destination[1] = 0x80 | (codepoint & 0x3F);
-        return 2;
+    uint32_t pixel_offset = load_le(header + 8, 4);
+    uint32_t header_size = load_le(header + 12, 4);
+    long consumed = 2 + 16;
+    if (header_size != 12 && header_size < 40)
+        return EXIT_FAILURE;
+
+    uint32_t dib_size =
+        header_size < BMP_MAX_HEADER_SIZE - 14 ? header_size
+                                               : BMP_MAX_HEADER_SIZE - 14;
+    uint8_t *dib = header + 14;
+    if (fread(dib + 4, 1, dib_size - 4, file) != dib_size - 4 ||
+        skip_bytes(file, header_size - dib_size)) {
+        fprintf(stderr, "Error: BMP header is truncated\n");
+        return EXIT_FAILURE;
     }
-    if (codepoint <= 0xFFFF) {
-        if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
-            return 0;
-        destination[0] = 0xE0 | (codepoint >> 12);
-        destination[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-        destination[2] = 0x80 | (codepoint & 0x3F);
-        return 3;
+    consumed += header_size - 4;
+
+    int width, height, bits_per_pixel;
+    uint32_t compression = BMP_RGB;
+    uint32_t colours = 0;
+    int palette_entry_size = 4;
+    if (header_size == 12) {
+        width = (int16_t)load_le(dib + 4, 2);
+        height = (int16_t)load_le(dib + 6, 2);
+        bits_per_pixel = load_le(dib + 10, 2);
+        palette_entry_size = 3;
+    } else {
+        width = (int32_t)load_le(dib + 4, 4);
+        height = (int32_t)load_le(dib + 8, 4);
+        bits_per_pixel = load_le(dib + 14, 2);
+        compression = load_le(dib + 16, 4);
+        colours = load_le(dib + 32, 4);
     }
-    if (codepoint <= 0x10FFFF) {
-        destination[0] = 0xF0 | (codepoint >> 18);
-        destination[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-        destination[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-        destination[3] = 0x80 | (codepoint & 0x3F);
-        return 4;
+
+    uint32_t masks[3];
+    if (compression == BMP_BITFIELDS) {
+        if (header_size == 40) {
+            if (fread(dib + 40, 1, 12, file) != 12) {
+                fprintf(stderr, "Error: BMP header is truncated\n");
+                return EXIT_FAILURE;
+            }
+            consumed += 12;
+        }
+        for (int c = 0; c < 3; c++) {
+            masks[c] = load_le(dib + 40 + 4 * c, 4);
+        }
+    } else if (bits_per_pixel == 16) {
+        masks[0] = 0x7c00;
+        masks[1] = 0x03e0;
+        masks[2] = 0x001f;
+    } else {
+        masks[0] = 0xff0000;
+        masks[1] = 0x00ff00;
+        masks[2] = 0x0000ff;
     }
-    return 0;
-}
 
-giko_codepoint_t *giko_load_charset(char *filepath, int base_encoding) {
-    assert(base_encoding > 0);
+    int indexed = bits_per_pixel <= 8;
+    int supported =
+        compression == BMP_RGB
+            ? (bits_per_pixel == 1 || bits_per_pixel == 4 ||
+               bits_per_pixel == 8 || bits_per_pixel == 16 ||
+               bits_per_pixel == 24 || bits_per_pixel == 32)
+            : compression == BMP_BITFIELDS &&
+                  (bits_per_pixel == 16 || bits_per_pixel == 32);
+    if (!supported)
+        return EXIT_FAILURE;
 
-    int capacity = STRING_CHUNK_SIZE;
-    int size = 0;
-    giko_codepoint_t *codepoints = malloc(capacity * sizeof(giko_codepoint_t));
-    if (!codepoints) {
-        perror("Error allocating memory");
-        return NULL;
+    // Luminance and colour of each palette entry
+    uint8_t palette[256] = {0};
+    uint8_t palette_rgb[256][3] = {{0}};
+    if (indexed) {
+        if (colours == 0 || colours > (1u << bits_per_pixel))
+            colours = 1u << bits_per_pixel;
+        for (uint32_t i = 0; i < colours; i++) {
+            uint8_t entry[4];
+            if (fread(entry, 1, palette_entry_size, file) !=
+                (size_t)palette_entry_size) {
+                fprintf(stderr, "Error: BMP palette is truncated\n");
+                return EXIT_FAILURE;
+            }
+            palette[i] = rgb_luma(entry[2], entry[1], entry[0]);
+            palette_rgb[i][0] = entry[2];
+            palette_rgb[i][1] = entry[1];
+            palette_rgb[i][2] = entry[0];
+        }
+        consumed += colours * palette_entry_size;
     }
 
-    FILE *charset_f = fopen(filepath, "rb");
-    if (!charset_f) {
-        perror(filepath);
-        return NULL;
+    if (pixel_offset < consumed || skip_bytes(file, pixel_offset - consumed)) {
+        fprintf(stderr, "Error: invalid BMP pixel data offset\n");
+        return EXIT_FAILURE;
     }
 
-    errno = 0;
-    char *endptr;
-    char codepoint_str[MAX_DIGITS_IN_CODEPOINT];
+    int top_down = height < 0;
+    if (top_down)
+        height = -height;
 
-    while (fgets(codepoint_str, MAX_DIGITS_IN_CODEPOINT, charset_f)) {
-        int codepoint = strtol(codepoint_str, &endptr, base_encoding);
+    if (new_image_sink(sink, width, height))
+        return EXIT_FAILURE;
 
-        if (errno) {
-            perror(codepoint_str);
-            return NULL;
+    size_t row_size = (((size_t)bits_per_pixel * width + 31) / 32) * 4;
+    uint8_t *raw = malloc(row_size);
+    uint8_t *luma = malloc(width);
+    if (!raw || !luma) {
+        perror("Error allocating memory");
+        free(raw);
+        free(luma);
+        free_image_sink(sink);
+        return EXIT_FAILURE;
+    }
+
+    // 1 bit images with a dark and a light colour are copied as they are,
+    // unless their palette colours are kept
+    int dark_zero = palette[0] < LUMA_THRESHOLD;
+    int dark_one = palette[1] < LUMA_THRESHOLD;
+    int copy_bits =
+        bits_per_pixel == 1 && dark_zero != dark_one && !sink->colors;
+    if (copy_bits && dark_zero)
+        sink->invert = !sink->invert;
+
+    int error = 0;
+    for (int i = 0; i < height; i++) {
+        if (fread(raw, 1, row_size, file) != row_size) {
+            error = 1;
+            break;
         }
-        if (*endptr == codepoint)
+        int y = top_down ? i : height - 1 - i;
+        if (copy_bits) {
+            sink_bits_row(sink, y, raw);
             continue;
+        }
 
-        if (size >= capacity - 1) {
-            capacity += STRING_CHUNK_SIZE;
-            codepoints =
-                realloc(codepoints, capacity * sizeof(giko_codepoint_t));
-            if (!codepoints) {
-                perror("Error allocating memory");
-                fclose(charset_f);
-                return NULL;
+        uint8_t *rgb = sink_rgb_row(sink);
+        for (int x = 0; x < width; x++) {
+            uint8_t red, green, blue;
+            if (indexed) {
+                int bit = x * bits_per_pixel;
+                int index = (raw[bit / 8] >> (8 - bits_per_pixel - bit % 8)) &
+                            ((1 << bits_per_pixel) - 1);
+                luma[x] = palette[index];
+                red = palette_rgb[index][0];
+                green = palette_rgb[index][1];
+                blue = palette_rgb[index][2];
+            } else if (bits_per_pixel == 24) {
+                red = raw[3 * x + 2];
+                green = raw[3 * x + 1];
+                blue = raw[3 * x];
+                luma[x] = rgb_luma(red, green, blue);
+            } else {
+                int size = bits_per_pixel / 8;
+                uint32_t pixel = load_le(raw + size * x, size);
+                red = mask_channel(pixel, masks[0]);
+                green = mask_channel(pixel, masks[1]);
+                blue = mask_channel(pixel, masks[2]);
+                luma[x] = rgb_luma(red, green, blue);
+            }
+            if (rgb) {
+                rgb[3 * x] = red;
+                rgb[3 * x + 1] = green;
+                rgb[3 * x + 2] = blue;
             }
         }
-        codepoints[size] = codepoint;
-        size++;
+        sink_luma_row(sink, y, luma);
     }
 
-    fclose(charset_f);
-    codepoints[size] = TERMINAL_CODEPOINT;
-    return codepoints;
+    free(raw);
+    free(luma);
+    if (error) {
+        fprintf(stderr, "Error: BMP pixel data is truncated\n");
+        free_image_sink(sink);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-giko_bitmap_t *giko_load_bitmap(char *bmp_filepath) {
-    FILE *bitmap_f = fopen(bmp_filepath, "rb");
-    if (!bitmap_f) {
-        perror(bmp_filepath);
-        return NULL;
+#ifdef GIKO_PNG
+// Read a PNG after its 8 byte signature. Rows are decoded one at a time,
+// except for interlaced images which are decoded whole. Transparent pixels
+// are composited onto white.
+int read_png(FILE *file, image_sink_t *sink) {
+    png_structp png =
+        png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        fprintf(stderr, "Error: libpng initialisation\n");
+        png_destroy_read_struct(&png, NULL, NULL);
+        return EXIT_FAILURE;
     }
 
-    int width;
-    int height;
-
-    fseek(bitmap_f, 18, SEEK_SET);
-    fread(&width, 4, 1, bitmap_f);
-    fread(&height, 4, 1, bitmap_f);
-
-    uint32_t pixel_data_offset;
-    fseek(bitmap_f, 10, SEEK_SET);
-    fread(&pixel_data_offset, 4, 1, bitmap_f);
+    int passes = read_png_header(png, info, file);
+    if (passes <= 0) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return EXIT_FAILURE;
+    }
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+    int channels = png_get_channels(png, info);
+    size_t row_size = png_get_rowbytes(png, info);
 
-    int bitmap_size = pitch_32bit(width) * height;
-    uint8_t *pixel_data = malloc(bitmap_size * sizeof(uint8_t));
-    if (!pixel_data) {
+    if (new_image_sink(sink, width, height)) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return EXIT_FAILURE;
+    }
+    int rows = passes > 1 ? height : 1;
+    uint8_t *pixels = malloc(row_size * rows);
+    png_bytep *row_pointers = malloc(rows * sizeof(png_bytep));
+    uint8_t *luma = malloc(width);
+    int error = !pixels || !row_pointers || !luma;
+    if (error) {
         perror("Error allocating memory");
-        fclose(bitmap_f);
-        return NULL;
+    } else {
+        for (int y = 0; y < rows; y++) {
+            row_pointers[y] = pixels + y * row_size;
+        }
+        error = read_png_rows(png, sink, channels, rows, row_pointers, luma);
     }
-    fseek(bitmap_f, pixel_data_offset, SEEK_SET);
-    fread(pixel_data, 1, bitmap_size, bitmap_f);
 
-    fclose(bitmap_f);
+    free(pixels);
+    free(row_pointers);
+    free(luma);
+    png_destroy_read_struct(&png, &info, NULL);
+    if (error) {
+        free_image_sink(sink);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-    giko_bitmap_t *bitmap = giko_new_bitmap(width, height, pixel_data);
-    if (!bitmap)
-        return NULL;
-    giko_flip_bitmap(bitmap);
+// Read the PNG header and set up 8 bit grey or RGB output, with alpha if
+// the image has any. Returns the number of interlace passes, or 0 on error.
+int read_png_header(png_structp png, png_infop info, FILE *file) {
+    if (setjmp(png_jmpbuf(png)))
+        return 0;
+    png_init_io(png, file);
+    png_set_sig_bytes(png, 8);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    return passes;
+}
 
-    return bitmap;
+// Decode the rows of a PNG into the sink. All rows are decoded at once when
+// there is a row pointer for each row.
+int read_png_rows(png_structp png, image_sink_t *sink, int channels, int rows,
+                  png_bytep *row_pointers, uint8_t *luma) {
+    if (setjmp(png_jmpbuf(png)))
+        return EXIT_FAILURE;
+    if (rows > 1)
+        png_read_image(png, row_pointers);
+
+    for (int y = 0; y < sink->height; y++) {
+        uint8_t *row = row_pointers[rows > 1 ? y : 0];
+        if (rows == 1)
+            png_read_row(png, row, NULL);
+
+        uint8_t *rgb = sink_rgb_row(sink);
+        for (int x = 0; x < sink->width; x++) {
+            uint8_t *pixel = row + x * channels;
+            int value = channels >= 3 ? rgb_luma(pixel[0], pixel[1], pixel[2])
+                                      : pixel[0];
+            int alpha = (channels == 2 || channels == 4) ? pixel[channels - 1]
+                                                         : 255;
+            if (alpha < 255)
+                value = (value * alpha + 255 * (255 - alpha) + 127) / 255;
+            luma[x] = value;
+            if (rgb) {
+                for (int c = 0; c < 3; c++) {
+                    int sample = pixel[channels >= 3 ? c : 0];
+                    rgb[3 * x + c] =
+                        (sample * alpha + 255 * (255 - alpha) + 127) / 255;
+                }
+            }
+        }
+        sink_luma_row(sink, y, luma);
+    }
+    png_read_end(png, NULL);
+    return EXIT_SUCCESS;
 }
+#endif
 
 int giko_write_codepoint_str(giko_codepoint_t *string, char *out_filepath) {
     FILE *out_f = fopen(out_filepath, "w");
@@ -658,3 +5021,224 @@ int giko_write_codepoint_str(giko_codepoint_t *string, char *out_filepath) {
     fclose(out_f);
     return EXIT_SUCCESS;
 }
+
+int giko_write_bitmap(giko_bitmap_t *bitmap, char *out_filepath) {
+    FILE *out_f = fopen(out_filepath, "wb");
+    if (!out_f) {
+        perror(out_filepath);
+        return EXIT_FAILURE;
+    }
+
+    // PBM rows are padded to a byte rather than to 32 bits
+    int row_bytes = (bitmap->width + 7) / 8;
+    int error = fprintf(out_f, "P4\n%d %d\n", bitmap->width,
+                        bitmap->height) < 0;
+    for (int y = 0; y < bitmap->height && !error; y++) {
+        error = fwrite(bitmap->data + (size_t)y * bitmap->pitch, 1, row_bytes,
+                       out_f) != (size_t)row_bytes;
+    }
+    if (fclose(out_f) || error) {
+        perror(out_filepath);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Glyph map cache
+
+// 64 bit FNV-1a
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t giko_glyph_map_key(char *ttf_filepath, giko_codepoint_t *charset,
+                            int glyph_size, sort_order_t order) {
+    FILE *font_f = fopen(ttf_filepath, "rb");
+    if (!font_f) {
+        perror(ttf_filepath);
+        return 0;
+    }
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t version = GLYPH_MAP_VERSION;
+    hash = fnv1a(hash, &version, sizeof(version));
+
+    uint8_t buffer[1 << 16];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), font_f)) > 0) {
+        hash = fnv1a(hash, buffer, bytes_read);
+    }
+    int error = ferror(font_f);
+    fclose(font_f);
+    if (error) {
+        fprintf(stderr, "Error reading %s\n", ttf_filepath);
+        return 0;
+    }
+
+    int32_t parameters[2] = {glyph_size, order};
+    hash = fnv1a(hash, parameters, sizeof(parameters));
+    for (int i = 0; charset[i] != TERMINAL_CODEPOINT; i++) {
+        hash = fnv1a(hash, &charset[i], sizeof(giko_codepoint_t));
+    }
+
+    return hash ? hash : 1; // 0 is reserved for errors
+}
+
+int giko_save_glyph_map(giko_glyph_map_t *map, uint64_t key,
+                        char *filepath) {
+    load_all_buckets(map, NULL);
+    glyph_map_file_header_t header = {0};
+    memcpy(header.magic, GLYPH_MAP_MAGIC, sizeof(header.magic));
+    header.version = GLYPH_MAP_VERSION;
+    header.byte_order = 0x01020304;
+    header.key = key;
+    header.file_size = sizeof(header) + map->image_size;
+    header.num_advances = map->num_advances;
+    header.em_height = map->em_height;
+    header.num_glyphs = map->num_glyphs;
+    header.atlas_size =
+        atlas_size(map->buckets, map->num_advances, map->em_height);
+
+    // Write to a uniquely named temporary file and rename it into place, so
+    // concurrent readers never see a partially written cache and concurrent
+    // writers, even threads of one process, never share a temporary file
+    char tmp_filepath[4096];
+    int length = snprintf(tmp_filepath, sizeof(tmp_filepath), "%s.XXXXXX",
+                          filepath);
+    if (length < 0 || (size_t)length >= sizeof(tmp_filepath)) {
+        fprintf(stderr, "Error: glyph map cache path %s is too long\n",
+                filepath);
+        return EXIT_FAILURE;
+    }
+    int fd = mkstemp(tmp_filepath);
+    if (fd < 0) {
+        perror(tmp_filepath);
+        return EXIT_FAILURE;
+    }
+    // mkstemp creates the file readable by its owner only
+    FILE *cache_f = NULL;
+    if (fchmod(fd, 0644) || !(cache_f = fdopen(fd, "wb"))) {
+        perror(tmp_filepath);
+        close(fd);
+        remove(tmp_filepath);
+        return EXIT_FAILURE;
+    }
+
+    fwrite(&header, sizeof(header), 1, cache_f);
+    fwrite(map->image, 1, map->image_size, cache_f);
+
+    int error = ferror(cache_f);
+    if (fclose(cache_f) || error) {
+        fprintf(stderr, "Error writing %s\n", tmp_filepath);
+        remove(tmp_filepath);
+        return EXIT_FAILURE;
+    }
+    if (rename(tmp_filepath, filepath)) {
+        perror(filepath);
+        remove(tmp_filepath);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+giko_glyph_map_t *giko_load_glyph_map(char *filepath, uint64_t key) {
+    FILE *cache_f = fopen(filepath, "rb");
+    if (!cache_f) {
+        if (errno != ENOENT)
+            perror(filepath);
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (fstat(fileno(cache_f), &file_stat) ||
+        (size_t)file_stat.st_size < sizeof(glyph_map_file_header_t)) {
+        fclose(cache_f);
+        return NULL;
+    }
+    size_t file_size = file_stat.st_size;
+    void *mapping =
+        mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(cache_f), 0);
+    fclose(cache_f);
+    if (mapping == MAP_FAILED) {
+        perror(filepath);
+        return NULL;
+    }
+
+    glyph_map_file_header_t header;
+    memcpy(&header, mapping, sizeof(header));
+    if (memcmp(header.magic, GLYPH_MAP_MAGIC, sizeof(header.magic)) ||
+        header.version != GLYPH_MAP_VERSION ||
+        header.byte_order != 0x01020304 || header.key != key) {
+        // Stale or foreign cache, rebuild
+        munmap(mapping, file_size);
+        return NULL;
+    }
+
+    map_layout_t layout = {0};
+    if (header.num_advances > 0 && header.num_glyphs >= 0 &&
+        header.em_height > 0) {
+        layout = map_layout(header.num_advances, header.num_glyphs,
+                            header.atlas_size);
+    }
+    if (layout.size == 0 || header.file_size != file_size ||
+        sizeof(header) + layout.size != file_size) {
+        fprintf(stderr, "Error: corrupt glyph map cache %s\n", filepath);
+        munmap(mapping, file_size);
+        return NULL;
+    }
+
+    giko_glyph_map_t *map = malloc(sizeof(giko_glyph_map_t));
+    if (!map) {
+        perror("Error allocating memory");
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    map->num_advances = header.num_advances;
+    map->em_height = header.em_height;
+    map->num_glyphs = header.num_glyphs;
+    map->image = (uint8_t *)mapping + sizeof(header);
+    map->image_size = layout.size;
+    map->mapping = mapping;
+    map->mapping_size = file_size;
+    map->lazy = NULL;
+    map->gray = NULL;
+    set_map_arrays(map, layout);
+
+    if (!valid_map_buckets(map, header.atlas_size)) {
+        fprintf(stderr, "Error: corrupt glyph map cache %s\n", filepath);
+        giko_free_glyph_map(map);
+        return NULL;
+    }
+    return map;
+}
+
+// Check that every bucket lies inside the glyphs, and every glyph bitmap
+// of it inside the atlas and 32 bit aligned, so that corrupt or truncated
+// caches are not read out of bounds. by_set_pixels must index the bucket's
+// own glyphs.
+int valid_map_buckets(giko_glyph_map_t *map, uint64_t atlas_size) {
+    for (int advance = 0; advance < map->num_advances; advance++) {
+        glyph_bucket_t bucket = map->buckets[advance];
+        uint64_t bitmap_size = pitch_32bit(advance) * map->em_height;
+        if (bucket.start < 0 || bucket.count < 0 ||
+            bucket.count > map->num_glyphs - bucket.start)
+            return 0;
+        for (int i = bucket.start; i < bucket.start + bucket.count; i++) {
+            int32_t sorted = map->by_set_pixels[i];
+            if (map->offsets[i] % sizeof(uint32_t) != 0 ||
+                map->offsets[i] + bitmap_size > atlas_size ||
+                sorted < bucket.start || sorted >= bucket.start + bucket.count)
+                return 0;
+        }
+    }
+    return 1;
+}
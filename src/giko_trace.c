@@ -1,15 +1,68 @@
 #include "giko.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #define MAX_CMD_LEN 1024
-#define PAGE_SIZE 4096
 #define MAX_PATH_LEN 4096
+#define SWEEP_MIN_SECONDS 0.05 // Traces are repeated for at least this long
+#define SWEEP_MAX_REPEATS 100
+#define SERVE_MAGIC "GIKO"
+#define SERVE_REQUEST_HEADER 12 // Magic, then the sizes of params and image
+#define SERVE_RESPONSE_HEADER 8 // Status, then the size of the body
+#define SERVE_MAX_PARAMS (64 * 1024)
+#define SERVE_MAX_IMAGE (256 * 1024 * 1024)
+#define SERVE_QUEUE_SIZE 256 // Accepted connections waiting for a worker
+#define SERVE_TIMEOUT_SECONDS 30 // Longest wait for a client to send or read
+#define SERVE_MAX_GLYPH_SIZE 512 // Largest glyph size of a request's map
+
+// Defaults of the CLI, and of the daemon's requests
+#define DEFAULT_HEIGHT 32
+#define DEFAULT_BASE_ENCODING 10
+#define DEFAULT_CHUNKINESS 0.5
+#define DEFAULT_ACCURACY 0.5
+#define DEFAULT_DENOISE 0.05
+#define DEFAULT_SORT_ORDER NONE
+#define DEFAULT_FIDELITY HIGH
+#define DEFAULT_NEGATION 0
+#define DEFAULT_VERBOSE 0
+#define DEFAULT_THREADS 1
+#define DEFAULT_CACHE 1
+#define DEFAULT_LAZY 0
+#define DEFAULT_SEARCH SEARCH_LINEAR
+#define DEFAULT_STREAM 0
+#define DEFAULT_FRAMES 0
+#define DEFAULT_SEGMENTATION SEGMENT_GREEDY
+#define DEFAULT_SHORTLIST 0
+#define DEFAULT_MODE BILEVEL
+#define DEFAULT_COLOR COLOR_NONE
+#define DEFAULT_SCORE 0
+#define DEFAULT_SWEEP_LIMIT 0
+#define DEFAULT_STATS 0
+#define DEFAULT_MAX_MAPS 32
+#define DEFAULT_MAX_PIXELS (8192L * 8192)
 
 typedef enum { LOW, MEDIUM, HIGH } fidelity_t;
 
+// How images are reduced for tracing: thresholded, dithered, or kept grey
+typedef enum { BILEVEL, DITHER, GRAY } image_mode_t;
+
+// How each glyph is coloured with the colour of its cell, if at all
+typedef enum { COLOR_NONE, COLOR_ANSI, COLOR_HTML } color_format_t;
+
 typedef struct config {
     char charset_file[MAX_PATH_LEN];
     char image_file[MAX_PATH_LEN];
@@ -23,121 +76,1126 @@ typedef struct config {
     float denoise;
     fidelity_t fidelity;
     int negate;
+    int threads;
+    int cache;
+    char cache_dir[MAX_PATH_LEN];
+    int lazy; // Rasterize glyphs when first searched, see --lazy
+    search_mode_t search;
+    char batch[MAX_PATH_LEN];
+    char output_dir[MAX_PATH_LEN];
+    int stream;
+    int frames;
+    segmentation_t segmentation;
+    int shortlist;
+    image_mode_t mode;
+    color_format_t color;
+    char render_file[MAX_PATH_LEN];
+    int score;
+    char sweep_dir[MAX_PATH_LEN];
+    int sweep_limit;
+    int stats;
+    char socket_path[MAX_PATH_LEN]; // Of the daemon, or to connect to
+    int max_maps;                   // Glyph maps kept by the daemon
+    long max_pixels;                // Largest image the daemon traces
 } config_t;
 
-uint8_t *magick_pipe(char *img_filepath);
-giko_bitmap_t *get_bitmap(uint8_t *bmp_blob);
+// Measures of the whole run, printed as JSON by --stats. Traces add to it
+// through their options, and decoding is added to by the CLI itself.
+giko_stats_t run_stats;
+
+// Shared by every glyph map build and trace of the run, so that batches and
+// sweeps reuse font faces and scratch buffers across images and settings.
+// Set up by the CLI and the daemon before tracing.
+giko_context_t *run_context;
+
+// Set by SIGINT or SIGTERM to stop the daemon
+volatile sig_atomic_t serve_stopping;
+
+// Reference image of a trace. A graymap in GRAY mode, otherwise a bitmap.
+typedef struct reference {
+    giko_bitmap_t *bitmap;
+    giko_graymap_t *graymap;
+    giko_color_bands_t *colors; // Colours of the image, if they are written
+    int height;
+} reference_t;
+
+// Destination of traced rows
+typedef struct row_output {
+    FILE *file;
+    color_format_t color;
+} row_output_t;
+
+// Settings of one trace of a sweep, and how it did
+typedef struct sweep_point {
+    float chunkiness;
+    float accuracy;
+    float denoise;
+    fidelity_t fidelity;
+    double seconds; // CPU time of one trace
+    float iou;      // Of the reference and the rendered trace
+    int pareto;     // No other point is both as fast and as good
+} sweep_point_t;
+
+// Shared state of a sweep. Workers claim points through next_point.
+typedef struct sweep_job {
+    config_t *config;
+    reference_t *reference;
+    giko_glyph_map_t *map;
+    sweep_point_t *points;
+    int num_points;
+    int next_point;
+    int failed;
+} sweep_job_t;
+
+// Growable list of file paths
+typedef struct path_list {
+    char **paths;
+    int size;
+    int capacity;
+} path_list_t;
+
+// Glyph map of a batch for one glyph size. The lock is held while the map
+// is built, so images of other sizes do not wait for it.
+typedef struct batch_map {
+    pthread_mutex_t lock;
+    giko_glyph_map_t *map; // Built on first use
+} batch_map_t;
+
+// Shared state of a batch. Workers claim images through next_input.
+typedef struct batch_job {
+    config_t *config;
+    giko_codepoint_t *charset;
+    giko_trace_options_t options;
+    path_list_t inputs;
+    int next_input;
+    int failed;
+    pthread_mutex_t maps_lock; // Guards maps and num_maps
+    batch_map_t **maps;        // Indexed by glyph size, or NULL
+    int num_maps;
+} batch_job_t;
+
+// Glyph map kept by the daemon between requests, keyed by everything it is
+// built from. A slot is free when it has neither a map nor a build.
+typedef struct served_map {
+    char font_file[MAX_PATH_LEN];
+    char charset_file[MAX_PATH_LEN];
+    int base_encoding;
+    int glyph_size;
+    sort_order_t order;
+    giko_glyph_map_t *map;
+    int building;       // The map is being built by a request
+    int users;          // Requests tracing with the map
+    uint64_t last_used; // Maps are evicted least recently used first
+} served_map_t;
+
+// Shared state of the daemon. The main thread queues accepted connections
+// and workers serve them one request after another. The fields below lock
+// are guarded by it.
+typedef struct server {
+    config_t *config;
+    int num_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // A connection was queued, or stopping
+    pthread_cond_t map_changed; // A map was built, or released
+    int queue[SERVE_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    int *active; // Connection served by each worker, or -1
+    int started; // Workers that have claimed an index in active
+    int stopping;
+    served_map_t *maps;
+    int num_maps;
+    uint64_t clock; // Ticks on every map use
+} server_t;
+
+// Finds the glyph map of a reference from its height. Colours are summed in
+// bands of the map's em_height as the image is decoded, so references with
+// colours find their map before they are decoded, the others after.
+typedef struct map_finder {
+    config_t *config;
+    giko_codepoint_t *charset; // Builds the map of a single trace,
+    batch_job_t *batch;        // or takes it from a batch,
+    server_t *server;          // or from the daemon
+    giko_glyph_map_t *map;     // Map found, or NULL
+    served_map_t *served;      // The daemon's entry of the map, to release
+    int failed;                // Set if the map could not be found
+    int too_short;             // Set if the image has fewer pixel rows than
+                               // config->height
+    long max_pixels;           // Largest image size, or 0 for any
+    int max_glyph_size;        // Largest glyph size, or 0 for any
+    int too_large;             // Set if the image or glyphs are larger
+    uint64_t find_ns;          // Time spent finding the map
+} map_finder_t;
+
+giko_glyph_map_t *get_glyph_map(config_t config, giko_codepoint_t *charset,
+                                int glyph_size);
+giko_glyph_map_t *build_glyph_map(config_t config, giko_codepoint_t *charset,
+                                  int glyph_size);
+int cache_filepath(config_t config, uint64_t key, char *filepath);
+int find_map(map_finder_t *finder, int height);
+int find_band_height(int width, int height, void *user_data);
+int load_reference(char *filepath, config_t *config, map_finder_t *finder,
+                   reference_t *reference);
+giko_graymap_t *load_graymap(char *filepath, int negate, map_finder_t *finder,
+                             giko_color_bands_t **colors);
+FILE *magick_pipe(char *img_filepath, image_mode_t mode, int colors);
+giko_codepoint_t *trace_reference(reference_t *reference,
+                                  giko_glyph_map_t *map,
+                                  giko_trace_options_t *options);
+void free_reference(reference_t *reference);
 void print_codepoint_str(giko_codepoint_t *string);
+int render_art(giko_codepoint_t *aa, giko_glyph_map_t *map,
+               reference_t *reference, config_t *config);
+int stream_art_str(reference_t *reference, giko_glyph_map_t *map,
+                   giko_trace_options_t *options, char *output_file,
+                   config_t *config);
+int write_art_rows(reference_t *reference, giko_glyph_map_t *map,
+                   giko_trace_options_t *options, FILE *out,
+                   config_t *config);
+int write_row(const giko_row_t *row, void *user_data);
+int write_color_row(const giko_row_t *row, void *user_data);
+void write_html_text(FILE *out, const uint8_t *utf8, int length);
+giko_trace_options_t get_trace_options(config_t config);
+int giko_trace_batch(config_t config);
+int collect_batch_inputs(char *source, path_list_t *inputs);
+int push_path(path_list_t *list, const char *path);
+void free_path_list(path_list_t *list);
+int compare_paths(const void *a, const void *b);
+void *batch_worker(void *arg);
+int trace_batch_image(batch_job_t *job, char *filepath);
+giko_glyph_map_t *batch_glyph_map(batch_job_t *job, int glyph_size);
+batch_map_t *find_batch_map(batch_job_t *job, int glyph_size);
+int batch_output_path(config_t *config, char *input, char *output);
+int check_output_names(path_list_t *inputs);
+char *path_name(char *path);
+int compare_path_names(const void *a, const void *b);
+int giko_trace_frames(config_t config);
+giko_bitmap_t *read_frame(FILE *in, config_t *config, int *done);
+int giko_trace_sweep(config_t config);
+int run_sweep(config_t *config, reference_t *reference,
+              giko_glyph_map_t *map);
+int clear_pareto_files(char *sweep_dir);
+int sweep_grid(sweep_point_t **points, int limit);
+void *sweep_worker(void *arg);
+int evaluate_sweep_point(sweep_job_t *job, sweep_point_t *point);
+double thread_seconds(void);
+void mark_pareto(sweep_point_t *points, int count);
+int compare_sweep_seconds(const void *a, const void *b);
+int write_config_file(config_t *config, sweep_point_t *point, char *filepath);
+void read_config(FILE *file, config_t *config);
+const char *config_error(config_t *config);
+int giko_serve(config_t config);
+void stop_serving(int signal_number);
+int listen_socket(char *socket_path);
+void default_socket_path(char *socket_path);
+void *serve_worker(void *arg);
+int serve_request(server_t *server, int fd);
+const char *trace_request(server_t *server, char *params, size_t params_size,
+                          uint8_t *image, size_t image_size, char **body,
+                          size_t *body_size);
+int read_reference(FILE *file, config_t *config, map_finder_t *finder,
+                   reference_t *reference);
+served_map_t *acquire_served_map(server_t *server, config_t *config,
+                                 int glyph_size);
+served_map_t *find_served_map(server_t *server, config_t *config,
+                              int glyph_size);
+served_map_t *idle_served_map(server_t *server);
+void release_served_map(server_t *server, served_map_t *entry);
+int send_response(int fd, uint32_t status, const char *body, size_t size);
+int giko_trace_remote(config_t config);
+int connect_socket(char *socket_path);
+int absolute_path(char *path);
+uint8_t *read_stream(FILE *file, size_t *size);
+int read_full(int fd, void *buffer, size_t size);
+int write_full(int fd, const void *buffer, size_t size);
+uint32_t load_be32(const uint8_t *bytes);
+void store_be32(uint8_t *bytes, uint32_t value);
+void write_config(FILE *file, config_t *config);
+const char *fidelity_name(fidelity_t fidelity);
+giko_stats_t *config_stats(config_t *config);
+giko_codepoint_t *load_charset(config_t *config);
+void add_run_time(uint64_t *total, uint64_t begin);
+void print_stats(FILE *out, giko_stats_t *stats);
 
 // Helper functions
 int linear(int x) { return x; }
 int quadratic(int x) { return x * x; }
 int cubic(int x) { return x * x * x; }
-int pitch_32bit(int width) { return ((width + 31) / 32) * 4; }
 
 int giko_trace(config_t config) {
     giko_codepoint_t *charset =
-        giko_load_charset(config.charset_file, config.base_encoding);
+        load_charset(&config);
+    if (!charset)
+        return EXIT_FAILURE;
+
+    reference_t reference;
+    map_finder_t finder = {0};
+    finder.config = &config;
+    finder.charset = charset;
+    uint64_t begin = giko_stats_clock();
+    int failed =
+        load_reference(config.image_file, &config, &finder, &reference);
+    add_run_time(&run_stats.decode_ns, begin + finder.find_ns);
+    if (!failed)
+        failed = find_map(&finder, reference.height);
+    if (finder.too_short) {
+        fprintf(
+            stderr,
+            "Error: --height must be less than height of reference image.\n");
+    }
+    if (failed)
+        return EXIT_FAILURE;
+
+    giko_glyph_map_t *map = finder.map;
+    giko_trace_options_t options = get_trace_options(config);
+    options.colors = reference.colors;
+    int render = strlen(config.render_file) > 0 || config.score;
+    if (!render && (config.stream || config.color != COLOR_NONE))
+        return stream_art_str(&reference, map, &options, config.output_file,
+                              &config);
+    giko_codepoint_t *aa = trace_reference(&reference, map, &options);
+    if (!aa)
+        return EXIT_FAILURE;
+
+    if (strlen(config.output_file) > 0) {
+        giko_write_codepoint_str(aa, config.output_file);
+    } else {
+        print_codepoint_str(aa);
+    }
+
+    if (render)
+        return render_art(aa, map, &reference, &config);
+    return EXIT_SUCCESS;
+}
+
+// Render the art back into an image the size of the reference, to write it
+// to the render file and print how well it matches the reference
+int render_art(giko_codepoint_t *aa, giko_glyph_map_t *map,
+               reference_t *reference, config_t *config) {
+    int width = reference->bitmap ? reference->bitmap->width
+                                  : reference->graymap->width;
+    giko_bitmap_t *rendered =
+        giko_render_art_str(aa, map, width, reference->height);
+    if (!rendered)
+        return EXIT_FAILURE;
+
+    int result = EXIT_SUCCESS;
+    if (strlen(config->render_file) > 0)
+        result = giko_write_bitmap(rendered, config->render_file);
+    if (result == EXIT_SUCCESS && config->score) {
+        float iou = giko_bitmap_iou(reference->bitmap, rendered);
+        if (iou < 0) {
+            result = EXIT_FAILURE;
+        } else {
+            fprintf(stderr, "IoU: %.6f\n", iou);
+        }
+    }
+    giko_free_bitmap(rendered);
+    return result;
+}
+
+// Write each row to the output file, or stdout, as soon as it is traced
+int stream_art_str(reference_t *reference, giko_glyph_map_t *map,
+                   giko_trace_options_t *options, char *output_file,
+                   config_t *config) {
+    FILE *out = stdout;
+    if (strlen(output_file) > 0) {
+        out = fopen(output_file, "w");
+        if (!out) {
+            perror(output_file);
+            return EXIT_FAILURE;
+        }
+    }
+    int result = write_art_rows(reference, map, options, out, config);
+    if (out != stdout)
+        fclose(out);
+    return result;
+}
+
+// Trace the reference into out row by row, coloured if the config asks for
+// it. HTML rows are wrapped in a <pre> block on the image's background.
+int write_art_rows(reference_t *reference, giko_glyph_map_t *map,
+                   giko_trace_options_t *options, FILE *out,
+                   config_t *config) {
+    row_output_t output = {out, config->color};
+    giko_row_callback_t callback =
+        config->color == COLOR_NONE ? write_row : write_color_row;
+    void *user_data = config->color == COLOR_NONE ? (void *)out : &output;
+
+    if (config->color == COLOR_HTML)
+        fprintf(out, "<pre style=\"background-color:%s\">\n",
+                config->negate ? "#000000" : "#ffffff");
+    int result = reference->graymap
+                     ? giko_trace_graymap_rows(reference->graymap, map,
+                                               options, callback, user_data)
+                     : giko_trace_rows(reference->bitmap, map, options,
+                                       callback, user_data);
+    if (result == EXIT_SUCCESS && config->color == COLOR_HTML &&
+        (fputs("</pre>\n", out) == EOF || fflush(out))) {
+        perror("Error writing output");
+        result = EXIT_FAILURE;
+    }
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int write_row(const giko_row_t *row, void *user_data) {
+    FILE *out = user_data;
+    if (fwrite(row->utf8, 1, row->utf8_length, out) !=
+            (size_t)row->utf8_length ||
+        fflush(out)) {
+        perror("Error writing output");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Write a row with each glyph in the colour of its cell, as 24 bit ANSI
+// escapes or HTML spans. A colour is only written when it changes, and
+// spaces keep the colour before them so runs are not broken up.
+int write_color_row(const giko_row_t *row, void *user_data) {
+    row_output_t *output = user_data;
+    FILE *out = output->file;
+    int html = output->color == COLOR_HTML;
+    int colored = 0;
+    giko_color_t current = {0};
+    uint8_t utf8[4];
+
+    for (int i = 0; i < row->length; i++) {
+        giko_codepoint_t codepoint = row->codepoints[i];
+        if (codepoint == '\n')
+            break;
+        int length = giko_codepoint_to_utf8(utf8, codepoint);
+        if (length <= 0) {
+            fprintf(stderr, "Invalid codepoint: U+%04X\n", codepoint);
+            continue;
+        }
+
+        giko_color_t color = row->colors[i];
+        int blank = codepoint == ' ' || codepoint == 0x3000;
+        if (!blank && (!colored || color.red != current.red ||
+                       color.green != current.green ||
+                       color.blue != current.blue)) {
+            if (html) {
+                fprintf(out, "%s<span style=\"color:#%02x%02x%02x\">",
+                        colored ? "</span>" : "", color.red, color.green,
+                        color.blue);
+            } else {
+                fprintf(out, "\x1b[38;2;%d;%d;%dm", color.red, color.green,
+                        color.blue);
+            }
+            colored = 1;
+            current = color;
+        }
+        if (html) {
+            write_html_text(out, utf8, length);
+        } else {
+            fwrite(utf8, 1, length, out);
+        }
+    }
 
-    int (*fidelity_function)(int);
+    if (colored)
+        fputs(html ? "</span>" : "\x1b[0m", out);
+    if (fputc('\n', out) == EOF || fflush(out)) {
+        perror("Error writing output");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Write UTF-8 text, escaping the characters HTML reserves
+void write_html_text(FILE *out, const uint8_t *utf8, int length) {
+    for (int i = 0; i < length; i++) {
+        if (utf8[i] == '<') {
+            fputs("&lt;", out);
+        } else if (utf8[i] == '>') {
+            fputs("&gt;", out);
+        } else if (utf8[i] == '&') {
+            fputs("&amp;", out);
+        } else {
+            fputc(utf8[i], out);
+        }
+    }
+}
+
+giko_trace_options_t get_trace_options(config_t config) {
+    int (*fidelity_function)(int) = cubic;
     if (config.fidelity == LOW) {
         fidelity_function = linear;
     } else if (config.fidelity == MEDIUM) {
         fidelity_function = quadratic;
-    } else if (config.fidelity == HIGH) {
-        fidelity_function = cubic;
     }
 
-    uint8_t *bmp_blob = magick_pipe(config.image_file);
-    if (!bmp_blob) {
-        fprintf(stderr, "Error using image magick. Please make sure image "
-                        "magick is installed on your system\n");
+    giko_trace_options_t options = giko_default_trace_options();
+    options.chunk_greed = 1 - config.chunkiness;
+    options.glyph_greed = config.accuracy;
+    options.noise_threshold = config.denoise;
+    options.fidelity_function = fidelity_function;
+    options.num_threads = config.threads;
+    options.search = config.search;
+    options.segmentation = config.segmentation;
+    options.shortlist = config.shortlist;
+    options.stats = config_stats(&config);
+    options.context = run_context;
+    return options;
+}
+
+// Trace every image of a directory, glob or manifest. The charset is loaded
+// once and glyph maps are shared by all images of the same glyph size.
+// Images are traced in parallel, each by a single thread.
+int giko_trace_batch(config_t config) {
+    batch_job_t job = {0};
+    job.config = &config;
+    if (collect_batch_inputs(config.batch, &job.inputs))
+        return EXIT_FAILURE;
+    if (job.inputs.size == 0) {
+        fprintf(stderr, "Error: no images found in %s\n", config.batch);
+        free_path_list(&job.inputs);
         return EXIT_FAILURE;
     }
-    giko_bitmap_t *reference = get_bitmap(bmp_blob);
-
-    if (!config.negate) {
-        giko_negate_bitmap(reference);
+    if (strlen(config.output_dir) > 0 && mkdir(config.output_dir, 0755) &&
+        errno != EEXIST) {
+        perror(config.output_dir);
+        free_path_list(&job.inputs);
+        return EXIT_FAILURE;
+    }
+    if (strlen(config.output_dir) > 0 && check_output_names(&job.inputs)) {
+        free_path_list(&job.inputs);
+        return EXIT_FAILURE;
     }
 
-    int glyph_size = reference->height / config.height;
-    if (glyph_size <= 0) {
-        fprintf(
-            stderr,
-            "Error: --height must be less than height of reference image.\n");
+    job.charset = load_charset(&config);
+    if (!job.charset) {
+        free_path_list(&job.inputs);
         return EXIT_FAILURE;
     }
+    job.options = get_trace_options(config);
+    job.options.num_threads = 1;
+    pthread_mutex_init(&job.maps_lock, NULL);
 
-    giko_glyph_map_t *map = giko_new_glyph_map(
-        config.font_file, charset, glyph_size, config.glyph_map_order);
-    giko_codepoint_t *aa =
-        giko_new_art_str(reference, map, 1 - config.chunkiness, config.accuracy,
-                         config.denoise, fidelity_function);
+    int num_workers = config.threads;
+    if (num_workers == 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > job.inputs.size)
+        num_workers = job.inputs.size;
 
-    if (strlen(config.output_file) > 0) {
-        giko_write_codepoint_str(aa, config.output_file);
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    int started = 0;
+    if (workers) {
+        for (; started < num_workers; started++) {
+            if (pthread_create(&workers[started], NULL, batch_worker, &job))
+                break;
+        }
+    }
+    if (started == 0) {
+        // Trace on the calling thread instead
+        batch_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (int i = 0; i < job.num_maps; i++) {
+        if (!job.maps[i])
+            continue;
+        if (job.maps[i]->map)
+            giko_free_glyph_map(job.maps[i]->map);
+        pthread_mutex_destroy(&job.maps[i]->lock);
+        free(job.maps[i]);
+    }
+    free(job.maps);
+    pthread_mutex_destroy(&job.maps_lock);
+    free(job.charset);
+
+    if (job.failed) {
+        fprintf(stderr, "Error: %d of %d images could not be traced\n",
+                job.failed, job.inputs.size);
+    }
+    free_path_list(&job.inputs);
+    return job.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Gather input paths. "-" reads a newline separated manifest from stdin, a
+// directory lists its files and anything else is expanded as a glob.
+// Directories skip hidden, .txt and .html files, so earlier outputs are not
+// traced.
+int collect_batch_inputs(char *source, path_list_t *inputs) {
+    struct stat info;
+    if (strcmp(source, "-") == 0) {
+        char line[MAX_PATH_LEN];
+        while (fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (strlen(line) > 0 && push_path(inputs, line))
+                return EXIT_FAILURE;
+        }
+    } else if (stat(source, &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR *directory = opendir(source);
+        if (!directory) {
+            perror(source);
+            return EXIT_FAILURE;
+        }
+        struct dirent *entry;
+        char filepath[MAX_PATH_LEN];
+        while ((entry = readdir(directory))) {
+            size_t length = strlen(entry->d_name);
+            if (entry->d_name[0] == '.' ||
+                (length > 4 &&
+                 strcmp(entry->d_name + length - 4, ".txt") == 0) ||
+                (length > 5 &&
+                 strcmp(entry->d_name + length - 5, ".html") == 0))
+                continue;
+            snprintf(filepath, sizeof(filepath), "%s/%s", source,
+                     entry->d_name);
+            if (stat(filepath, &info) == 0 && S_ISREG(info.st_mode) &&
+                push_path(inputs, filepath)) {
+                closedir(directory);
+                return EXIT_FAILURE;
+            }
+        }
+        closedir(directory);
+        qsort(inputs->paths, inputs->size, sizeof(char *), compare_paths);
     } else {
-        print_codepoint_str(aa);
+        glob_t matches;
+        int error = glob(source, 0, NULL, &matches);
+        if (error == GLOB_NOMATCH)
+            return EXIT_SUCCESS;
+        if (error) {
+            fprintf(stderr, "Error: could not expand %s\n", source);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; !error && i < matches.gl_pathc; i++) {
+            error = push_path(inputs, matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+        if (error)
+            return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
+}
 
+int push_path(path_list_t *list, const char *path) {
+    if (list->size == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (!paths) {
+            perror("Error allocating memory");
+            return EXIT_FAILURE;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->size] = strdup(path);
+    if (!list->paths[list->size]) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+    list->size++;
     return EXIT_SUCCESS;
 }
 
-uint8_t *magick_pipe(char *img_filepath) {
-    FILE *pipe;
-    uint8_t buffer[PAGE_SIZE];
-    int bytes_read;
-    int blob_size = 0;
-    char command[MAX_CMD_LEN];
+void free_path_list(path_list_t *list) {
+    for (int i = 0; i < list->size; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
 
-    uint8_t *bmp_blob = NULL;
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    snprintf(command, sizeof(command),
-             "magick %s -threshold 50%% -type bilevel BMP:-", img_filepath);
-    pipe = popen(command, "r");
-    if (!pipe) {
-        perror("popen");
+void *batch_worker(void *arg) {
+    batch_job_t *job = arg;
+    while (1) {
+        int input = __atomic_fetch_add(&job->next_input, 1, __ATOMIC_RELAXED);
+        if (input >= job->inputs.size)
+            break;
+        if (trace_batch_image(job, job->inputs.paths[input])) {
+            fprintf(stderr, "Error: failed to trace %s\n",
+                    job->inputs.paths[input]);
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int trace_batch_image(batch_job_t *job, char *filepath) {
+    reference_t reference;
+    map_finder_t finder = {0};
+    finder.config = job->config;
+    finder.batch = job;
+    uint64_t begin = giko_stats_clock();
+    int failed = load_reference(filepath, job->config, &finder, &reference);
+    add_run_time(&run_stats.decode_ns, begin + finder.find_ns);
+    if (!failed && find_map(&finder, reference.height)) {
+        free_reference(&reference);
+        failed = 1;
+    }
+    if (finder.too_short)
+        fprintf(stderr, "Error: %s is shorter than --height.\n", filepath);
+    if (failed)
+        return EXIT_FAILURE;
+    giko_glyph_map_t *map = finder.map;
+
+    char output[MAX_PATH_LEN];
+    if (batch_output_path(job->config, filepath, output)) {
+        free_reference(&reference);
+        return EXIT_FAILURE;
+    }
+    if (job->config->color != COLOR_NONE) {
+        giko_trace_options_t options = job->options;
+        options.colors = reference.colors;
+        int result = stream_art_str(&reference, map, &options, output,
+                                    job->config);
+        free_reference(&reference);
+        return result;
+    }
+
+    giko_codepoint_t *aa = trace_reference(&reference, map, &job->options);
+    free_reference(&reference);
+    if (!aa)
+        return EXIT_FAILURE;
+
+    int result = giko_write_codepoint_str(aa, output);
+    free(aa);
+    return result;
+}
+
+// Get the shared glyph map of a glyph size, building it on first use
+giko_glyph_map_t *batch_glyph_map(batch_job_t *job, int glyph_size) {
+    batch_map_t *entry = find_batch_map(job, glyph_size);
+    if (!entry)
         return NULL;
+    pthread_mutex_lock(&entry->lock);
+    if (!entry->map)
+        entry->map = get_glyph_map(*job->config, job->charset, glyph_size);
+    giko_glyph_map_t *map = entry->map;
+    pthread_mutex_unlock(&entry->lock);
+    return map;
+}
+
+// Find the map entry of a glyph size, adding it if there is none. Only
+// this holds maps_lock, never a map build.
+batch_map_t *find_batch_map(batch_job_t *job, int glyph_size) {
+    pthread_mutex_lock(&job->maps_lock);
+    if (glyph_size >= job->num_maps) {
+        batch_map_t **maps =
+            realloc(job->maps, (glyph_size + 1) * sizeof(batch_map_t *));
+        if (!maps) {
+            perror("Error allocating memory");
+            pthread_mutex_unlock(&job->maps_lock);
+            return NULL;
+        }
+        memset(maps + job->num_maps, 0,
+               (glyph_size + 1 - job->num_maps) * sizeof(batch_map_t *));
+        job->maps = maps;
+        job->num_maps = glyph_size + 1;
     }
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
-        bmp_blob = realloc(bmp_blob, blob_size + bytes_read);
-        if (!bmp_blob) {
+    if (!job->maps[glyph_size]) {
+        batch_map_t *entry = calloc(1, sizeof(batch_map_t));
+        if (!entry) {
             perror("Error allocating memory");
-            pclose(pipe);
+            pthread_mutex_unlock(&job->maps_lock);
             return NULL;
         }
-        // Copy the buffer data into the allocated memory
-        memcpy(bmp_blob + blob_size, buffer, bytes_read);
-        blob_size += bytes_read;
+        pthread_mutex_init(&entry->lock, NULL);
+        job->maps[glyph_size] = entry;
     }
+    batch_map_t *entry = job->maps[glyph_size];
+    pthread_mutex_unlock(&job->maps_lock);
+    return entry;
+}
 
-    pclose(pipe);
-    return bmp_blob;
+// Output of an input image: its file name with ".txt" (or ".html") appended,
+// in the output directory or else next to the image. Fails if the path is
+// too long.
+int batch_output_path(config_t *config, char *input, char *output) {
+    char *extension = config->color == COLOR_HTML ? "html" : "txt";
+    int length;
+    if (strlen(config->output_dir) > 0) {
+        length = snprintf(output, MAX_PATH_LEN, "%s/%s.%s", config->output_dir,
+                          path_name(input), extension);
+    } else {
+        length = snprintf(output, MAX_PATH_LEN, "%s.%s", input, extension);
+    }
+    if (length < 0 || length >= MAX_PATH_LEN) {
+        fprintf(stderr, "Error: output path of %s is too long\n", input);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-giko_bitmap_t *get_bitmap(uint8_t *bmp_blob) {
-    int width;
-    int height;
-    memcpy(&width, bmp_blob + 18, sizeof(int));
-    memcpy(&height, bmp_blob + 22, sizeof(int));
+// Outputs in the output directory are named after the file name alone, so
+// inputs of different directories with the same name would overwrite each
+// other. Fail before tracing if any do.
+int check_output_names(path_list_t *inputs) {
+    char **paths = malloc(inputs->size * sizeof(char *));
+    if (!paths) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+    memcpy(paths, inputs->paths, inputs->size * sizeof(char *));
+    qsort(paths, inputs->size, sizeof(char *), compare_path_names);
+    int result = EXIT_SUCCESS;
+    for (int i = 1; i < inputs->size; i++) {
+        if (compare_path_names(&paths[i - 1], &paths[i]) == 0) {
+            fprintf(stderr,
+                    "Error: %s and %s would have the same output in "
+                    "--output-dir.\n",
+                    paths[i - 1], paths[i]);
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    free(paths);
+    return result;
+}
 
-    uint32_t pixel_data_offset;
-    memcpy(&pixel_data_offset, bmp_blob + 10, sizeof(uint32_t));
+// File name of a path, after its last '/'
+char *path_name(char *path) {
+    char *name = strrchr(path, '/');
+    return name ? name + 1 : path;
+}
 
-    int bitmap_size = pitch_32bit(width) * height;
-    uint8_t *pixel_data = malloc(bitmap_size * sizeof(uint8_t));
-    if (!pixel_data) {
-        perror("Error allocating memory");
+int compare_path_names(const void *a, const void *b) {
+    return strcmp(path_name(*(char *const *)a), path_name(*(char *const *)b));
+}
+
+// Trace a stream of concatenated images (e.g. PBM/PGM frames piped from a
+// video decoder) from the image file, or stdin if it is unset or "-". Each
+// frame's rows are written as they are traced, followed by a form feed.
+// Chunks whose pixels did not change since the previous frame are reused.
+int giko_trace_frames(config_t config) {
+    if (config.mode == GRAY) {
+        fprintf(stderr, "Error: --frames does not support --mode GRAY. Use "
+                        "BILEVEL or DITHER.\n");
+        return EXIT_FAILURE;
+    }
+    if (config.color != COLOR_NONE) {
+        fprintf(stderr, "Error: --frames does not support --color.\n");
+        return EXIT_FAILURE;
+    }
+    giko_codepoint_t *charset =
+        load_charset(&config);
+    if (!charset)
+        return EXIT_FAILURE;
+
+    FILE *in = stdin;
+    if (strlen(config.image_file) > 0 && strcmp(config.image_file, "-") != 0) {
+        in = fopen(config.image_file, "rb");
+        if (!in) {
+            perror(config.image_file);
+            return EXIT_FAILURE;
+        }
+    }
+    FILE *out = stdout;
+    if (strlen(config.output_file) > 0) {
+        out = fopen(config.output_file, "w");
+        if (!out) {
+            perror(config.output_file);
+            return EXIT_FAILURE;
+        }
+    }
+
+    giko_trace_options_t options = get_trace_options(config);
+    giko_glyph_map_t *map = NULL;
+    giko_frame_tracer_t *tracer = NULL;
+    int result = EXIT_SUCCESS;
+    int done = 0;
+    for (int index = 0; result == EXIT_SUCCESS; index++) {
+        uint64_t begin = giko_stats_clock();
+        giko_bitmap_t *frame = read_frame(in, &config, &done);
+        add_run_time(&run_stats.decode_ns, begin);
+        if (!frame) {
+            if (!done) {
+                fprintf(stderr, "Error: could not read frame %d\n", index);
+                result = EXIT_FAILURE;
+            }
+            break;
+        }
+
+        if (!map) {
+            // The first frame sets the glyph size of the whole stream
+            int glyph_size = frame->height / config.height;
+            if (glyph_size <= 0) {
+                fprintf(stderr, "Error: --height must be less than height of "
+                                "reference image.\n");
+                giko_free_bitmap(frame);
+                result = EXIT_FAILURE;
+                break;
+            }
+            map = get_glyph_map(config, charset, glyph_size);
+            tracer = map ? giko_new_frame_tracer(map, &options) : NULL;
+            if (!tracer) {
+                giko_free_bitmap(frame);
+                result = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        if (giko_trace_frame(tracer, frame, write_row, out) ||
+            fputc('\f', out) == EOF || fflush(out)) {
+            result = EXIT_FAILURE;
+        }
+        giko_free_bitmap(frame);
+    }
+
+    giko_free_frame_tracer(tracer);
+    if (map)
+        giko_free_glyph_map(map);
+    free(charset);
+    if (in != stdin)
+        fclose(in);
+    if (out != stdout)
+        fclose(out);
+    return result;
+}
+
+// Read the next frame of a stream, skipping whitespace between frames. Sets
+// done and returns NULL at the end of the stream. Frames are dithered in
+// DITHER mode.
+giko_bitmap_t *read_frame(FILE *in, config_t *config, int *done) {
+    int c = fgetc(in);
+    while (c != EOF && isspace(c)) {
+        c = fgetc(in);
+    }
+    if (c == EOF) {
+        *done = 1;
         return NULL;
     }
-    memcpy(pixel_data, bmp_blob + pixel_data_offset, bitmap_size);
+    ungetc(c, in);
+    if (config->mode != DITHER)
+        return giko_read_image(in, config->negate);
 
-    giko_bitmap_t *bitmap = giko_new_bitmap(width, height, pixel_data);
-    if (!bitmap)
+    giko_graymap_t *graymap = giko_read_graymap(in, config->negate);
+    if (!graymap)
         return NULL;
-    giko_flip_bitmap(bitmap);
+    giko_bitmap_t *frame = giko_dither_graymap(graymap);
+    giko_free_graymap(graymap);
+    return frame;
+}
+
+giko_glyph_map_t *get_glyph_map(config_t config, giko_codepoint_t *charset,
+                                int glyph_size) {
+    if (!config.cache)
+        return build_glyph_map(config, charset, glyph_size);
+
+    char filepath[MAX_PATH_LEN];
+    uint64_t key = giko_glyph_map_key(config.font_file, charset, glyph_size,
+                                      config.glyph_map_order);
+    int cached = key && cache_filepath(config, key, filepath) == EXIT_SUCCESS;
+
+    if (cached) {
+        giko_glyph_map_t *map = giko_load_glyph_map(filepath, key);
+        if (map)
+            return map;
+    }
+
+    giko_glyph_map_t *map = build_glyph_map(config, charset, glyph_size);
+    if (map && cached && !config.lazy) {
+        // A failed save only costs the next run a rebuild. Lazy maps are not
+        // saved, as saving rasterizes every glyph.
+        giko_save_glyph_map(map, key, filepath);
+    }
+    return map;
+}
+
+giko_glyph_map_t *build_glyph_map(config_t config, giko_codepoint_t *charset,
+                                  int glyph_size) {
+    if (config.lazy)
+        return giko_new_lazy_glyph_map(config.font_file, charset, glyph_size,
+                                       config.glyph_map_order,
+                                       config_stats(&config));
+    return giko_context_glyph_map(run_context, config.font_file, charset,
+                                  glyph_size, config.glyph_map_order,
+                                  config_stats(&config));
+}
+
+// Build the path of the cache file for a key, creating the cache directory
+// if needed. The directory defaults to $XDG_CACHE_HOME/giko or
+// $HOME/.cache/giko.
+int cache_filepath(config_t config, uint64_t key, char *filepath) {
+    char directory[MAX_PATH_LEN];
+    char *xdg_cache = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+
+    if (strlen(config.cache_dir) > 0) {
+        snprintf(directory, sizeof(directory), "%s", config.cache_dir);
+    } else if (xdg_cache && strlen(xdg_cache) > 0) {
+        mkdir(xdg_cache, 0755);
+        snprintf(directory, sizeof(directory), "%s/giko", xdg_cache);
+    } else if (home && strlen(home) > 0) {
+        snprintf(directory, sizeof(directory), "%s/.cache", home);
+        mkdir(directory, 0755);
+        snprintf(directory, sizeof(directory), "%s/.cache/giko", home);
+    } else {
+        return EXIT_FAILURE;
+    }
+
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        perror(directory);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(filepath, MAX_PATH_LEN, "%s/%016llx.gmap", directory,
+             (unsigned long long)key);
+    return EXIT_SUCCESS;
+}
+
+// Find the map for a reference of a height, if it is not found yet. Returns
+// EXIT_FAILURE if the reference is too short or the map cannot be built.
+int find_map(map_finder_t *finder, int height) {
+    if (finder->map)
+        return EXIT_SUCCESS;
+    if (finder->failed)
+        return EXIT_FAILURE;
+    int glyph_size = height / finder->config->height;
+    if (glyph_size <= 0) {
+        finder->too_short = 1;
+        finder->failed = 1;
+        return EXIT_FAILURE;
+    }
+    if (finder->max_glyph_size && glyph_size > finder->max_glyph_size) {
+        finder->too_large = 1;
+        finder->failed = 1;
+        return EXIT_FAILURE;
+    }
+
+    uint64_t begin = giko_stats_clock();
+    if (finder->server) {
+        finder->served =
+            acquire_served_map(finder->server, finder->config, glyph_size);
+        finder->map = finder->served ? finder->served->map : NULL;
+    } else if (finder->batch) {
+        finder->map = batch_glyph_map(finder->batch, glyph_size);
+    } else {
+        finder->map =
+            get_glyph_map(*finder->config, finder->charset, glyph_size);
+    }
+    finder->find_ns += giko_stats_clock() - begin;
+    finder->failed = !finder->map;
+    return finder->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// giko_band_height_callback_t finding the map of the reference being decoded,
+// before it is allocated. Stops the read if the image is too large.
+int find_band_height(int width, int height, void *user_data) {
+    map_finder_t *finder = user_data;
+    if (finder->max_pixels && (int64_t)width * height > finder->max_pixels) {
+        finder->too_large = 1;
+        finder->failed = 1;
+        return 0;
+    }
+    if (find_map(finder, height))
+        return 0;
+    return giko_glyph_map_em_height(finder->map);
+}
+
+// Load the image with the built in decoders, falling back to image magick
+// for other formats. Dark pixels are set unless negated. Images are
+// thresholded in BILEVEL mode, dithered in DITHER mode and kept grey in GRAY
+// mode. If colours are written, they are summed in the same pass, and the
+// finder finds the map as soon as the image's height is known.
+int load_reference(char *filepath, config_t *config, map_finder_t *finder,
+                   reference_t *reference) {
+    memset(reference, 0, sizeof(reference_t));
+    if (access(filepath, R_OK) != 0) {
+        perror(filepath);
+        return EXIT_FAILURE;
+    }
+
+    giko_color_bands_t **colors =
+        config->color != COLOR_NONE ? &reference->colors : NULL;
+    if (config->mode == BILEVEL) {
+        reference->bitmap = giko_load_color_image(
+            filepath, config->negate, find_band_height, finder, colors);
+        if (!reference->bitmap && !finder->failed) {
+            FILE *pipe = magick_pipe(filepath, BILEVEL, colors != NULL);
+            if (pipe) {
+                reference->bitmap = giko_read_color_image(
+                    pipe, config->negate, find_band_height, finder, colors);
+                pclose(pipe);
+            }
+        }
+    } else {
+        giko_graymap_t *graymap =
+            load_graymap(filepath, config->negate, finder, colors);
+        if (graymap && config->mode == DITHER) {
+            reference->bitmap = giko_dither_graymap(graymap);
+            giko_free_graymap(graymap);
+        } else {
+            reference->graymap = graymap;
+        }
+    }
+
+    if (reference->bitmap) {
+        reference->height = reference->bitmap->height;
+    } else if (reference->graymap) {
+        reference->height = reference->graymap->height;
+    } else {
+        if (!finder->failed)
+            fprintf(stderr, "Error using image magick. Please make sure image "
+                            "magick is installed on your system\n");
+        free_reference(reference);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+giko_graymap_t *load_graymap(char *filepath, int negate, map_finder_t *finder,
+                             giko_color_bands_t **colors) {
+    giko_graymap_t *graymap = giko_load_color_graymap(
+        filepath, negate, find_band_height, finder, colors);
+    if (graymap || finder->failed)
+        return graymap;
+
+    FILE *pipe = magick_pipe(filepath, GRAY, colors != NULL);
+    if (!pipe)
+        return NULL;
+    graymap = giko_read_color_graymap(pipe, negate, find_band_height, finder,
+                                      colors);
+    pclose(pipe);
+    return graymap;
+}
+
+// Convert an image with image magick, to be decoded straight from the pipe.
+// Images whose colours are summed are converted to an 8 bit PPM. Otherwise
+// BILEVEL images are thresholded into a BMP, the others converted to an 8
+// bit PGM.
+FILE *magick_pipe(char *img_filepath, image_mode_t mode, int colors) {
+    char command[MAX_CMD_LEN];
+    if (colors) {
+        snprintf(command, sizeof(command), "magick %s -depth 8 PPM:-",
+                 img_filepath);
+    } else if (mode == BILEVEL) {
+        snprintf(command, sizeof(command),
+                 "magick %s -threshold 50%% -type bilevel BMP:-",
+                 img_filepath);
+    } else {
+        snprintf(command, sizeof(command),
+                 "magick %s -colorspace Gray -depth 8 PGM:-", img_filepath);
+    }
+    FILE *pipe = popen(command, "r");
+    if (!pipe)
+        perror("popen");
+    return pipe;
+}
+
+giko_codepoint_t *trace_reference(reference_t *reference,
+                                  giko_glyph_map_t *map,
+                                  giko_trace_options_t *options) {
+    if (reference->graymap)
+        return giko_trace_graymap_str(reference->graymap, map, options);
+    return giko_trace_art_str(reference->bitmap, map, options);
+}
 
-    return bitmap;
+void free_reference(reference_t *reference) {
+    if (reference->bitmap)
+        giko_free_bitmap(reference->bitmap);
+    if (reference->graymap)
+        giko_free_graymap(reference->graymap);
+    if (reference->colors)
+        giko_free_color_bands(reference->colors);
 }
 
 void print_codepoint_str(giko_codepoint_t *string) {
@@ -158,3 +1216,1143 @@ void print_codepoint_str(giko_codepoint_t *string) {
         codepoint = string[index];
     }
 }
+
+// Trace the reference with every combination of a grid of chunkiness,
+// accuracy, denoise and fidelity settings, reusing one glyph map. Points are
+// traced in parallel, each by a single thread, and timed by CPU time. The
+// Pareto-optimal points, trading time for IoU, are written to the sweep
+// directory as config files, fastest first.
+int giko_trace_sweep(config_t config) {
+    if (config.mode == GRAY) {
+        fprintf(stderr, "Error: --sweep scores bitmaps, not --mode GRAY. Use "
+                        "BILEVEL or DITHER.\n");
+        return EXIT_FAILURE;
+    }
+    if (mkdir(config.sweep_dir, 0755) && errno != EEXIST) {
+        perror(config.sweep_dir);
+        return EXIT_FAILURE;
+    }
+
+    giko_codepoint_t *charset =
+        load_charset(&config);
+    if (!charset)
+        return EXIT_FAILURE;
+    reference_t reference;
+    map_finder_t finder = {0};
+    finder.config = &config;
+    finder.charset = charset;
+    int result =
+        load_reference(config.image_file, &config, &finder, &reference);
+    if (!result) {
+        result = find_map(&finder, reference.height);
+        if (!result)
+            result = run_sweep(&config, &reference, finder.map);
+        free_reference(&reference);
+    }
+    if (finder.too_short) {
+        fprintf(
+            stderr,
+            "Error: --height must be less than height of reference image.\n");
+    }
+    if (finder.map)
+        giko_free_glyph_map(finder.map);
+    free(charset);
+    return result;
+}
+
+// Trace and score every point of the grid, then print them all and write the
+// Pareto-optimal ones to the sweep directory.
+int run_sweep(config_t *config, reference_t *reference,
+              giko_glyph_map_t *map) {
+    sweep_job_t job = {config, reference, map, NULL, 0, 0, 0};
+    job.num_points = sweep_grid(&job.points, config->sweep_limit);
+    if (job.num_points < 0)
+        return EXIT_FAILURE;
+
+    int num_workers = config->threads;
+    if (num_workers == 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > job.num_points)
+        num_workers = job.num_points;
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    int started = 0;
+    if (workers) {
+        for (; started < num_workers; started++) {
+            if (pthread_create(&workers[started], NULL, sweep_worker, &job))
+                break;
+        }
+    }
+    if (started == 0) {
+        // Trace on the calling thread instead
+        sweep_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (job.failed) {
+        free(job.points);
+        return EXIT_FAILURE;
+    }
+
+    mark_pareto(job.points, job.num_points);
+    qsort(job.points, job.num_points, sizeof(sweep_point_t),
+          compare_sweep_seconds);
+    printf("chunkiness accuracy denoise fidelity time_ms   iou      pareto\n");
+    int result = clear_pareto_files(config->sweep_dir);
+    int written = 0;
+    for (int i = 0; i < job.num_points; i++) {
+        sweep_point_t *point = &job.points[i];
+        printf("%-10.2f %-8.2f %-7.2f %-8s %-9.3f %-8.6f %s\n",
+               point->chunkiness, point->accuracy, point->denoise,
+               fidelity_name(point->fidelity), point->seconds * 1e3,
+               point->iou, point->pareto ? "yes" : "no");
+        if (!point->pareto || result)
+            continue;
+        char filepath[MAX_PATH_LEN];
+        snprintf(filepath, sizeof(filepath), "%s/pareto-%02d.txt",
+                 config->sweep_dir, ++written);
+        result = write_config_file(config, point, filepath);
+    }
+    free(job.points);
+    return result;
+}
+
+// Remove the pareto-NN.txt files of an earlier sweep, so a smaller front does
+// not leave stale points behind.
+int clear_pareto_files(char *sweep_dir) {
+    DIR *directory = opendir(sweep_dir);
+    if (!directory) {
+        perror(sweep_dir);
+        return EXIT_FAILURE;
+    }
+    struct dirent *entry;
+    char filepath[MAX_PATH_LEN];
+    int result = EXIT_SUCCESS;
+    while (!result && (entry = readdir(directory))) {
+        // Only names written by a sweep: "pareto-", digits, then ".txt"
+        size_t length = strlen(entry->d_name);
+        if (length < 13 || strncmp(entry->d_name, "pareto-", 7) != 0 ||
+            strcmp(entry->d_name + length - 4, ".txt") != 0 ||
+            strspn(entry->d_name + 7, "0123456789") != length - 11)
+            continue;
+        snprintf(filepath, sizeof(filepath), "%s/%s", sweep_dir,
+                 entry->d_name);
+        if (unlink(filepath) && errno != ENOENT) {
+            perror(filepath);
+            result = EXIT_FAILURE;
+        }
+    }
+    closedir(directory);
+    return result;
+}
+
+// Fill the grid of sweep settings. With a limit, a spread of that many
+// points is taken from a fixed shuffle of the grid. Returns the number of
+// points, or -1 on error.
+int sweep_grid(sweep_point_t **points, int limit) {
+    static const float chunkiness[] = {0.25, 0.5, 0.75, 1};
+    static const float accuracy[] = {0.3, 0.5, 0.7, 0.9, 1};
+    static const float denoise[] = {0, 0.05, 0.1};
+    static const fidelity_t fidelity[] = {LOW, MEDIUM, HIGH};
+    int count = 4 * 5 * 3 * 3;
+
+    *points = malloc(count * sizeof(sweep_point_t));
+    if (!*points) {
+        perror("Error allocating memory");
+        return -1;
+    }
+    int i = 0;
+    for (int c = 0; c < 4; c++) {
+        for (int a = 0; a < 5; a++) {
+            for (int d = 0; d < 3; d++) {
+                for (int f = 0; f < 3; f++) {
+                    sweep_point_t point = {chunkiness[c], accuracy[a],
+                                           denoise[d], fidelity[f], 0, 0, 0};
+                    (*points)[i++] = point;
+                }
+            }
+        }
+    }
+    if (limit <= 0 || limit >= count)
+        return count;
+
+    // Fisher-Yates with a fixed xorshift seed, so runs are repeatable
+    uint32_t state = 0x9e3779b9;
+    for (i = count - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int j = state % (i + 1);
+        sweep_point_t swap = (*points)[i];
+        (*points)[i] = (*points)[j];
+        (*points)[j] = swap;
+    }
+    return limit;
+}
+
+void *sweep_worker(void *arg) {
+    sweep_job_t *job = arg;
+    while (1) {
+        int point = __atomic_fetch_add(&job->next_point, 1, __ATOMIC_RELAXED);
+        if (point >= job->num_points)
+            break;
+        if (evaluate_sweep_point(job, &job->points[point]))
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Time the trace of one point, repeating short traces for a steadier
+// measure, and score the trace against the reference
+int evaluate_sweep_point(sweep_job_t *job, sweep_point_t *point) {
+    config_t config = *job->config;
+    config.chunkiness = point->chunkiness;
+    config.accuracy = point->accuracy;
+    config.denoise = point->denoise;
+    config.fidelity = point->fidelity;
+    giko_trace_options_t options = get_trace_options(config);
+    options.num_threads = 1;
+
+    giko_codepoint_t *aa = NULL;
+    int repeats = 0;
+    double start = thread_seconds();
+    double elapsed = 0;
+    do {
+        free(aa);
+        aa = trace_reference(job->reference, job->map, &options);
+        if (!aa)
+            return EXIT_FAILURE;
+        repeats++;
+        elapsed = thread_seconds() - start;
+    } while (elapsed < SWEEP_MIN_SECONDS && repeats < SWEEP_MAX_REPEATS);
+    point->seconds = elapsed / repeats;
+
+    giko_bitmap_t *rendered =
+        giko_render_art_str(aa, job->map, job->reference->bitmap->width,
+                            job->reference->height);
+    free(aa);
+    if (!rendered)
+        return EXIT_FAILURE;
+    point->iou = giko_bitmap_iou(job->reference->bitmap, rendered);
+    giko_free_bitmap(rendered);
+    return point->iou < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// CPU time of the calling thread, so parallel traces do not slow each
+// other's measures
+double thread_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Mark the points that no other point beats on both time and IoU
+void mark_pareto(sweep_point_t *points, int count) {
+    for (int i = 0; i < count; i++) {
+        points[i].pareto = 1;
+        for (int j = 0; j < count && points[i].pareto; j++) {
+            int as_good = points[j].seconds <= points[i].seconds &&
+                          points[j].iou >= points[i].iou;
+            int better = points[j].seconds < points[i].seconds ||
+                         points[j].iou > points[i].iou;
+            if (j != i && as_good && better)
+                points[i].pareto = 0;
+        }
+    }
+}
+
+int compare_sweep_seconds(const void *a, const void *b) {
+    double x = ((const sweep_point_t *)a)->seconds;
+    double y = ((const sweep_point_t *)b)->seconds;
+    return (x > y) - (x < y);
+}
+
+// Write the config with the settings of a point, in the format read by
+// parse_config_file
+int write_config_file(config_t *config, sweep_point_t *point, char *filepath) {
+    FILE *file = fopen(filepath, "w");
+    if (!file) {
+        perror(filepath);
+        return EXIT_FAILURE;
+    }
+    config_t settings = *config;
+    settings.chunkiness = point->chunkiness;
+    settings.accuracy = point->accuracy;
+    settings.denoise = point->denoise;
+    settings.fidelity = point->fidelity;
+    fprintf(file, "# %.3f ms per trace, IoU %.6f\n", point->seconds * 1e3,
+            point->iou);
+    write_config(file, &settings);
+    if (fclose(file)) {
+        perror(filepath);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+const char *fidelity_name(fidelity_t fidelity) {
+    return fidelity == LOW ? "LOW" : fidelity == MEDIUM ? "MEDIUM" : "HIGH";
+}
+
+// Stats of the run if --stats is given, otherwise NULL
+giko_stats_t *config_stats(config_t *config) {
+    return config->stats ? &run_stats : NULL;
+}
+
+giko_codepoint_t *load_charset(config_t *config) {
+    uint64_t begin = giko_stats_clock();
+    giko_codepoint_t *charset =
+        giko_load_charset(config->charset_file, config->base_encoding);
+    add_run_time(&run_stats.charset_ns, begin);
+    return charset;
+}
+
+// Add the time since begin to a stage of the run. Batch images are decoded
+// by several threads at once.
+void add_run_time(uint64_t *total, uint64_t begin) {
+    __atomic_fetch_add(total, giko_stats_clock() - begin, __ATOMIC_RELAXED);
+}
+
+// Print stats as one line of JSON, times in nanoseconds
+void print_stats(FILE *out, giko_stats_t *stats) {
+    fprintf(out,
+            "{\"engine\":\"%s\",\"charset_ns\":%llu,\"decode_ns\":%llu,"
+            "\"rasterize_ns\":%llu,\"pack_ns\":%llu,\"crop_ns\":%llu,"
+            "\"similarity_ns\":%llu,\"output_ns\":%llu,\"trace_ns\":%llu,"
+            "\"glyphs_rasterized\":%llu,\"rows_traced\":%llu,"
+            "\"similarity_calls\":%llu,\"glyph_greed_exits\":%llu,"
+            "\"chunk_greed_exits\":%llu,\"bytes_allocated\":%llu}\n",
+            giko_engine_name(giko_get_engine()),
+            (unsigned long long)stats->charset_ns,
+            (unsigned long long)stats->decode_ns,
+            (unsigned long long)stats->rasterize_ns,
+            (unsigned long long)stats->pack_ns,
+            (unsigned long long)stats->crop_ns,
+            (unsigned long long)stats->similarity_ns,
+            (unsigned long long)stats->output_ns,
+            (unsigned long long)stats->trace_ns,
+            (unsigned long long)stats->glyphs_rasterized,
+            (unsigned long long)stats->rows_traced,
+            (unsigned long long)stats->similarity_calls,
+            (unsigned long long)stats->glyph_greed_exits,
+            (unsigned long long)stats->chunk_greed_exits,
+            (unsigned long long)stats->bytes_allocated);
+}
+
+// Set the fields of a config from the key=value lines of a config file.
+// Unknown keys and lines are ignored.
+void read_config(FILE *file, config_t *config) {
+    char line[MAX_PATH_LEN + 128];
+    while (fgets(line, sizeof(line), file)) {
+        char key[128], value[MAX_PATH_LEN];
+        if (sscanf(line, "%127[^=]=%4095s", key, value) == 2) {
+            if (strcmp(key, "charset_file") == 0) {
+                strncpy(config->charset_file, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "image_file") == 0) {
+                strncpy(config->image_file, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "font_file") == 0) {
+                strncpy(config->font_file, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "output_file") == 0) {
+                strncpy(config->output_file, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "height") == 0) {
+                config->height = atoi(value);
+            } else if (strcmp(key, "base_encoding") == 0) {
+                config->base_encoding = atoi(value);
+            } else if (strcmp(key, "glyph_map_order") == 0) {
+                if (strcmp(value, "NONE") == 0) {
+                    config->glyph_map_order = NONE;
+                } else if (strcmp(value, "ASCENDING") == 0) {
+                    config->glyph_map_order = ASCENDING;
+                } else if (strcmp(value, "DESCENDING") == 0) {
+                    config->glyph_map_order = DESCENDING;
+                }
+            } else if (strcmp(key, "chunkiness") == 0) {
+                config->chunkiness = atof(value);
+            } else if (strcmp(key, "accuracy") == 0) {
+                config->accuracy = atof(value);
+            } else if (strcmp(key, "denoise") == 0) {
+                config->denoise = atof(value);
+            } else if (strcmp(key, "fidelity") == 0) {
+                if (strcmp(value, "LOW") == 0) {
+                    config->fidelity = LOW;
+                } else if (strcmp(value, "MEDIUM") == 0) {
+                    config->fidelity = MEDIUM;
+                } else if (strcmp(value, "HIGH") == 0) {
+                    config->fidelity = HIGH;
+                }
+            } else if (strcmp(key, "negate") == 0) {
+                config->negate = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "threads") == 0) {
+                config->threads = atoi(value);
+            } else if (strcmp(key, "cache") == 0) {
+                config->cache = strcmp(value, "false") != 0;
+            } else if (strcmp(key, "cache_dir") == 0) {
+                strncpy(config->cache_dir, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "lazy") == 0) {
+                config->lazy = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "stream") == 0) {
+                config->stream = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "frames") == 0) {
+                config->frames = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "batch") == 0) {
+                strncpy(config->batch, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "output_dir") == 0) {
+                strncpy(config->output_dir, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "search") == 0) {
+                if (strcmp(value, "LINEAR") == 0) {
+                    config->search = SEARCH_LINEAR;
+                } else if (strcmp(value, "BOUNDED") == 0) {
+                    config->search = SEARCH_BOUNDED;
+                }
+            } else if (strcmp(key, "shortlist") == 0) {
+                config->shortlist = atoi(value);
+            } else if (strcmp(key, "segmentation") == 0) {
+                if (strcmp(value, "GREEDY") == 0) {
+                    config->segmentation = SEGMENT_GREEDY;
+                } else if (strcmp(value, "OPTIMAL") == 0) {
+                    config->segmentation = SEGMENT_OPTIMAL;
+                }
+            } else if (strcmp(key, "mode") == 0) {
+                if (strcmp(value, "BILEVEL") == 0) {
+                    config->mode = BILEVEL;
+                } else if (strcmp(value, "DITHER") == 0) {
+                    config->mode = DITHER;
+                } else if (strcmp(value, "GRAY") == 0) {
+                    config->mode = GRAY;
+                }
+            } else if (strcmp(key, "render_file") == 0) {
+                strncpy(config->render_file, value, MAX_PATH_LEN - 1);
+            } else if (strcmp(key, "score") == 0) {
+                config->score = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "stats") == 0) {
+                config->stats = strcmp(value, "true") == 0;
+            } else if (strcmp(key, "color") == 0) {
+                if (strcmp(value, "NONE") == 0) {
+                    config->color = COLOR_NONE;
+                } else if (strcmp(value, "ANSI") == 0) {
+                    config->color = COLOR_ANSI;
+                } else if (strcmp(value, "HTML") == 0) {
+                    config->color = COLOR_HTML;
+                }
+            }
+        }
+    }
+}
+
+// Check the numeric settings against the ranges giko-trace's options allow,
+// as read_config and daemon requests take them as they are. Returns NULL if
+// they are valid, otherwise why not. NaN is out of every range.
+const char *config_error(config_t *config) {
+    if (config->height <= 0)
+        return "height must be positive";
+    if (config->base_encoding <= 0)
+        return "base_encoding must be positive";
+    if (!(config->chunkiness >= 0 && config->chunkiness <= 1))
+        return "chunkiness must be between 0 and 1";
+    if (!(config->accuracy > 0 && config->accuracy <= 1))
+        return "accuracy must be above 0 and at most 1";
+    if (!(config->denoise >= 0 && config->denoise <= 1))
+        return "denoise must be between 0 and 1";
+    if (config->threads < 0)
+        return "threads must be positive, or 0 to use every CPU";
+    if (config->shortlist < 0)
+        return "shortlist must be positive, or 0 to compare every glyph";
+    return NULL;
+}
+
+// Write the tracing settings of a config as key=value lines, which
+// read_config reads back
+void write_config(FILE *file, config_t *config) {
+    fprintf(file, "charset_file=%s\n", config->charset_file);
+    fprintf(file, "image_file=%s\n", config->image_file);
+    fprintf(file, "font_file=%s\n", config->font_file);
+    fprintf(file, "height=%d\n", config->height);
+    fprintf(file, "base_encoding=%d\n", config->base_encoding);
+    fprintf(file, "glyph_map_order=%s\n",
+            config->glyph_map_order == NONE        ? "NONE"
+            : config->glyph_map_order == ASCENDING ? "ASCENDING"
+                                                   : "DESCENDING");
+    fprintf(file, "chunkiness=%g\n", config->chunkiness);
+    fprintf(file, "accuracy=%g\n", config->accuracy);
+    fprintf(file, "denoise=%g\n", config->denoise);
+    fprintf(file, "fidelity=%s\n", fidelity_name(config->fidelity));
+    fprintf(file, "negate=%s\n", config->negate ? "true" : "false");
+    fprintf(file, "threads=%d\n", config->threads);
+    fprintf(file, "search=%s\n",
+            config->search == SEARCH_BOUNDED ? "BOUNDED" : "LINEAR");
+    fprintf(file, "segmentation=%s\n",
+            config->segmentation == SEGMENT_OPTIMAL ? "OPTIMAL" : "GREEDY");
+    fprintf(file, "shortlist=%d\n", config->shortlist);
+    fprintf(file, "mode=%s\n", config->mode == GRAY     ? "GRAY"
+                               : config->mode == DITHER ? "DITHER"
+                                                        : "BILEVEL");
+    fprintf(file, "color=%s\n", config->color == COLOR_ANSI   ? "ANSI"
+                                : config->color == COLOR_HTML ? "HTML"
+                                                              : "NONE");
+}
+
+// Daemon. Requests and responses are framed by big-endian 32 bit sizes.
+// A request is SERVE_MAGIC, the size of the params, the size of the image,
+// then the params as config file lines and the image file's bytes. A response
+// is a status (0 on success), the size of the body, then the body: the traced
+// art as giko-trace writes it, or an error message. A connection may send any
+// number of requests, one after another.
+int giko_serve(config_t config) {
+    if (strlen(config.socket_path) == 0)
+        default_socket_path(config.socket_path);
+    int num_workers = config.threads;
+    if (num_workers == 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1)
+        num_workers = 1;
+
+    server_t server = {0};
+    server.config = &config;
+    server.num_workers = num_workers;
+    // Each worker holds at most one map, so a slot is always free to build in
+    server.num_maps = config.max_maps > num_workers ? config.max_maps
+                                                    : num_workers;
+    server.maps = calloc(server.num_maps, sizeof(served_map_t));
+    server.active = malloc(num_workers * sizeof(int));
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    if (!server.maps || !server.active || !workers) {
+        perror("Error allocating memory");
+        free(server.maps);
+        free(server.active);
+        free(workers);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_workers; i++)
+        server.active[i] = -1;
+
+    int listener = listen_socket(config.socket_path);
+    if (listener < 0) {
+        free(server.maps);
+        free(server.active);
+        free(workers);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued, NULL);
+    pthread_cond_init(&server.map_changed, NULL);
+
+    // Workers block the stop signals so that they interrupt accept
+    sigset_t stop_signals, previous;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+    int started = 0;
+    while (started < num_workers &&
+           pthread_create(&workers[started], NULL, serve_worker, &server) == 0)
+        started++;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    int result = EXIT_SUCCESS;
+    if (started < num_workers) {
+        fprintf(stderr, "Error creating worker threads\n");
+        result = EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "giko-traced: listening on %s with %d workers\n",
+                config.socket_path, num_workers);
+    }
+
+    while (result == EXIT_SUCCESS && !serve_stopping) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("Error accepting connection");
+            continue;
+        }
+        // Idle or stalled clients are dropped, rather than holding a worker
+        // until they close the connection
+        struct timeval timeout = {SERVE_TIMEOUT_SECONDS, 0};
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof(timeout)) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                       sizeof(timeout))) {
+            perror("Error setting socket timeout");
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&server.lock);
+        if (server.queue_count == SERVE_QUEUE_SIZE) {
+            // Every worker is busy and the queue is full. The client sees
+            // the connection close.
+            close(fd);
+        } else {
+            int tail = (server.queue_head + server.queue_count) %
+                       SERVE_QUEUE_SIZE;
+            server.queue[tail] = fd;
+            server.queue_count++;
+            pthread_cond_signal(&server.queued);
+        }
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    close(listener);
+    unlink(config.socket_path);
+
+    // Wake every worker, including those waiting for the next request of a
+    // connection
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    for (int i = 0; i < num_workers; i++) {
+        if (server.active[i] >= 0)
+            shutdown(server.active[i], SHUT_RDWR);
+    }
+    while (server.queue_count > 0) {
+        close(server.queue[server.queue_head]);
+        server.queue_head = (server.queue_head + 1) % SERVE_QUEUE_SIZE;
+        server.queue_count--;
+    }
+    pthread_cond_broadcast(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    for (int i = 0; i < server.num_maps; i++) {
+        if (server.maps[i].map)
+            giko_free_glyph_map(server.maps[i].map);
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.queued);
+    pthread_cond_destroy(&server.map_changed);
+    free(server.maps);
+    free(server.active);
+    free(workers);
+    return result;
+}
+
+void stop_serving(int signal_number) {
+    (void)signal_number;
+    serve_stopping = 1;
+}
+
+// Bind a listening socket at a path, replacing a socket left behind by a
+// daemon that is no longer running. Only the user may connect.
+int listen_socket(char *socket_path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct stat status;
+    if (stat(socket_path, &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n",
+                    socket_path);
+            return -1;
+        }
+        int probe = connect_socket(socket_path);
+        if (probe >= 0) {
+            close(probe);
+            fprintf(stderr, "Error: a daemon is already listening on %s\n",
+                    socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    mode_t mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (bound || listen(fd, SOMAXCONN)) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// $XDG_RUNTIME_DIR/giko-traced.sock, or /tmp/giko-traced-UID.sock
+void default_socket_path(char *socket_path) {
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && strlen(runtime_dir) > 0) {
+        snprintf(socket_path, MAX_PATH_LEN, "%s/giko-traced.sock",
+                 runtime_dir);
+    } else {
+        snprintf(socket_path, MAX_PATH_LEN, "/tmp/giko-traced-%d.sock",
+                 (int)getuid());
+    }
+}
+
+void *serve_worker(void *arg) {
+    server_t *server = arg;
+    pthread_mutex_lock(&server->lock);
+    int index = server->started++;
+    while (!server->stopping) {
+        if (server->queue_count == 0) {
+            pthread_cond_wait(&server->queued, &server->lock);
+            continue;
+        }
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVE_QUEUE_SIZE;
+        server->queue_count--;
+        server->active[index] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        while (serve_request(server, fd) == EXIT_SUCCESS) {
+        }
+
+        // Closed under the lock, so the main thread never shuts down a
+        // descriptor that has been reused
+        pthread_mutex_lock(&server->lock);
+        server->active[index] = -1;
+        close(fd);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+// Read one request from a connection and send its response. Returns
+// EXIT_FAILURE once the connection should be closed.
+int serve_request(server_t *server, int fd) {
+    uint8_t header[SERVE_REQUEST_HEADER];
+    if (read_full(fd, header, sizeof(header)))
+        return EXIT_FAILURE;
+    if (memcmp(header, SERVE_MAGIC, 4) != 0) {
+        const char *error = "Not a giko-traced request";
+        send_response(fd, 1, error, strlen(error));
+        return EXIT_FAILURE;
+    }
+    uint32_t params_size = load_be32(header + 4);
+    uint32_t image_size = load_be32(header + 8);
+    if (params_size == 0 || params_size > SERVE_MAX_PARAMS ||
+        image_size == 0 || image_size > SERVE_MAX_IMAGE) {
+        const char *error = "Params or image missing or too large";
+        send_response(fd, 1, error, strlen(error));
+        return EXIT_FAILURE;
+    }
+
+    char *params = malloc(params_size);
+    uint8_t *image = malloc(image_size);
+    if (!params || !image) {
+        perror("Error allocating memory");
+        free(params);
+        free(image);
+        return EXIT_FAILURE;
+    }
+    if (read_full(fd, params, params_size) ||
+        read_full(fd, image, image_size)) {
+        free(params);
+        free(image);
+        return EXIT_FAILURE;
+    }
+
+    char *body = NULL;
+    size_t body_size = 0;
+    const char *error = trace_request(server, params, params_size, image,
+                                      image_size, &body, &body_size);
+    int result = error ? send_response(fd, 1, error, strlen(error))
+                       : send_response(fd, 0, body, body_size);
+    free(body);
+    free(params);
+    free(image);
+    return result;
+}
+
+// Trace the image of a request into a body. Returns NULL on success,
+// otherwise the error message to send back.
+const char *trace_request(server_t *server, char *params, size_t params_size,
+                          uint8_t *image, size_t image_size, char **body,
+                          size_t *body_size) {
+    // Requests choose how to trace, but not how the daemon builds and caches
+    // glyph maps or how many threads trace one image
+    config_t config = *server->config;
+    FILE *file = fmemopen(params, params_size, "r");
+    if (!file)
+        return "Could not read the params";
+    read_config(file, &config);
+    fclose(file);
+    config.cache = server->config->cache;
+    strcpy(config.cache_dir, server->config->cache_dir);
+    config.lazy = server->config->lazy;
+    config.threads = 1;
+    config.stats = 0;
+    if (strlen(config.font_file) == 0 || strlen(config.charset_file) == 0)
+        return "font_file and charset_file must be set";
+    const char *error = config_error(&config);
+    if (error)
+        return error;
+
+    file = fmemopen(image, image_size, "rb");
+    if (!file)
+        return "Could not read the image";
+    reference_t reference;
+    map_finder_t finder = {0};
+    finder.config = &config;
+    finder.server = server;
+    finder.max_pixels = server->config->max_pixels;
+    finder.max_glyph_size = SERVE_MAX_GLYPH_SIZE;
+    int failed = read_reference(file, &config, &finder, &reference);
+    fclose(file);
+    if (!failed && find_map(&finder, reference.height)) {
+        free_reference(&reference);
+        failed = 1;
+    }
+    if (failed) {
+        if (finder.served)
+            release_served_map(server, finder.served);
+        if (finder.too_short)
+            return "height must be less than the height of the image";
+        if (finder.too_large)
+            return "The image or its glyphs are too large. Send a smaller "
+                   "image or raise height";
+        if (finder.failed)
+            return "Could not build the glyph map. Check the font and charset";
+        return "Could not decode the image. Send a BMP, PBM, PGM, PPM or PNG";
+    }
+    served_map_t *entry = finder.served;
+
+    giko_trace_options_t options = get_trace_options(config);
+    options.colors = reference.colors;
+    FILE *out = open_memstream(body, body_size);
+    int result = EXIT_FAILURE;
+    if (out) {
+        result = write_art_rows(&reference, entry->map, &options, out,
+                                &config);
+        if (fclose(out))
+            result = EXIT_FAILURE;
+    } else {
+        perror("Error allocating memory");
+    }
+    release_served_map(server, entry);
+    free_reference(&reference);
+    if (result) {
+        free(*body);
+        *body = NULL;
+        return "Tracing failed";
+    }
+    return NULL;
+}
+
+// Decode a reference from a file like load_reference, without falling back
+// to ImageMagick
+int read_reference(FILE *file, config_t *config, map_finder_t *finder,
+                   reference_t *reference) {
+    memset(reference, 0, sizeof(reference_t));
+    giko_color_bands_t **colors =
+        config->color != COLOR_NONE ? &reference->colors : NULL;
+    if (config->mode == BILEVEL) {
+        reference->bitmap = giko_read_color_image(
+            file, config->negate, find_band_height, finder, colors);
+    } else {
+        giko_graymap_t *graymap = giko_read_color_graymap(
+            file, config->negate, find_band_height, finder, colors);
+        if (graymap && config->mode == DITHER) {
+            reference->bitmap = giko_dither_graymap(graymap);
+            giko_free_graymap(graymap);
+        } else {
+            reference->graymap = graymap;
+        }
+    }
+
+    if (reference->bitmap) {
+        reference->height = reference->bitmap->height;
+    } else if (reference->graymap) {
+        reference->height = reference->graymap->height;
+    } else {
+        free_reference(reference);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Take the daemon's map for a config and glyph size, building it if it is
+// not kept yet. Requests for a map that is being built wait for it. Release
+// the map with release_served_map.
+served_map_t *acquire_served_map(server_t *server, config_t *config,
+                                 int glyph_size) {
+    pthread_mutex_lock(&server->lock);
+    served_map_t *entry = NULL;
+    while (!entry) {
+        served_map_t *kept = find_served_map(server, config, glyph_size);
+        if (kept && !kept->building) {
+            kept->users++;
+            kept->last_used = ++server->clock;
+            pthread_mutex_unlock(&server->lock);
+            return kept;
+        }
+        if (!kept)
+            entry = idle_served_map(server);
+        if (!entry)
+            pthread_cond_wait(&server->map_changed, &server->lock);
+    }
+
+    // Claim the slot, then build without the lock so that requests for
+    // other maps are not held up
+    giko_glyph_map_t *evicted = entry->map;
+    strcpy(entry->font_file, config->font_file);
+    strcpy(entry->charset_file, config->charset_file);
+    entry->base_encoding = config->base_encoding;
+    entry->glyph_size = glyph_size;
+    entry->order = config->glyph_map_order;
+    entry->map = NULL;
+    entry->building = 1;
+    entry->users = 1;
+    entry->last_used = ++server->clock;
+    pthread_mutex_unlock(&server->lock);
+
+    if (evicted)
+        giko_free_glyph_map(evicted);
+    giko_glyph_map_t *map = NULL;
+    giko_codepoint_t *charset = load_charset(config);
+    if (charset) {
+        map = get_glyph_map(*config, charset, glyph_size);
+        free(charset);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    entry->building = 0;
+    entry->map = map;
+    if (!map)
+        entry->users = 0;
+    pthread_cond_broadcast(&server->map_changed);
+    pthread_mutex_unlock(&server->lock);
+    return map ? entry : NULL;
+}
+
+served_map_t *find_served_map(server_t *server, config_t *config,
+                              int glyph_size) {
+    for (int i = 0; i < server->num_maps; i++) {
+        served_map_t *entry = &server->maps[i];
+        if ((entry->map || entry->building) &&
+            entry->glyph_size == glyph_size &&
+            entry->base_encoding == config->base_encoding &&
+            entry->order == config->glyph_map_order &&
+            strcmp(entry->font_file, config->font_file) == 0 &&
+            strcmp(entry->charset_file, config->charset_file) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// A free slot, or else the least recently used map that no request is using
+served_map_t *idle_served_map(server_t *server) {
+    served_map_t *oldest = NULL;
+    for (int i = 0; i < server->num_maps; i++) {
+        served_map_t *entry = &server->maps[i];
+        if (!entry->map && !entry->building)
+            return entry;
+        if (entry->map && entry->users == 0 &&
+            (!oldest || entry->last_used < oldest->last_used))
+            oldest = entry;
+    }
+    return oldest;
+}
+
+void release_served_map(server_t *server, served_map_t *entry) {
+    pthread_mutex_lock(&server->lock);
+    entry->users--;
+    pthread_cond_broadcast(&server->map_changed);
+    pthread_mutex_unlock(&server->lock);
+}
+
+int send_response(int fd, uint32_t status, const char *body, size_t size) {
+    uint8_t header[SERVE_RESPONSE_HEADER];
+    store_be32(header, status);
+    store_be32(header + 4, size);
+    if (write_full(fd, header, sizeof(header)) || write_full(fd, body, size))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+// Client of the daemon. Sends the image and settings of a config, and writes
+// the response like giko_trace.
+int giko_trace_remote(config_t config) {
+    // The daemon opens the font and charset from its own working directory
+    if (absolute_path(config.font_file) || absolute_path(config.charset_file))
+        return EXIT_FAILURE;
+
+    int from_stdin = strcmp(config.image_file, "-") == 0;
+    FILE *file = from_stdin ? stdin : fopen(config.image_file, "rb");
+    if (!file) {
+        perror(config.image_file);
+        return EXIT_FAILURE;
+    }
+    size_t image_size = 0;
+    uint8_t *image = read_stream(file, &image_size);
+    if (!from_stdin)
+        fclose(file);
+    if (!image)
+        return EXIT_FAILURE;
+
+    char *params = NULL;
+    size_t params_size = 0;
+    file = open_memstream(&params, &params_size);
+    if (!file) {
+        perror("Error allocating memory");
+        free(image);
+        return EXIT_FAILURE;
+    }
+    write_config(file, &config);
+    fclose(file);
+
+    int fd = connect_socket(config.socket_path);
+    if (fd < 0) {
+        perror(config.socket_path);
+        free(params);
+        free(image);
+        return EXIT_FAILURE;
+    }
+    uint8_t header[SERVE_REQUEST_HEADER];
+    memcpy(header, SERVE_MAGIC, 4);
+    store_be32(header + 4, params_size);
+    store_be32(header + 8, image_size);
+    uint8_t response[SERVE_RESPONSE_HEADER];
+    int failed = write_full(fd, header, sizeof(header)) ||
+                 write_full(fd, params, params_size) ||
+                 write_full(fd, image, image_size) ||
+                 read_full(fd, response, sizeof(response));
+    free(params);
+    free(image);
+
+    char *body = NULL;
+    uint32_t body_size = failed ? 0 : load_be32(response + 4);
+    if (!failed) {
+        body = malloc(body_size + 1);
+        failed = !body || read_full(fd, body, body_size);
+    }
+    close(fd);
+    if (failed) {
+        fprintf(stderr, "Error: no response from giko-traced at %s\n",
+                config.socket_path);
+        free(body);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_SUCCESS;
+    if (load_be32(response) != 0) {
+        fprintf(stderr, "giko-traced: %.*s\n", (int)body_size, body);
+        result = EXIT_FAILURE;
+    } else {
+        FILE *out = stdout;
+        if (strlen(config.output_file) > 0)
+            out = fopen(config.output_file, "w");
+        if (!out || fwrite(body, 1, body_size, out) != body_size) {
+            perror(config.output_file);
+            result = EXIT_FAILURE;
+        }
+        if (out && out != stdout)
+            fclose(out);
+    }
+    free(body);
+    return result;
+}
+
+int connect_socket(char *socket_path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Replace a path with its absolute path
+int absolute_path(char *path) {
+    char *resolved = realpath(path, NULL);
+    if (!resolved) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    snprintf(path, MAX_PATH_LEN, "%s", resolved);
+    free(resolved);
+    return EXIT_SUCCESS;
+}
+
+// Read a whole file into memory. Returns NULL on error or if it is empty.
+uint8_t *read_stream(FILE *file, size_t *size) {
+    size_t capacity = 64 * 1024;
+    uint8_t *buffer = malloc(capacity);
+    *size = 0;
+    while (buffer) {
+        *size += fread(buffer + *size, 1, capacity - *size, file);
+        if (*size < capacity)
+            break;
+        capacity *= 2;
+        uint8_t *grown = realloc(buffer, capacity);
+        if (!grown)
+            free(buffer);
+        buffer = grown;
+    }
+    if (!buffer) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    if (ferror(file) || *size == 0) {
+        fprintf(stderr, "Error reading image\n");
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Read exactly size bytes. Fails on end of file as well as on errors.
+int read_full(int fd, void *buffer, size_t size) {
+    uint8_t *bytes = buffer;
+    while (size > 0) {
+        ssize_t count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return EXIT_FAILURE;
+        bytes += count;
+        size -= count;
+    }
+    return EXIT_SUCCESS;
+}
+
+int write_full(int fd, const void *buffer, size_t size) {
+    const uint8_t *bytes = buffer;
+    while (size > 0) {
+        ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return EXIT_FAILURE;
+        bytes += count;
+        size -= count;
+    }
+    return EXIT_SUCCESS;
+}
+
+uint32_t load_be32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 |
+           (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+void store_be32(uint8_t *bytes, uint32_t value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
@@ -0,0 +1,134 @@
+#include "giko_trace.c"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WORKERS 0
+
+// Function prototypes
+void print_usage(const char *program_name);
+
+int main(int argc, char *argv[]) {
+    // Settings of requests default to those of giko-trace
+    config_t config = {"",
+                       "",
+                       "",
+                       "",
+                       DEFAULT_HEIGHT,
+                       DEFAULT_BASE_ENCODING,
+                       DEFAULT_SORT_ORDER,
+                       DEFAULT_CHUNKINESS,
+                       DEFAULT_ACCURACY,
+                       DEFAULT_DENOISE,
+                       DEFAULT_FIDELITY,
+                       DEFAULT_NEGATION,
+                       DEFAULT_WORKERS,
+                       DEFAULT_CACHE,
+                       "",
+                       DEFAULT_LAZY,
+                       DEFAULT_SEARCH,
+                       "",
+                       "",
+                       DEFAULT_STREAM,
+                       DEFAULT_FRAMES,
+                       DEFAULT_SEGMENTATION,
+                       DEFAULT_SHORTLIST,
+                       DEFAULT_MODE,
+                       DEFAULT_COLOR,
+                       "",
+                       DEFAULT_SCORE,
+                       "",
+                       DEFAULT_SWEEP_LIMIT,
+                       DEFAULT_STATS,
+                       "",
+                       DEFAULT_MAX_MAPS,
+                       DEFAULT_MAX_PIXELS};
+
+    static struct option long_options[] = {
+        {"socket", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"max-maps", required_argument, 0, 'M'},
+        {"max-pixels", required_argument, 0, 'p'},
+        {"cache-dir", required_argument, 0, 'D'},
+        {"no-cache", no_argument, 0, 'N'},
+        {"lazy", no_argument, 0, 'z'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    int option_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "s:t:M:p:D:Nzh", long_options,
+                              &option_index)) != -1) {
+        switch (opt) {
+        case 's':
+            strncpy(config.socket_path, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 0) {
+                fprintf(stderr, "Error: --threads must be positive, or 0 to "
+                                "use every CPU.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            config.max_maps = atoi(optarg);
+            if (config.max_maps < 1) {
+                fprintf(stderr, "Error: --max-maps must be at least 1.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            config.max_pixels = atol(optarg);
+            if (config.max_pixels < 1) {
+                fprintf(stderr, "Error: --max-pixels must be at least 1.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            strncpy(config.cache_dir, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'N':
+            config.cache = 0;
+            break;
+        case 'z':
+            config.lazy = 1;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    run_context = giko_new_context();
+    if (!run_context)
+        return EXIT_FAILURE;
+    int result = giko_serve(config);
+    giko_free_context(run_context);
+    return result;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -h, --help                    Print this message\n");
+    printf("  -s, --socket PATH             Path of the socket to listen on "
+           "(default: $XDG_RUNTIME_DIR/giko-traced.sock)\n");
+    printf("  -t, --threads NUMBER          Number of requests traced at once "
+           "(0 for every CPU, default: 0)\n");
+    printf("  -M, --max-maps NUMBER         Number of glyph maps kept in "
+           "memory (default: 32)\n");
+    printf("  -p, --max-pixels NUMBER       Largest image traced, in pixels "
+           "(default: 67108864)\n");
+    printf("  -D, --cache-dir PATH          Glyph map cache directory (default: "
+           "~/.cache/giko)\n");
+    printf("  -N, --no-cache                Always build glyph maps, without "
+           "the cache\n");
+    printf("  -z, --lazy                    Rasterize glyphs when they are "
+           "first searched\n");
+}